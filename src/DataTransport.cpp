@@ -0,0 +1,279 @@
+
+#include "DataTransport.h"
+#include "server.h"
+#include "threading.h"
+#include "log/log.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+int g_transportKind = TRANSPORT_SOCKET;
+
+std::shared_ptr<DataTransport> make_zerocopy_transport(ZSOCKET sock);
+std::shared_ptr<DataTransport> make_uring_transport(ZSOCKET sock);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// FrameBuffer
+
+FrameBuffer::~FrameBuffer()
+{
+	if (!m_external)
+		free(m_data);
+}
+
+/**
+	@brief Make sure the buffer can hold `capacity` bytes. Contents are not preserved.
+ */
+void FrameBuffer::Reserve(size_t capacity)
+{
+	if (capacity > m_capacity) {
+		free(m_data);
+
+		// Page aligned so the kernel can pin it for zero-copy sends
+		capacity = (capacity + 4095) & ~(size_t)4095;
+		if (posix_memalign((void**)&m_data, 4096, capacity) != 0) {
+			m_data = NULL;
+			m_capacity = 0;
+			throw std::bad_alloc();
+		}
+
+		m_capacity = capacity;
+	}
+
+	Reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// FramePool
+
+FramePool::~FramePool()
+{
+	for (auto buf : m_free)
+		delete buf;
+}
+
+std::shared_ptr<FrameBuffer> FramePool::Acquire(size_t capacity)
+{
+	FrameBuffer* buf = NULL;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Prefer a buffer that is already big enough
+		for (size_t i = 0; i < m_free.size(); i++) {
+			if (m_free[i]->Capacity() >= capacity || i + 1 == m_free.size()) {
+				buf = m_free[i];
+				m_free.erase(m_free.begin() + i);
+				break;
+			}
+		}
+	}
+
+	if (!buf)
+		buf = new FrameBuffer;
+
+	if (buf->Capacity() < capacity) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_onFree && buf->Capacity())
+			m_onFree(*buf);
+		buf->Reserve(capacity);
+		if (m_onAllocate)
+			m_onAllocate(*buf);
+	} else {
+		buf->Reset();
+	}
+
+	// Frames may be held (e.g. by analysis) after their transport is gone, so keep the pool alive
+	std::shared_ptr<FramePool> pool = shared_from_this();
+	return std::shared_ptr<FrameBuffer>(buf, [pool](FrameBuffer* b) { pool->Release(b); });
+}
+
+void FramePool::Release(FrameBuffer* buf)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_free.size() < m_maxFree) {
+		m_free.push_back(buf);
+	} else {
+		if (m_onFree)
+			m_onFree(*buf);
+		delete buf;
+	}
+}
+
+/**
+	@brief Install (or with empty functions, remove) the allocation hooks
+ */
+void FramePool::SetHooks(Hook onAllocate, Hook onFree)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_onAllocate = onAllocate;
+	m_onFree = onFree;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// DataTransport
+
+static double process_cpu_seconds()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+DataTransport::DataTransport(ZSOCKET sock)
+	: m_socket(sock)
+	, m_pool(std::make_shared<FramePool>())
+	, m_statsStartMs(get_ms())
+	, m_statsBytes(0)
+	, m_statsStartCpu(process_cpu_seconds())
+{
+}
+
+DataTransport::~DataTransport()
+{
+}
+
+std::shared_ptr<FrameBuffer> DataTransport::Acquire(size_t capacity)
+{
+	return m_pool->Acquire(capacity);
+}
+
+bool DataTransport::RecvAck(uint8_t& ack)
+{
+	return m_socket.RecvLooped(&ack, 1);
+}
+
+/**
+	@brief Unblock RecvAck() and fail any further sends
+ */
+void DataTransport::Shutdown()
+{
+	shutdown(m_socket, SHUT_RDWR);
+}
+
+/**
+	@brief Send bytes that are not part of a pooled frame, in order with frames
+ */
+bool DataTransport::SendRaw(const void* buf, size_t len)
+{
+	auto frame = Acquire(len);
+	memcpy(frame->Append(len), buf, len);
+	return Send(frame);
+}
+
+/**
+	@brief Track throughput and process CPU time per GB sent, logged every 10 seconds
+ */
+void DataTransport::AccountSent(size_t bytes)
+{
+	m_statsBytes += bytes;
+
+	uint64_t now = get_ms();
+	if (now - m_statsStartMs < 10000)
+		return;
+
+	double cpu = process_cpu_seconds();
+	double gb = m_statsBytes / 1e9;
+	double secs = (now - m_statsStartMs) / 1000.0;
+
+	if (gb > 0)
+		LogDebug("Data plane (%s): %.1f MB/s, %.2f CPU-s/GB\n", GetName(), gb * 1000 / secs, (cpu - m_statsStartCpu) / gb);
+
+	m_statsStartMs = now;
+	m_statsBytes = 0;
+	m_statsStartCpu = cpu;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SocketTransport
+
+bool SocketTransport::Send(std::shared_ptr<FrameBuffer> buf)
+{
+	std::lock_guard<std::mutex> lock(m_sendMutex);
+
+	if (!m_socket.SendLooped(buf->Data(), buf->Length()))
+		return false;
+
+	AccountSent(buf->Length());
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SendQueue
+
+SendQueue::SendQueue(size_t depth)
+	: m_depth(depth)
+	, m_stop(false)
+	, m_thread(&SendQueue::Run, this)
+{
+}
+
+SendQueue::~SendQueue()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_changed.notify_all();
+	m_thread.join();
+}
+
+void SendQueue::Push(std::shared_ptr<DataTransport> client, std::shared_ptr<FrameBuffer> buf)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_changed.wait(lock, [this] { return m_queue.size() < m_depth; });
+
+	m_queue.emplace_back(client, buf);
+	m_changed.notify_all();
+}
+
+void SendQueue::Run()
+{
+	apply_thread_policy("sender");
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		m_changed.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+		if (m_queue.empty())
+			return;
+
+		// Stays queued (and counted against the depth) until it is sent
+		item next = m_queue.front();
+		lock.unlock();
+
+		next.first->WaitOutstanding(m_depth - 1);
+		next.first->Send(next.second);
+		next = item();
+
+		lock.lock();
+		m_queue.pop_front();
+		m_changed.notify_all();
+	}
+}
+
+/**
+	@brief Create the transport selected with --transport, falling back towards plain sockets
+ */
+std::shared_ptr<DataTransport> make_data_transport(ZSOCKET sock)
+{
+	std::shared_ptr<DataTransport> transport;
+
+	#ifdef __linux__
+	if (g_transportKind == TRANSPORT_URING)
+		transport = make_uring_transport(sock);
+
+	if (!transport && g_transportKind != TRANSPORT_SOCKET)
+		transport = make_zerocopy_transport(sock);
+	#endif
+
+	if (!transport)
+		transport = std::make_shared<SocketTransport>(sock);
+
+	LogVerbose("Data plane transport: %s\n", transport->GetName());
+	return transport;
+}
@@ -0,0 +1,228 @@
+
+#ifndef DataTransport_h
+#define DataTransport_h
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+
+#include "xptools/Socket.h"
+
+/**
+	@brief One data plane message, built in place and handed to a DataTransport to send
+
+	The message grows up from the start of the buffer. Scratch space that belongs to the frame but
+	is not sent (e.g. raw samples of channels the client did not subscribe to) is carved from the
+	top of the buffer, so everything derived from one capture shares a single allocation.
+ */
+class FrameBuffer
+{
+public:
+	FrameBuffer() : m_data(NULL), m_capacity(0), m_length(0), m_scratchTop(0), m_index(-1), m_external(false) {}
+	FrameBuffer(uint8_t* data, size_t capacity, int index)
+		: m_data(data), m_capacity(capacity), m_length(0), m_scratchTop(capacity), m_index(index), m_external(true) {}
+	~FrameBuffer();
+
+	uint8_t* Data() { return m_data; }
+	size_t Length() const { return m_length; }
+	size_t Capacity() const { return m_capacity; }
+
+	// Slot this buffer is registered in with the transport, or -1
+	int GetIndex() const { return m_index; }
+	void SetIndex(int index) { m_index = index; }
+
+	void Reset() { m_length = 0; m_scratchTop = m_capacity; }
+	void Reserve(size_t capacity);
+
+	uint8_t* Append(size_t n)
+	{
+		uint8_t* p = m_data + m_length;
+		m_length += n;
+		return p;
+	}
+
+	template<typename T> void Put(const T& value)
+	{
+		memcpy(Append(sizeof(T)), &value, sizeof(T));
+	}
+
+	uint8_t* Scratch(size_t n)
+	{
+		m_scratchTop -= n;
+		return m_data + m_scratchTop;
+	}
+
+	// Hand back all scratch space, once nothing still uses it
+	void ReleaseScratch() { m_scratchTop = m_capacity; }
+
+	// Give back message space that was reserved but not used
+	void Truncate(size_t length) { m_length = length; }
+
+	// Room left between the message and the scratch area
+	size_t Available() const { return m_scratchTop - m_length; }
+
+protected:
+	uint8_t* m_data;
+	size_t m_capacity;
+	size_t m_length;
+	size_t m_scratchTop;
+	int m_index;
+
+	// Memory belongs to someone else (e.g. a shared memory slot)
+	bool m_external;
+};
+
+/**
+	@brief Recycles FrameBuffers so steady-state capture does no large allocations
+ */
+class FramePool : public std::enable_shared_from_this<FramePool>
+{
+public:
+	FramePool(size_t maxFree = 8) : m_maxFree(maxFree) {}
+	~FramePool();
+
+	std::shared_ptr<FrameBuffer> Acquire(size_t capacity);
+
+	typedef std::function<void(FrameBuffer&)> Hook;
+	void SetHooks(Hook onAllocate, Hook onFree);
+
+protected:
+	void Release(FrameBuffer* buf);
+
+	std::mutex m_mutex;
+
+	// Called whenever a buffer's storage is (re)allocated, and before it is freed
+	Hook m_onAllocate;
+	Hook m_onFree;
+
+	std::vector<FrameBuffer*> m_free;
+	size_t m_maxFree;
+};
+
+// Sent in place of a frame's seqnum to mark a data plane message that is not a waveform. A u8
+// message_type follows.
+static const uint32_t MESSAGE_TAG = 0xFFFFFFFF;
+
+enum message_type {
+	MESSAGE_HISTOGRAM = 1,
+	MESSAGE_SPECTRUM = 2,
+	MESSAGE_FRAME_BEGIN = 3,
+	MESSAGE_FRAME_CHUNK = 4,
+	MESSAGE_FRAME_END = 5,
+	MESSAGE_BUS = 6,
+	MESSAGE_RANGE = 7,
+	MESSAGE_EDGES = 8,
+	MESSAGE_BATCH = 9
+};
+
+extern int g_shmListener;
+extern std::string g_shmSocketName;
+
+enum transport_kind {
+	TRANSPORT_SOCKET,
+	TRANSPORT_ZEROCOPY,
+	TRANSPORT_URING
+};
+
+extern int g_transportKind;
+
+/**
+	@brief Connection to one data plane client
+
+	Frames go out through Send(), which takes a reference on the buffer until the kernel is done with
+	it. Acks ('K') come back through RecvAck() on the client's thread.
+ */
+class DataTransport
+{
+public:
+	DataTransport(ZSOCKET sock);
+	virtual ~DataTransport();
+
+	virtual const char* GetName() = 0;
+
+	virtual std::shared_ptr<FrameBuffer> Acquire(size_t capacity);
+	virtual bool Send(std::shared_ptr<FrameBuffer> buf) = 0;
+
+	virtual bool RecvAck(uint8_t& ack);
+	virtual void Shutdown();
+
+	// Block until the transport holds at most `count` sent messages it has not finished with.
+	// Only transports whose Send() returns before the data has gone out have anything to wait for.
+	virtual void WaitOutstanding(size_t count) { (void)count; }
+
+	// Arguments that follow some requests
+	virtual bool RecvArgs(void* buf, size_t len) { return m_socket.RecvLooped((uint8_t*)buf, len); }
+
+	// Give up the socket without closing it
+	ZSOCKET Release() { return m_socket.Detach(); }
+
+	bool SendRaw(const void* buf, size_t len);
+
+protected:
+	void AccountSent(size_t bytes);
+
+	Socket m_socket;
+	std::shared_ptr<FramePool> m_pool;
+
+	// Frames may be sent from more than one thread
+	std::mutex m_sendMutex;
+
+	// Send statistics, reported every 10 s
+	uint64_t m_statsStartMs;
+	uint64_t m_statsBytes;
+	double m_statsStartCpu;
+};
+
+/**
+	@brief Plain blocking send() path, the default
+ */
+class SocketTransport : public DataTransport
+{
+public:
+	SocketTransport(ZSOCKET sock) : DataTransport(sock) {}
+
+	virtual const char* GetName() { return "socket"; }
+	virtual bool Send(std::shared_ptr<FrameBuffer> buf);
+};
+
+/**
+	@brief Sends messages from a thread of its own, so the producer can carry on building the next one
+
+	At most `depth` messages wait at a time, and a message is only handed to the transport once the
+	transport holds fewer than `depth` unfinished sends. Push() blocks while the queue is full, so
+	the memory held by a frame that is being streamed out in pieces stays bounded even when Send()
+	returns as soon as a send is queued.
+ */
+class SendQueue
+{
+public:
+	SendQueue(size_t depth);
+	~SendQueue();
+
+	void Push(std::shared_ptr<DataTransport> client, std::shared_ptr<FrameBuffer> buf);
+
+protected:
+	void Run();
+
+	typedef std::pair<std::shared_ptr<DataTransport>, std::shared_ptr<FrameBuffer>> item;
+
+	size_t m_depth;
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	std::deque<item> m_queue;
+	bool m_stop;
+	std::thread m_thread;
+};
+
+std::shared_ptr<DataTransport> make_data_transport(ZSOCKET sock);
+std::shared_ptr<DataTransport> make_shm_transport(ZSOCKET sock);
+bool open_shm_listener(int port);
+
+#endif // DataTransport_h
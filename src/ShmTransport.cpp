@@ -0,0 +1,338 @@
+
+/*
+	Shared memory data plane for clients on the same host.
+
+	A client that learns the socket name from DATA:SHM? connects to it instead of the TCP data port.
+	The bridge shares a memfd holding a ring of frame slots (passed with SCM_RIGHTS) and frames are
+	built directly in the slots. Each frame is announced with a shm_message doorbell on the UNIX
+	socket; the client hands the slot back with 'R' + slot index once it has consumed it, and asks
+	for the next waveform with 'K' exactly as on TCP. The bytes in a slot are the same message the
+	TCP transport would send.
+ */
+
+#include "DataTransport.h"
+#include "log/log.h"
+
+int g_shmListener = -1;
+std::string g_shmSocketName;
+
+#ifdef __linux__
+
+#include <condition_variable>
+#include <chrono>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Doorbell from bridge to client
+struct shm_message {
+	uint32_t type;
+	uint32_t slot;		// SHM_RING: slot count
+	uint64_t offset;	// of the frame within the memfd
+	uint64_t length;	// SHM_RING: slot size; SHM_FRAME: message length
+};
+
+enum shm_message_type {
+	SHM_RING = 1,		// a new ring replaces the old one; memfd attached
+	SHM_FRAME = 2
+};
+
+static const unsigned SHM_SLOTS = 4;
+
+// How long Send() waits for the client to give back a slot
+static const int SHM_SLOT_TIMEOUT_MS = 1000;
+
+/**
+	@brief One memfd mapping and the ownership state of its slots
+
+	Kept alive by every frame that lives in it, so a ring replaced while frames are still held (e.g.
+	by analysis) is only unmapped once they are all released.
+ */
+struct ShmRing {
+	ShmRing() : memfd(-1), base((uint8_t*)MAP_FAILED), slotSize(0), mapSize(0) {}
+	~ShmRing()
+	{
+		if (base != MAP_FAILED)
+			munmap(base, mapSize);
+		if (memfd >= 0)
+			close(memfd);
+	}
+
+	bool Idle()
+	{
+		for (unsigned i = 0; i < SHM_SLOTS; i++) {
+			if (bridgeHeld[i] || clientHeld[i])
+				return false;
+		}
+		return true;
+	}
+
+	int memfd;
+	uint8_t* base;
+	size_t slotSize;
+	size_t mapSize;
+
+	// Guarded by ShmSync::mutex
+	bool bridgeHeld[SHM_SLOTS] = {};
+	bool clientHeld[SHM_SLOTS] = {};
+};
+
+/**
+	@brief Slot bookkeeping lock, shared with frames so they can be released after the transport is gone
+ */
+struct ShmSync {
+	std::mutex mutex;
+	std::condition_variable released;
+};
+
+class ShmTransport : public DataTransport
+{
+public:
+	ShmTransport(ZSOCKET sock) : DataTransport(sock), m_sync(std::make_shared<ShmSync>()) {}
+	virtual ~ShmTransport() {}
+
+	virtual const char* GetName() { return "shm"; }
+
+	virtual std::shared_ptr<FrameBuffer> Acquire(size_t capacity);
+	virtual bool Send(std::shared_ptr<FrameBuffer> buf);
+	virtual bool RecvAck(uint8_t& ack);
+
+protected:
+	std::shared_ptr<ShmRing> CreateRing(size_t slotSize);
+	int FindFreeSlot();
+	std::shared_ptr<FrameBuffer> WrapSlot(int slot);
+	bool SendDoorbell(const shm_message& msg, int fd);
+
+	std::shared_ptr<ShmSync> m_sync;
+	std::shared_ptr<ShmRing> m_ring;
+	bool m_ringAnnounced = false;
+};
+
+std::shared_ptr<ShmRing> ShmTransport::CreateRing(size_t slotSize)
+{
+	auto ring = std::make_shared<ShmRing>();
+
+	ring->slotSize = (slotSize + 4095) & ~(size_t)4095;
+	ring->mapSize = ring->slotSize * SHM_SLOTS;
+
+	ring->memfd = memfd_create("scopehal-sigrok-bridge", MFD_CLOEXEC);
+	if (ring->memfd < 0 || ftruncate(ring->memfd, ring->mapSize) != 0) {
+		LogError("Failed to create shared memory ring (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	ring->base = (uint8_t*)mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+	if (ring->base == MAP_FAILED) {
+		LogError("Failed to map shared memory ring (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	LogDebug("Shared memory ring: %u slots of %zu bytes\n", SHM_SLOTS, ring->slotSize);
+	return ring;
+}
+
+// Call with m_sync->mutex held
+int ShmTransport::FindFreeSlot()
+{
+	for (unsigned i = 0; i < SHM_SLOTS; i++) {
+		if (!m_ring->bridgeHeld[i] && !m_ring->clientHeld[i])
+			return i;
+	}
+	return -1;
+}
+
+// Call with m_sync->mutex held
+std::shared_ptr<FrameBuffer> ShmTransport::WrapSlot(int slot)
+{
+	std::shared_ptr<ShmRing> ring = m_ring;
+	ring->bridgeHeld[slot] = true;
+
+	auto buf = new FrameBuffer(ring->base + slot * ring->slotSize, ring->slotSize, slot);
+	std::shared_ptr<ShmSync> sync = m_sync;
+	return std::shared_ptr<FrameBuffer>(buf, [sync, ring, slot](FrameBuffer* b) {
+		{
+			std::lock_guard<std::mutex> lock(sync->mutex);
+			ring->bridgeHeld[slot] = false;
+		}
+		sync->released.notify_all();
+		delete b;
+	});
+}
+
+/**
+	@brief Hand out a free slot to build a frame in, or heap memory if none is free or big enough
+ */
+std::shared_ptr<FrameBuffer> ShmTransport::Acquire(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(m_sync->mutex);
+
+	// Grow the ring when frames get bigger, but only once nothing refers to the old one
+	if ((!m_ring || m_ring->slotSize < capacity) && (!m_ring || m_ring->Idle())) {
+		auto ring = CreateRing(capacity + capacity / 4);
+		if (ring) {
+			m_ring = ring;
+			m_ringAnnounced = false;
+		}
+	}
+
+	if (m_ring && m_ring->slotSize >= capacity) {
+		int slot = FindFreeSlot();
+		if (slot >= 0)
+			return WrapSlot(slot);
+	}
+
+	return DataTransport::Acquire(capacity);
+}
+
+bool ShmTransport::SendDoorbell(const shm_message& msg, int fd)
+{
+	iovec iov = {(void*)&msg, sizeof(msg)};
+
+	msghdr hdr = {};
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	if (fd >= 0) {
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+
+		cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+
+	return sendmsg(m_socket, &hdr, MSG_NOSIGNAL) == sizeof(msg);
+}
+
+bool ShmTransport::Send(std::shared_ptr<FrameBuffer> buf)
+{
+	std::lock_guard<std::mutex> lock(m_sendMutex);
+	std::unique_lock<std::mutex> slotLock(m_sync->mutex);
+
+	std::shared_ptr<ShmRing> ring = m_ring;
+	int slot = buf->GetIndex();
+	bool inRing = ring && slot >= 0 && buf->Data() == ring->base + slot * ring->slotSize;
+
+	if (!inRing) {
+		// Built outside the ring (no slot was free or big enough), so it has to be copied in
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_SLOT_TIMEOUT_MS);
+		for (;;) {
+			if (m_ring && m_ring->slotSize < buf->Length() && m_ring->Idle())
+				m_ring = NULL;
+			if (!m_ring) {
+				m_ring = CreateRing(buf->Length() + buf->Length() / 4);
+				m_ringAnnounced = false;
+				if (!m_ring)
+					return false;
+			}
+
+			if (m_ring->slotSize >= buf->Length() && (slot = FindFreeSlot()) >= 0)
+				break;
+
+			if (m_sync->released.wait_until(slotLock, deadline) == std::cv_status::timeout) {
+				LogWarning("Shared memory client is not releasing slots, dropping frame\n");
+				return false;
+			}
+		}
+
+		ring = m_ring;
+		memcpy(ring->base + slot * ring->slotSize, buf->Data(), buf->Length());
+	}
+
+	if (!m_ringAnnounced) {
+		shm_message announce = {SHM_RING, SHM_SLOTS, 0, ring->slotSize};
+		if (!SendDoorbell(announce, ring->memfd))
+			return false;
+		m_ringAnnounced = true;
+	}
+
+	ring->clientHeld[slot] = true;
+	slotLock.unlock();
+
+	shm_message doorbell = {SHM_FRAME, (uint32_t)slot, slot * ring->slotSize, buf->Length()};
+	if (!SendDoorbell(doorbell, -1))
+		return false;
+
+	AccountSent(buf->Length());
+	return true;
+}
+
+/**
+	@brief Wait for the next 'K', handling slot releases that arrive in between
+ */
+bool ShmTransport::RecvAck(uint8_t& ack)
+{
+	for (;;) {
+		if (!m_socket.RecvLooped(&ack, 1))
+			return false;
+
+		if (ack != 'R')
+			return true;
+
+		uint32_t slot;
+		if (!m_socket.RecvLooped((uint8_t*)&slot, sizeof(slot)))
+			return false;
+
+		{
+			std::lock_guard<std::mutex> lock(m_sync->mutex);
+			if (m_ring && slot < SHM_SLOTS)
+				m_ring->clientHeld[slot] = false;
+		}
+		m_sync->released.notify_all();
+	}
+}
+
+std::shared_ptr<DataTransport> make_shm_transport(ZSOCKET sock)
+{
+	return std::make_shared<ShmTransport>(sock);
+}
+
+/**
+	@brief Listen for shared memory clients on an abstract UNIX socket named after the data port
+ */
+bool open_shm_listener(int port)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	char name[64];
+	snprintf(name, sizeof(name), "scopehal-sigrok-bridge-%d", port);
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	// Leading NUL: abstract namespace, nothing to clean up on disk
+	strncpy(addr.sun_path + 1, name, sizeof(addr.sun_path) - 2);
+	socklen_t len = offsetof(sockaddr_un, sun_path) + 1 + strlen(name);
+
+	if (bind(fd, (sockaddr*)&addr, len) != 0 || listen(fd, 1) != 0) {
+		LogWarning("Shared memory transport unavailable (%s)\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	g_shmListener = fd;
+	g_shmSocketName = std::string("@") + name;
+	LogDebug("Shared memory clients can connect to %s\n", g_shmSocketName.c_str());
+	return true;
+}
+
+#else
+
+std::shared_ptr<DataTransport> make_shm_transport(ZSOCKET)
+{
+	return NULL;
+}
+
+bool open_shm_listener(int)
+{
+	return false;
+}
+
+#endif // __linux__
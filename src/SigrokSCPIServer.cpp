@@ -2,6 +2,19 @@
 #include "server.h"
 #include "SigrokSCPIServer.h"
 #include "srbinding.h"
+#include "calibration.h"
+#include "averaging.h"
+#include "persistence.h"
+#include "spectrum.h"
+#include "retain.h"
+#include "asynclog.h"
+#include "measure.h"
+#include "masktest.h"
+#include "autotune.h"
+#include "delta.h"
+#include "bwfilter.h"
+#include "DataTransport.h"
+#include "devicequeue.h"
 
 using namespace std;
 
@@ -26,13 +39,15 @@ bool SigrokSCPIServer::GetChannelID(const std::string& subject, size_t& id_out)
 {
 	int result;
 
-	if (subject.size() == 1) {
+	if (subject.empty()) {
+		return false;
+	} else if (subject.size() == 1) {
 		result = subject[0] - '0';
 	} else {
 		result = 10 + (subject[1] - '0');
 	}
 
-	if (result < 0 || result > (int)GetAnalogChannelCount()) {
+	if (result < 0 || result >= (int)GetAnalogChannelCount()) {
 		return false;
 	}
 
@@ -56,6 +71,147 @@ bool SigrokSCPIServer::OnQuery(
 	if(BridgeSCPIServer::OnQuery(line, subject, cmd))
 		return true;
 
+	size_t channelId;
+
+	if (subject == "CAL" && cmd == "FORMAT") {
+		if (g_sampleFormat == SAMPLE_CAL_I16)
+			SendReply("INT16");
+		else if (g_sampleFormat == SAMPLE_CAL_F32)
+			SendReply("FLOAT");
+		else
+			SendReply("RAW");
+		return true;
+	} else if (subject == "DATA" && cmd == "MASK") {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "0x%lx", (uint64_t)g_channelMask);
+		SendReply(buf);
+		return true;
+	} else if (subject == "AVG" && cmd == "COUNT") {
+		SendReply(to_string(avg_get_count()));
+		return true;
+	} else if (subject == "PERSIST" && cmd == "COLS") {
+		SendReply(to_string(persist_get_columns()));
+		return true;
+	} else if (subject == "PERSIST" && cmd == "COUNT") {
+		// Captures in the histograms so far
+		SendReply(to_string(persist_frames()));
+		return true;
+	} else if (subject == "FFT" && cmd == "ENABLE") {
+		SendReply(spectrum_enabled() ? "1" : "0");
+		return true;
+	} else if (subject == "FFT" && cmd == "AVG") {
+		SendReply(to_string(spectrum_get_average()));
+		return true;
+	} else if (subject == "FFT" && cmd == "RATE") {
+		// Captures transformed per second
+		SendReply(to_string(spectrum_rate()));
+		return true;
+	} else if (subject == "DATA" && cmd == "CHUNK") {
+		SendReply(to_string(g_chunkSamples));
+		return true;
+	} else if (subject == "DATA" && cmd == "DELTA") {
+		SendReply(delta_enabled() ? "1" : "0");
+		return true;
+	} else if (subject == "DATA" && cmd == "KEYFRAME") {
+		SendReply(to_string(delta_get_keyframe_interval()));
+		return true;
+	} else if (subject == "DATA" && cmd == "BATCH") {
+		SendReply(to_string(g_batchFrames));
+		return true;
+	} else if (subject == "DATA" && cmd == "BATCHWAIT") {
+		SendReply(to_string(g_batchWaitMs));
+		return true;
+	} else if (subject == "DATA" && cmd == "LAYOUT") {
+		int layout = g_logicLayout;
+		SendReply(layout == LAYOUT_BUS ? "BUS" : layout == LAYOUT_EDGES ? "EDGES" : "CHANNEL");
+		return true;
+	} else if (subject == "TUNE" && cmd == "ENABLE") {
+		SendReply(tune_enabled() ? "1" : "0");
+		return true;
+	} else if (subject == "TUNE" && cmd == "TARGET") {
+		SendReply(to_string(tune_get_target()));
+		return true;
+	} else if (subject == "TUNE" && cmd == "SPAN") {
+		SendReply(to_string(tune_get_span()));
+		return true;
+	} else if (subject == "TUNE" && cmd == "STATE") {
+		// "rate,depth,wfm/s": the tuner's current setting and the update rate it last measured
+		SendReply(tune_state());
+		return true;
+	} else if (subject == "RLE" && cmd == "ENABLE") {
+		SendReply(g_rle ? "1" : "0");
+		return true;
+	} else if (subject == "DATA" && cmd == "EDGES:RATIO") {
+		// Effective compression of EDGES layout frames: logic bytes captured per byte sent
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.2f", edge_compression());
+		SendReply(buf);
+		return true;
+	} else if (subject == "RETAIN" && cmd == "COUNT") {
+		SendReply(to_string(retain_get_count()));
+		return true;
+	} else if (subject == "RETAIN" && cmd == "LIST") {
+		// Seqnums of the captures that can be queried, oldest first
+		string reply;
+		for (uint32_t seqnum : retain_seqnums())
+			reply += (reply.empty() ? "" : ",") + to_string(seqnum);
+		SendReply(reply);
+		return true;
+	} else if (subject == "MEAS" && cmd == "RATE") {
+		// Captures measured per second
+		SendReply(to_string(meas_rate()));
+		return true;
+	} else if (subject == "MEAS" && cmd == "DROPPED") {
+		// Captures that arrived while the measurement thread was busy
+		SendReply(to_string(meas_dropped()));
+		return true;
+	} else if (GetChannelID(subject, channelId) && cmd.compare(0, 5, "MEAS:") == 0) {
+		// "last,min,max,mean,count" of one of the channel's measurements
+		int type;
+		if (!meas_parse_type(cmd.substr(5), type))
+			return false;
+		SendReply(meas_query(channelId, type));
+		return true;
+	} else if (subject == "MASK" && cmd == "ENABLE") {
+		SendReply(mask_enabled() ? "1" : "0");
+		return true;
+	} else if (subject == "MASK" && cmd == "COUNT") {
+		// "pass,fail,total" captures since MASK:RESET
+		uint64_t pass, fail, total;
+		mask_counts(pass, fail, total);
+		SendReply(to_string(pass) + "," + to_string(fail) + "," + to_string(total));
+		return true;
+	} else if (subject == "MASK" && cmd == "FAILS") {
+		// Seqnums of the failing captures kept for range queries
+		string reply;
+		for (uint32_t seqnum : retain_pinned_seqnums())
+			reply += (reply.empty() ? "" : ",") + to_string(seqnum);
+		SendReply(reply);
+		return true;
+	} else if (subject == "BWLIMIT" && cmd == "TYPE") {
+		SendReply(bw_get_type() == BW_IIR ? "IIR" : "FIR");
+		return true;
+	} else if (GetChannelID(subject, channelId) && cmd == "BWLIMIT") {
+		SendReply(to_string(bw_get_limit(channelId)));
+		return true;
+	} else if (GetChannelID(subject, channelId) && cmd == "MASK:FAIL") {
+		// Failing captures in which this channel was outside its envelope
+		SendReply(to_string(mask_channel_failures(channelId)));
+		return true;
+	} else if (subject == "LOG" && cmd == "DROPPED") {
+		// Log messages lost because the logger thread fell behind
+		SendReply(to_string(g_asyncLog ? g_asyncLog->GetDropped() : 0));
+		return true;
+	} else if (subject == "DATA" && cmd == "SHM") {
+		// Local clients may connect here instead of the TCP data port
+		SendReply(g_shmListener >= 0 ? g_shmSocketName.c_str() : "NONE");
+		return true;
+	} else if (GetChannelID(subject, channelId) && cmd == "CAL" && g_deviceIsScope) {
+		// Whether the channel has a calibration table for its present vdiv
+		SendReply(cal_have_table(channelId) ? "1" : "0");
+		return true;
+	}
+
 	//TODO: handle commands not implemented by the base class
 	LogWarning("Unrecognized query received: %s\n", line.c_str());
 
@@ -97,46 +253,24 @@ size_t SigrokSCPIServer::GetAnalogChannelCount()
 
 vector<size_t> SigrokSCPIServer::GetSampleRates()
 {
-	vector<uint64_t> rate_options = get_dev_config_options<uint64_t>(g_sr_device, SR_CONF_SAMPLERATE);
-
-	return rate_options;
+	return g_rate_options;
 }
 
 vector<size_t> SigrokSCPIServer::GetSampleDepths()
 {
-
-	vector<size_t> muls {
-		10,
-		25,
-		50,
-	};
-
+	// Reported hardware depth limit is astonishing; g_maxDepth is what actually works (5MS unless
+	// probed with --probe-depths, beyond which libsigrok4DSL tends to fail with LIBUSB_ERROR_NO_MEM).
+	// Hardware RLE raises it.
 	vector<size_t> result;
-	size_t d = 10;
-	while (d) {
-		for (auto m : muls) {
-			auto opt = d*m;
-
-			if (!g_deviceIsScope && opt <= 1000) {
-				// DSLogic won't actually take captures under 2.5kS
-				// There doesn't seem to be any way to get the sample depth
-				// options programmatically...
-				continue;
-			}
-
-			if (opt > g_hw_depth || opt > 5000000) {
-				// Reported hardware depth limit is astonishing.
-				// I can't configure it above 5MS on my laptop without getting
-				// a LIBUSB_ERROR_NO_MEM inside libsigrok4DSL, so arbitrary
-				// limit there for now.
-				d = 0;
-				break;
-			}
-
-			result.push_back(opt);
+	for (uint64_t opt : sample_depth_steps(max_capture_depth())) {
+		if (!g_deviceIsScope && opt <= 1000) {
+			// DSLogic won't actually take captures under 2.5kS
+			// There doesn't seem to be any way to get the sample depth
+			// options programmatically...
+			continue;
 		}
 
-		d *= 10;
+		result.push_back(opt);
 	}
 
 	return result;
@@ -172,6 +306,282 @@ bool SigrokSCPIServer::OnCommand(
 			}
 			else
 				goto unknown;
+		} else if (cmd == "CAL:POINT" && channelType == CH_ANALOG && args.size() == 1) {
+			// The channel's input is at a known reference voltage; record it against the ADC code
+			double volts;
+			if (!ParseDouble(args[0], volts))
+				goto unknown;
+
+			cal_begin_point(channelId, volts);
+			LogDebug("Recording calibration point for %s at %f V\n", subject.c_str(), volts);
+			return true;
+		} else if (cmd == "CAL:BUILD" && channelType == CH_ANALOG) {
+			cal_build_table(channelId);
+			return true;
+		} else if (cmd == "MEAS:ADD" && args.size() == 1) {
+			// Take a measurement on every capture of this channel from now on
+			int type;
+			if (!meas_parse_type(args[0], type))
+				goto unknown;
+			if (channelType == CH_DIGITAL && type != MEAS_FREQ && type != MEAS_DUTY)
+				goto unknown;
+
+			meas_add(channelId, type);
+			LogDebug("Measuring %s on %s\n", args[0].c_str(), subject.c_str());
+			return true;
+		} else if (cmd == "MEAS:CLEAR") {
+			meas_clear(channelId);
+			return true;
+		} else if (cmd == "BWLIMIT" && channelType == CH_ANALOG && args.size() == 1) {
+			// Low-pass cutoff in Hz, applied in the bridge; 0 for full bandwidth
+			double hz;
+			if (!ParseDouble(args[0], hz) || hz < 0)
+				goto unknown;
+
+			bw_set_limit(channelId, hz);
+			LogDebug("Updated BWLIMIT for %s, now %.0f Hz\n", subject.c_str(), hz);
+			return true;
+		} else if ((cmd == "MASK:LOWER" || cmd == "MASK:UPPER") && channelType == CH_ANALOG && args.size() == 1) {
+			// ADC code envelope, two hex digits per point
+			if (!mask_set_envelope(channelId, cmd == "MASK:UPPER", args[0]))
+				goto unknown;
+
+			LogDebug("Updated %s for %s (%zu points)\n", cmd.c_str(), subject.c_str(), args[0].size() / 2);
+			return true;
+		} else if (cmd == "MASK:CLEAR" && channelType == CH_ANALOG) {
+			mask_clear(channelId);
+			return true;
+		} else if (cmd == "CAL:CLEAR" && channelType == CH_ANALOG) {
+			clear_calibration(channelId);
+			return true;
+		}
+	}
+
+	if (subject == "CAL") {
+		if (cmd == "FORMAT" && args.size() == 1) {
+			if (args[0] == "RAW")
+				g_sampleFormat = SAMPLE_RAW;
+			else if (args[0] == "INT16")
+				g_sampleFormat = SAMPLE_CAL_I16;
+			else if (args[0] == "FLOAT")
+				g_sampleFormat = SAMPLE_CAL_F32;
+			else
+				goto unknown;
+
+			// The client's delta reference was sent in the old format
+			delta_reset();
+			LogDebug("Data plane sample format now %s\n", args[0].c_str());
+			return true;
+		} else if (cmd == "SAVE") {
+			save_calibration(args.empty() ? g_calPath : args[0]);
+			return true;
+		}
+	}
+
+	if (subject == "DATA" && cmd == "MASK" && args.size() == 1) {
+		// Bitmask of hardware channels the client wants on the data plane (0x prefix for hex)
+		char* end;
+		uint64_t mask = strtoull(args[0].c_str(), &end, 0);
+		if (end == args[0].c_str())
+			goto unknown;
+
+		g_channelMask = mask;
+		LogDebug("Data plane channel mask now 0x%lx\n", mask);
+		return true;
+	}
+
+	if (subject == "DATA" && cmd == "CHUNK" && args.size() == 1) {
+		// Stream frames deeper than this many samples in pieces of this size; 0 sends whole frames
+		double samples;
+		if (!ParseDouble(args[0], samples) || samples < 0 || samples > CHUNK_MAX_SAMPLES)
+			goto unknown;
+
+		g_chunkSamples = samples;
+		delta_reset();
+		LogDebug("Data plane chunk size now %zu samples\n", (size_t)g_chunkSamples);
+		return true;
+	}
+
+	if (subject == "DATA" && (cmd == "DELTA" || cmd == "KEYFRAME") && args.size() == 1 && g_deviceIsScope) {
+		// DELTA: RAW analog channels as deltas against the previous frame (SAMPLE_DELTA_U8);
+		// KEYFRAME: every this many frames carry full samples
+		double value;
+		if (!ParseDouble(args[0], value) || value < 0)
+			goto unknown;
+
+		value = std::min(value, (double)DELTA_MAX_KEYFRAME_INTERVAL);
+		if (cmd == "DELTA")
+			delta_set_enabled(value != 0);
+		else
+			delta_set_keyframe_interval(value);
+
+		LogDebug("Data plane %s now %u\n", cmd.c_str(), (unsigned)value);
+		return true;
+	}
+
+	if (subject == "DATA" && (cmd == "BATCH" || cmd == "BATCHWAIT") && args.size() == 1) {
+		// BATCH: frames sent together as one MESSAGE_BATCH (0 or 1 sends each alone);
+		// BATCHWAIT: longest a batch stays open waiting for more, in ms
+		double value;
+		if (!ParseDouble(args[0], value) || value < 0)
+			goto unknown;
+
+		if (cmd == "BATCH") {
+			if (value > BATCH_MAX_FRAMES)
+				goto unknown;
+			g_batchFrames = value;
+		} else {
+			value = std::min(value, (double)BATCH_MAX_WAIT_MS);
+			g_batchWaitMs = value;
+		}
+
+		LogDebug("Data plane %s now %u\n", cmd.c_str(), (unsigned)value);
+		return true;
+	}
+
+	if (subject == "DATA" && cmd == "LAYOUT" && args.size() == 1 && !g_deviceIsScope) {
+		// BUS: one word per sample holding every sent channel (MESSAGE_BUS); EDGES: level change
+		// positions per channel (MESSAGE_EDGES); CHANNEL: the usual frames
+		if (args[0] == "BUS")
+			g_logicLayout = LAYOUT_BUS;
+		else if (args[0] == "EDGES")
+			g_logicLayout = LAYOUT_EDGES;
+		else if (args[0] == "CHANNEL")
+			g_logicLayout = LAYOUT_CHANNEL;
+		else
+			goto unknown;
+
+		LogDebug("Data plane layout now %s\n", args[0].c_str());
+		return true;
+	}
+
+	if (subject == "TUNE" && args.size() == 1) {
+		double value;
+		if (!ParseDouble(args[0], value))
+			goto unknown;
+
+		if (cmd == "ENABLE") {
+			tune_set_enabled(value != 0);
+			LogDebug("Auto-tuning %s\n", value != 0 ? "on" : "off");
+			return true;
+		} else if (cmd == "TARGET" && value > 0) {
+			// Waveforms per second the client wants
+			tune_set_target(value);
+			return true;
+		} else if (cmd == "SPAN" && value >= 0) {
+			// Shortest time every capture must cover, in seconds
+			tune_set_span(value);
+			return true;
+		}
+	}
+
+	if (subject == "RLE" && cmd == "ENABLE" && args.size() == 1 && !g_deviceIsScope) {
+		// Hardware run-length compression; sparse captures then also suit DATA:LAYOUT EDGES
+		double value;
+		if (!ParseDouble(args[0], value))
+			goto unknown;
+
+		bool enable = value != 0;
+		device_submit(device_key(DEVICE_RLE), [=]() {
+			if (set_rle(enable))
+				LogDebug("Hardware RLE now %s\n", enable ? "on" : "off");
+			else
+				LogWarning("Device can't turn hardware RLE %s\n", enable ? "on" : "off");
+		});
+		return true;
+	}
+
+	if (subject == "RETAIN" && cmd == "COUNT" && args.size() == 1) {
+		// Captures kept for range queries ('Q' on the data plane); 0 keeps none
+		double count;
+		if (!ParseDouble(args[0], count) || count < 0 || count > RETAIN_MAX_COUNT)
+			goto unknown;
+
+		retain_set_count(count);
+		LogDebug("Retaining the last %u captures\n", retain_get_count());
+		return true;
+	}
+
+	if (subject == "BWLIMIT" && cmd == "TYPE" && args.size() == 1) {
+		if (args[0] == "FIR")
+			bw_set_type(BW_FIR);
+		else if (args[0] == "IIR")
+			bw_set_type(BW_IIR);
+		else
+			goto unknown;
+
+		LogDebug("Bandwidth limit filters now %s\n", args[0].c_str());
+		return true;
+	}
+
+	if (subject == "MASK") {
+		double value;
+		if (cmd == "ENABLE" && args.size() == 1 && ParseDouble(args[0], value) && g_deviceIsScope) {
+			mask_set_enabled(value != 0);
+			return true;
+		} else if (cmd == "KEEP" && args.size() == 1 && ParseDouble(args[0], value) && value >= 0 && value <= MASK_MAX_KEEP) {
+			// Failing captures to keep for range queries
+			mask_set_keep(value);
+			return true;
+		} else if (cmd == "STOP" && args.size() == 1 && ParseDouble(args[0], value)) {
+			// Stop acquisition on the first failure
+			mask_set_stop(value != 0);
+			return true;
+		} else if (cmd == "RESET") {
+			mask_reset();
+			retain_clear_pinned();
+			return true;
+		}
+	}
+
+	if (subject == "MEAS" && cmd == "RESET") {
+		// Restart the statistics of every measurement
+		meas_reset_stats();
+		return true;
+	}
+
+	if (subject == "AVG" && cmd == "COUNT" && args.size() == 1) {
+		// Captures per averaged frame; 0 or 1 sends every capture as before
+		double count;
+		if (!ParseDouble(args[0], count) || count < 0)
+			goto unknown;
+
+		avg_set_count(std::min(count, (double)AVG_MAX_COUNT));
+		delta_reset();
+		LogDebug("Averaging now %u captures per frame\n", avg_get_count());
+		return true;
+	}
+
+	if (subject == "PERSIST") {
+		double value;
+		if (cmd == "COLS" && args.size() == 1 && ParseDouble(args[0], value) && value >= 0) {
+			// Time columns per histogram; 0 turns persistence off
+			persist_set_columns(std::min(value, (double)PERSIST_MAX_COLUMNS));
+			LogDebug("Persistence now %u columns\n", persist_get_columns());
+			return true;
+		} else if (cmd == "THREADS" && args.size() == 1 && ParseDouble(args[0], value) && value >= 1) {
+			// Cores histogramming each capture
+			persist_set_threads(std::min(value, (double)PERSIST_MAX_THREADS));
+			return true;
+		} else if (cmd == "CLEAR") {
+			persist_clear();
+			return true;
+		}
+	}
+
+	if (subject == "FFT" && args.size() == 1) {
+		double value;
+		if (!ParseDouble(args[0], value) || value < 0)
+			goto unknown;
+
+		if (cmd == "ENABLE") {
+			// Spectra instead of time domain frames on the data plane
+			spectrum_set_enabled(value != 0);
+			LogDebug("Spectrum mode %s\n", value != 0 ? "on" : "off");
+			return true;
+		} else if (cmd == "AVG") {
+			spectrum_set_average(std::min(value, (double)SPECTRUM_MAX_AVERAGE));
+			return true;
 		}
 	}
 
@@ -188,6 +598,14 @@ bool SigrokSCPIServer::OnCommand(
 	@brief Arm the device for capture. If oneShot, capture only one waveform
  */
 void SigrokSCPIServer::AcquisitionStart(bool oneShot)
+{
+	device_submit(DEVICE_ORDERED, [=]() { StartCapture(oneShot); });
+}
+
+/**
+	@brief Body of AcquisitionStart, applied on the device-owner thread
+ */
+void SigrokSCPIServer::StartCapture(bool oneShot)
 {
 	LogDebug("cmd: START\n");
 
@@ -197,11 +615,16 @@ void SigrokSCPIServer::AcquisitionStart(bool oneShot)
 	g_session_start_ms = get_ms();
 	g_lastReportedRate = 0;
 
+	if (g_run && g_running && g_capturedFirstFrame) {
+		// Still armed from a previous client (or a previous START) with the current config; the
+		// next captured frame goes straight out once the client acks, so skip the restart.
+		LogDebug("Device already armed, not restarting capture\n");
+		return;
+	}
+
 	g_run = true;
 
 	force_correct_config();
-
-
 }
 
 /**
@@ -217,10 +640,12 @@ void SigrokSCPIServer::AcquisitionForceTrigger()
  */
 void SigrokSCPIServer::AcquisitionStop()
 {
-	LogDebug("cmd: STOP\n");
+	device_submit(DEVICE_ORDERED, []() {
+		LogDebug("cmd: STOP\n");
 
-	g_run = false;
-	sr_session_stop();
+		g_run = false;
+		sr_session_stop();
+	});
 }
 
 
@@ -232,21 +657,23 @@ void SigrokSCPIServer::SetChannelEnabled(size_t chIndex, bool enabled)
 {
 	if (!g_deviceIsScope) return;
 
-	if (!enabled && chIndex == 0 && !get_probe_config<bool>(g_sr_device, g_channels[1], SR_CONF_PROBE_EN)) {
-		LogWarning("Ignoring request to disable ch0 because it would disable all channels\n");
-	} else {
-		// Must stop acquisition while disabling probe or we crash inside vendor code
-		bool wasRunning = stop_capture_sync();
+	device_submit(device_key(DEVICE_ENABLE, chIndex), [=]() {
+		if (!enabled && chIndex == 0 && !get_probe_config<bool>(g_sr_device, g_channels[1], SR_CONF_PROBE_EN)) {
+			LogWarning("Ignoring request to disable ch0 because it would disable all channels\n");
+		} else {
+			// Must stop acquisition while disabling probe or we crash inside vendor code
+			bool wasRunning = stop_capture_sync();
 
-		set_probe_config<bool>(g_sr_device, g_channels[chIndex], SR_CONF_PROBE_EN, enabled);
-		LogDebug("Updated ENABLED for ch%ld, now %d\n", chIndex, enabled);
+			set_probe_config<bool>(g_sr_device, g_channels[chIndex], SR_CONF_PROBE_EN, enabled);
+			LogDebug("Updated ENABLED for ch%ld, now %d\n", chIndex, enabled);
 
-		force_correct_config();
-		
-		if (wasRunning) restart_capture();
+			force_correct_config();
 
-		force_correct_config();
-	}
+			if (wasRunning) restart_capture();
+
+			force_correct_config();
+		}
+	});
 }
 
 /**
@@ -267,8 +694,10 @@ void SigrokSCPIServer::SetAnalogCoupling(size_t chIndex, const std::string& coup
 		return;
 	}
 
-	set_probe_config<uint8_t>(g_sr_device, g_channels[chIndex], SR_CONF_PROBE_COUPLING, sr_coupling);
-	LogDebug("Updated coupling for ch%ld, now %s\n", chIndex, coupling.c_str());
+	device_submit(device_key(DEVICE_COUPLING, chIndex), [=]() {
+		set_probe_config<uint8_t>(g_sr_device, g_channels[chIndex], SR_CONF_PROBE_COUPLING, sr_coupling);
+		LogDebug("Updated coupling for ch%ld, now %s\n", chIndex, coupling.c_str());
+	});
 }
 
 /**
@@ -289,8 +718,10 @@ void SigrokSCPIServer::SetAnalogRange(size_t chIndex, double range_V)
 		}
 	}
 
-	set_probe_config<uint64_t>(g_sr_device, g_channels[chIndex], SR_CONF_PROBE_VDIV, selected);
-	LogDebug("Updated RANGE; Wanted %f (%f PtP), result: %lu\n", range_mV_per_div, range_V, selected);
+	device_submit(device_key(DEVICE_RANGE, chIndex), [=]() {
+		set_vdiv(chIndex, selected);
+		LogDebug("Updated RANGE; Wanted %f (%f PtP), result: %lu\n", range_mV_per_div, range_V, selected);
+	});
 }
 
 /**
@@ -303,9 +734,11 @@ void SigrokSCPIServer::SetDigitalThreshold(size_t chIndex, double threshold_V)
 	if (threshold_V < 0) threshold_V = 0;
 	if (threshold_V > 5) threshold_V = 5;
 
-	set_dev_config<double>(g_sr_device, SR_CONF_VTH, threshold_V);
+	device_submit(device_key(DEVICE_THRESHOLD), [=]() {
+		set_dev_config<double>(g_sr_device, SR_CONF_VTH, threshold_V);
 
-	LogDebug("Updated THRESH, now %f\n", threshold_V);
+		LogDebug("Updated THRESH, now %f\n", threshold_V);
+	});
 }
 
 /**
@@ -331,11 +764,11 @@ void SigrokSCPIServer::SetAnalogOffset(size_t chIndex, double offset_V)
  */
 void SigrokSCPIServer::SetSampleRate(uint64_t rate_hz)
 {
-	set_rate(rate_hz);
+	device_submit(device_key(DEVICE_RATE), [=]() {
+		set_rate(rate_hz);
 
-	LogDebug("Updated RATE; now %lu\n", g_rate);
-
-	force_correct_config();
+		LogDebug("Updated RATE; now %lu\n", g_rate);
+	}, true);
 }
 
 /**
@@ -343,11 +776,11 @@ void SigrokSCPIServer::SetSampleRate(uint64_t rate_hz)
  */
 void SigrokSCPIServer::SetSampleDepth(uint64_t depth)
 {
-	set_depth(depth);
+	device_submit(device_key(DEVICE_DEPTH), [=]() {
+		set_depth(depth);
 
-	LogDebug("Updated DEPTH; now %lu\n", g_depth);
-
-	force_correct_config();
+		LogDebug("Updated DEPTH; now %lu\n", g_depth);
+	}, true);
 }
 
 //-- Trigger Configuration --//
@@ -356,9 +789,11 @@ void SigrokSCPIServer::SetSampleDepth(uint64_t depth)
  */
 void SigrokSCPIServer::SetTriggerDelay(uint64_t delay_fs)
 {
-	set_trigfs(delay_fs);
+	device_submit(device_key(DEVICE_TRIGGER_DELAY), [=]() {
+		set_trigfs(delay_fs);
 
-	LogDebug("Set trigger DELAY to %lu (%%%d)\n", delay_fs, g_trigpct);
+		LogDebug("Set trigger DELAY to %lu (%%%d)\n", delay_fs, g_trigpct);
+	});
 }
 
 /**
@@ -366,9 +801,11 @@ void SigrokSCPIServer::SetTriggerDelay(uint64_t delay_fs)
  */
 void SigrokSCPIServer::SetTriggerSource(size_t chIndex)
 {
-	set_trigger_channel(chIndex);
+	device_submit(device_key(DEVICE_TRIGGER_SOURCE), [=]() {
+		set_trigger_channel(chIndex);
 
-	LogDebug("Set trigger SOU to %lu\n", chIndex);
+		LogDebug("Set trigger SOU to %lu\n", chIndex);
+	});
 }
 
 //-- (Edge) Trigger Configuration --//
@@ -387,21 +824,23 @@ void SigrokSCPIServer::SetTriggerLevel(double level_V)
 {
 	if (!g_deviceIsScope) return;
 
-	// Set it on all probes, allowing SR_CONF_TRIGGER_SOURCE to select
-	// which is actually active
-	for (auto ch : g_channels) {
-		float scale, offset;
-		compute_scale_and_offset(ch, scale, offset);
+	device_submit(device_key(DEVICE_TRIGGER_LEVEL), [=]() {
+		// Set it on all probes, allowing SR_CONF_TRIGGER_SOURCE to select
+		// which is actually active
+		for (auto ch : g_channels) {
+			float scale, offset;
+			compute_scale_and_offset(ch, scale, offset);
 
-		// voltage = ADC * scale - offset
-		// ADC = (voltage + offset) / scale
+			// voltage = ADC * scale - offset
+			// ADC = (voltage + offset) / scale
 
-		uint8_t adc = (level_V + offset) / scale;
+			uint8_t adc = (level_V + offset) / scale;
 
-		set_probe_config<uint8_t>(g_sr_device, ch, SR_CONF_TRIGGER_VALUE, adc);
-	}
+			set_probe_config<uint8_t>(g_sr_device, ch, SR_CONF_TRIGGER_VALUE, adc);
+		}
 
-	LogDebug("Set trigger LEV to %f\n", level_V);
+		LogDebug("Set trigger LEV to %f\n", level_V);
+	});
 }
 
 /**
@@ -423,8 +862,10 @@ void SigrokSCPIServer::SetEdgeTriggerEdge(const std::string& edge)
 		return;
 	}
 
-	set_trigger_direction(dir);
+	device_submit(device_key(DEVICE_TRIGGER_EDGE), [=]() {
+		set_trigger_direction(dir);
 
-	LogDebug("Set trigger EDGE to %s\n", edge.c_str());
+		LogDebug("Set trigger EDGE to %s\n", edge.c_str());
+	});
 }
 
@@ -53,6 +53,9 @@ protected:
 	virtual void SetTriggerLevel(double level_V);
 	virtual void SetTriggerTypeEdge();
 	virtual void SetEdgeTriggerEdge(const std::string& edge);
+
+	// Runs on the device-owner thread
+	static void StartCapture(bool oneShot);
 };
 
 #endif
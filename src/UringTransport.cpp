@@ -0,0 +1,603 @@
+
+/*
+	Linux zero-copy data plane transports.
+
+	UringTransport submits each frame as an io_uring SEND_ZC from a registered buffer; the frame's
+	buffer goes back to its pool when the kernel posts the zero-copy notification. ZeroCopyTransport
+	is the fallback for kernels without SEND_ZC: blocking send(MSG_ZEROCOPY), with buffers released
+	as completions arrive on the socket error queue.
+
+	io_uring is driven through the raw syscalls so there is no liburing dependency.
+ */
+
+#include "DataTransport.h"
+#include "threading.h"
+#include "log/log.h"
+
+#include <memory>
+
+#ifdef __linux__
+
+#include <map>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <condition_variable>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/errqueue.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// Messages smaller than this are cheaper to copy than to pin
+static const size_t ZEROCOPY_MIN_BYTES = 16384;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// MSG_ZEROCOPY
+
+class ZeroCopyTransport : public DataTransport
+{
+public:
+	ZeroCopyTransport(ZSOCKET sock);
+	virtual ~ZeroCopyTransport();
+
+	virtual const char* GetName() { return "zerocopy"; }
+	virtual bool Send(std::shared_ptr<FrameBuffer> buf);
+
+protected:
+	void CompletionThread();
+
+	// Buffers the kernel may still be reading from, keyed by the id of the last send() using them
+	std::mutex m_pendingMutex;
+	std::deque<std::pair<uint32_t, std::shared_ptr<FrameBuffer>>> m_pending;
+	uint32_t m_nextId;
+
+	std::atomic<bool> m_quit;
+	std::thread m_completionThread;
+};
+
+ZeroCopyTransport::ZeroCopyTransport(ZSOCKET sock)
+	: DataTransport(sock)
+	, m_nextId(0)
+	, m_quit(false)
+{
+	m_completionThread = std::thread(&ZeroCopyTransport::CompletionThread, this);
+}
+
+ZeroCopyTransport::~ZeroCopyTransport()
+{
+	m_quit = true;
+	m_completionThread.join();
+}
+
+bool ZeroCopyTransport::Send(std::shared_ptr<FrameBuffer> buf)
+{
+	std::lock_guard<std::mutex> lock(m_sendMutex);
+
+	if (buf->Length() < ZEROCOPY_MIN_BYTES) {
+		if (!m_socket.SendLooped(buf->Data(), buf->Length()))
+			return false;
+
+		AccountSent(buf->Length());
+		return true;
+	}
+
+	const uint8_t* p = buf->Data();
+	size_t remaining = buf->Length();
+	while (remaining) {
+		ssize_t sent = send(m_socket, p, remaining, MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		// Every successful zero-copy send() consumes one completion id
+		m_nextId++;
+		p += sent;
+		remaining -= sent;
+	}
+
+	{
+		std::lock_guard<std::mutex> plock(m_pendingMutex);
+		m_pending.emplace_back(m_nextId - 1, buf);
+	}
+
+	AccountSent(buf->Length());
+	return true;
+}
+
+void ZeroCopyTransport::CompletionThread()
+{
+	apply_thread_policy("zerocopy");
+
+	bool warnedCopied = false;
+
+	while (!m_quit) {
+		// Completions are signalled as POLLERR
+		pollfd pfd = {m_socket, 0, 0};
+		if (poll(&pfd, 1, 100) <= 0 || !(pfd.revents & POLLERR))
+			continue;
+
+		char control[128];
+		msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(m_socket, &msg, MSG_ERRQUEUE) < 0)
+			continue;
+
+		for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			sock_extended_err* err = (sock_extended_err*)CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !warnedCopied) {
+				// e.g. loopback, where the kernel falls back to copying
+				LogDebug("Kernel is copying MSG_ZEROCOPY sends on this socket\n");
+				warnedCopied = true;
+			}
+
+			// Completions cover the id range [ee_info, ee_data]
+			uint32_t last = err->ee_data;
+
+			std::lock_guard<std::mutex> plock(m_pendingMutex);
+			while (!m_pending.empty() && (int32_t)(m_pending.front().first - last) <= 0)
+				m_pending.pop_front();
+		}
+	}
+}
+
+std::shared_ptr<DataTransport> make_zerocopy_transport(ZSOCKET sock)
+{
+	int one = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+		LogWarning("SO_ZEROCOPY not supported (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	return std::make_shared<ZeroCopyTransport>(sock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// io_uring
+
+#ifdef IORING_CQE_F_NOTIF
+
+// Number of registered buffer slots; frames beyond this are sent from unregistered memory
+static const unsigned URING_BUFFER_SLOTS = 8;
+static const unsigned URING_ENTRIES = 64;
+static const uint64_t URING_WAKEUP = ~0ULL;
+
+class UringTransport : public DataTransport
+{
+public:
+	UringTransport(ZSOCKET sock);
+	virtual ~UringTransport();
+
+	bool Setup();
+
+	virtual const char* GetName() { return "io_uring"; }
+	virtual bool Send(std::shared_ptr<FrameBuffer> buf);
+	virtual void Shutdown();
+	virtual void WaitOutstanding(size_t count);
+
+protected:
+	struct Request {
+		std::shared_ptr<FrameBuffer> buf;
+		size_t offset;
+		bool sendDone;
+		bool notifDone;
+	};
+
+	void SubmitSend(uint64_t id);
+	void Submit(const io_uring_sqe& sqe);
+	void CompletionThread();
+	void OnAllocate(FrameBuffer& buf);
+	void OnFree(FrameBuffer& buf);
+	bool UpdateBuffer(unsigned slot, void* base, size_t len);
+
+	int m_ringfd;
+	void* m_sqRing;
+	size_t m_sqRingLen;
+	void* m_cqRing;
+	size_t m_cqRingLen;
+	io_uring_sqe* m_sqes;
+	size_t m_sqesLen;
+
+	unsigned* m_sqTail;
+	unsigned* m_sqMask;
+	unsigned* m_sqArray;
+	unsigned* m_cqHead;
+	unsigned* m_cqTail;
+	unsigned* m_cqMask;
+	io_uring_cqe* m_cqes;
+
+	bool m_haveFixedBuffers;
+	FrameBuffer* m_slots[URING_BUFFER_SLOTS];
+
+	// Sends on one stream socket must not overlap, so requests go out one at a time in order.
+	// A request stays in m_requests until both its send and zero-copy notification complete.
+	std::map<uint64_t, Request> m_requests;
+	std::condition_variable m_requestDone;
+	std::deque<uint64_t> m_queue;
+	uint64_t m_nextId;
+	bool m_inFlight;
+	bool m_failed;
+
+	bool m_quit;
+	std::thread m_completionThread;
+};
+
+static int uring_setup(unsigned entries, io_uring_params* p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, void* arg, unsigned nargs)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+UringTransport::UringTransport(ZSOCKET sock)
+	: DataTransport(sock)
+	, m_ringfd(-1)
+	, m_sqRing(MAP_FAILED)
+	, m_cqRing(MAP_FAILED)
+	, m_sqes((io_uring_sqe*)MAP_FAILED)
+	, m_haveFixedBuffers(false)
+	, m_nextId(0)
+	, m_inFlight(false)
+	, m_failed(false)
+	, m_quit(false)
+{
+	for (auto& slot : m_slots)
+		slot = NULL;
+}
+
+UringTransport::~UringTransport()
+{
+	if (m_completionThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_sendMutex);
+			m_quit = true;
+
+			io_uring_sqe sqe = {};
+			sqe.opcode = IORING_OP_NOP;
+			sqe.user_data = URING_WAKEUP;
+			Submit(sqe);
+		}
+
+		m_completionThread.join();
+	}
+
+	m_pool->SetHooks(NULL, NULL);
+
+	// Closing the ring cancels anything still outstanding and drops the buffer registrations
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesLen);
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingLen);
+	if (m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingLen);
+	if (m_ringfd >= 0)
+		close(m_ringfd);
+}
+
+/**
+	@brief Create the ring, check the kernel can SEND_ZC and register the buffer slots
+ */
+bool UringTransport::Setup()
+{
+	io_uring_params params = {};
+	m_ringfd = uring_setup(URING_ENTRIES, &params);
+	if (m_ringfd < 0) {
+		LogWarning("io_uring_setup failed (%s)\n", strerror(errno));
+		return false;
+	}
+
+	m_sqRingLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingLen = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		m_sqRingLen = m_cqRingLen = std::max(m_sqRingLen, m_cqRingLen);
+
+	m_sqRing = mmap(NULL, m_sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED)
+		return false;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing = mmap(NULL, m_cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED)
+			return false;
+	}
+
+	m_sqesLen = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = (io_uring_sqe*)mmap(NULL, m_sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+		return false;
+
+	uint8_t* sq = (uint8_t*)m_sqRing;
+	m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+	m_sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	m_sqArray = (unsigned*)(sq + params.sq_off.array);
+
+	uint8_t* cq = (uint8_t*)m_cqRing;
+	m_cqHead = (unsigned*)(cq + params.cq_off.head);
+	m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+	m_cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	// Make sure this kernel has zero-copy send at all
+	size_t probeLen = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::unique_ptr<uint8_t[]> probeBuf(new uint8_t[probeLen]());
+	io_uring_probe* probe = (io_uring_probe*)probeBuf.get();
+	if (uring_register(m_ringfd, IORING_REGISTER_PROBE, probe, 256) < 0
+		|| probe->last_op < IORING_OP_SEND_ZC
+		|| !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)) {
+		LogWarning("Kernel io_uring has no SEND_ZC\n");
+		return false;
+	}
+
+	// Sparse buffer table that frame buffers are slotted into as the pool allocates them. Without
+	// it (pre-5.19 kernels) SEND_ZC still works, just from unregistered memory.
+	io_uring_rsrc_register reg = {};
+	reg.nr = URING_BUFFER_SLOTS;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	m_haveFixedBuffers = uring_register(m_ringfd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) >= 0;
+	if (!m_haveFixedBuffers)
+		LogDebug("io_uring buffer registration unavailable, sending from unregistered buffers\n");
+
+	m_pool->SetHooks(
+		[this](FrameBuffer& buf) { OnAllocate(buf); },
+		[this](FrameBuffer& buf) { OnFree(buf); });
+
+	m_completionThread = std::thread(&UringTransport::CompletionThread, this);
+	return true;
+}
+
+bool UringTransport::UpdateBuffer(unsigned slot, void* base, size_t len)
+{
+	iovec iov = {base, len};
+
+	io_uring_rsrc_update2 update = {};
+	update.offset = slot;
+	update.data = (uint64_t)(uintptr_t)&iov;
+	update.nr = 1;
+
+	return uring_register(m_ringfd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) >= 0;
+}
+
+void UringTransport::OnAllocate(FrameBuffer& buf)
+{
+	if (!m_haveFixedBuffers)
+		return;
+
+	int slot = buf.GetIndex();
+	for (unsigned i = 0; slot < 0 && i < URING_BUFFER_SLOTS; i++) {
+		if (!m_slots[i])
+			slot = i;
+	}
+
+	if (slot < 0)
+		return;
+
+	if (UpdateBuffer(slot, buf.Data(), buf.Capacity())) {
+		m_slots[slot] = &buf;
+		buf.SetIndex(slot);
+	} else {
+		m_slots[slot] = NULL;
+		buf.SetIndex(-1);
+	}
+}
+
+void UringTransport::OnFree(FrameBuffer& buf)
+{
+	int slot = buf.GetIndex();
+	if (slot < 0)
+		return;
+
+	// An empty iovec clears the slot so the kernel drops its reference to the old pages
+	UpdateBuffer(slot, NULL, 0);
+	m_slots[slot] = NULL;
+	buf.SetIndex(-1);
+}
+
+/**
+	@brief Queue a frame; returns as soon as it is queued
+ */
+bool UringTransport::Send(std::shared_ptr<FrameBuffer> buf)
+{
+	std::lock_guard<std::mutex> lock(m_sendMutex);
+
+	if (m_failed)
+		return false;
+
+	uint64_t id = m_nextId++;
+	m_requests[id] = {buf, 0, false, false};
+	m_queue.push_back(id);
+
+	if (!m_inFlight)
+		SubmitSend(m_queue.front());
+
+	return true;
+}
+
+void UringTransport::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_sendMutex);
+		m_failed = true;
+	}
+	m_requestDone.notify_all();
+
+	DataTransport::Shutdown();
+}
+
+/**
+	@brief Wait for completions until at most `count` requests still hold a buffer
+ */
+void UringTransport::WaitOutstanding(size_t count)
+{
+	std::unique_lock<std::mutex> lock(m_sendMutex);
+	m_requestDone.wait(lock, [&] { return m_failed || m_requests.size() <= count; });
+}
+
+// Call with m_sendMutex held
+void UringTransport::SubmitSend(uint64_t id)
+{
+	Request& req = m_requests[id];
+	FrameBuffer* buf = req.buf.get();
+
+	io_uring_sqe sqe = {};
+	sqe.opcode = IORING_OP_SEND_ZC;
+	sqe.fd = m_socket;
+	sqe.addr = (uint64_t)(uintptr_t)(buf->Data() + req.offset);
+	sqe.len = buf->Length() - req.offset;
+	sqe.msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe.user_data = id;
+
+	if (buf->GetIndex() >= 0) {
+		sqe.ioprio |= IORING_RECVSEND_FIXED_BUF;
+		sqe.buf_index = buf->GetIndex();
+	}
+
+	m_inFlight = true;
+	Submit(sqe);
+}
+
+// Call with m_sendMutex held
+void UringTransport::Submit(const io_uring_sqe& sqe)
+{
+	unsigned tail = *m_sqTail;
+	unsigned index = tail & *m_sqMask;
+
+	m_sqes[index] = sqe;
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	while (uring_enter(m_ringfd, 1, 0, 0) < 0 && errno == EINTR)
+		;
+}
+
+void UringTransport::CompletionThread()
+{
+	apply_thread_policy("uring");
+
+	for (;;) {
+		if (uring_enter(m_ringfd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			LogError("io_uring_enter failed (%s)\n", strerror(errno));
+
+			std::lock_guard<std::mutex> lock(m_sendMutex);
+			m_failed = true;
+			m_requestDone.notify_all();
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_sendMutex);
+
+		unsigned head = *m_cqHead;
+		unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			io_uring_cqe cqe = m_cqes[head & *m_cqMask];
+
+			if (cqe.user_data == URING_WAKEUP)
+				continue;
+
+			auto it = m_requests.find(cqe.user_data);
+			if (it == m_requests.end())
+				continue;
+			Request& req = it->second;
+
+			if (cqe.flags & IORING_CQE_F_NOTIF) {
+				// Kernel is done with the pages
+				req.notifDone = true;
+			} else {
+				req.sendDone = true;
+				if (!(cqe.flags & IORING_CQE_F_MORE))
+					req.notifDone = true;
+
+				if (cqe.res < 0) {
+					LogWarning("io_uring send failed (%s)\n", strerror(-cqe.res));
+					m_failed = true;
+				} else {
+					req.offset += cqe.res;
+					AccountSent(cqe.res);
+				}
+
+				m_inFlight = false;
+				bool partial = !m_failed && req.offset < req.buf->Length();
+
+				if (partial) {
+					// Short send; the remainder goes out as a new request so ids stay unique
+					uint64_t id = m_nextId++;
+					m_requests[id] = {req.buf, req.offset, false, false};
+					m_queue.front() = id;
+				} else {
+					m_queue.pop_front();
+				}
+
+				if (!m_failed && !m_queue.empty())
+					SubmitSend(m_queue.front());
+			}
+
+			// m_requests may have been modified above, so look the request up again
+			auto done = m_requests.find(cqe.user_data);
+			if (done != m_requests.end() && done->second.sendDone && done->second.notifDone)
+				m_requests.erase(done);
+		}
+
+		__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+		m_requestDone.notify_all();
+
+		if (m_quit)
+			return;
+	}
+}
+
+std::shared_ptr<DataTransport> make_uring_transport(ZSOCKET sock)
+{
+	// Check the ring works before handing over the socket
+	io_uring_params params = {};
+	int fd = uring_setup(1, &params);
+	if (fd < 0) {
+		LogWarning("io_uring unavailable (%s)\n", strerror(errno));
+		return NULL;
+	}
+	close(fd);
+
+	auto transport = std::make_shared<UringTransport>(sock);
+	if (!transport->Setup()) {
+		// Keep the socket open for the fallback transport
+		transport->Release();
+		return NULL;
+	}
+
+	return transport;
+}
+
+#else
+
+std::shared_ptr<DataTransport> make_uring_transport(ZSOCKET)
+{
+	LogWarning("Built without io_uring zero-copy send support\n");
+	return NULL;
+}
+
+#endif // IORING_CQE_F_NOTIF
+
+#endif // __linux__
@@ -1,10 +1,29 @@
 
+#include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <poll.h>
+#include <math.h>
+#include <algorithm>
+#include <sys/socket.h>
 
 #include "server.h"
 #include "xptools/Socket.h"
 #include "log/log.h"
 #include "srbinding.h"
+#include "calibration.h"
+#include "averaging.h"
+#include "persistence.h"
+#include "spectrum.h"
+#include "retain.h"
+#include "measure.h"
+#include "masktest.h"
+#include "autotune.h"
+#include "delta.h"
+#include "bwfilter.h"
+#include "deinterleave.h"
+#include "threading.h"
+#include "DataTransport.h"
 
 uint64_t g_session_start_ms;
 uint32_t g_seqnum = 0;
@@ -65,10 +84,587 @@ float InterpolateTriggerTime(struct sr_channel *ch, uint8_t* buf, uint64_t trigp
 	return final;
 }
 
-bool g_pendingAcquisition = false;
+std::atomic<bool> g_pendingAcquisition = false;
 
-void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafeed_packet *packet, void* client_vp) {
-	Socket* client = (Socket*) client_vp;
+Socket g_dataSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+
+// Set once SessionThread has finished setting up, before clients are accepted
+std::atomic<bool> g_sessionReady = false;
+std::atomic<bool> g_shutdown = false;
+
+// Bit N set = hardware channel N is sent on the data plane
+std::atomic<uint64_t> g_channelMask = ~0ULL;
+
+// Samples per piece when deep frames are streamed in pieces (DATA:CHUNK); 0 sends whole frames
+std::atomic<size_t> g_chunkSamples{0};
+
+// How logic captures go out (DATA:LAYOUT), a logic_layout
+std::atomic<int> g_logicLayout{LAYOUT_CHANNEL};
+
+// Up to this many frames go out together as one MESSAGE_BATCH (DATA:BATCH); 0 or 1 sends each alone
+std::atomic<unsigned> g_batchFrames{0};
+
+// ...unless the batch would then have been open this long (DATA:BATCHWAIT)
+std::atomic<unsigned> g_batchWaitMs{50};
+
+// Logic sample bytes captured and actually sent while in the EDGES layout
+static std::atomic<uint64_t> s_edgeRawBytes{0};
+static std::atomic<uint64_t> s_edgeSentBytes{0};
+
+// The one data plane client frames are currently delivered to, if any. Swapped atomically by
+// WaveformServerThread so the datafeed callback never sees a socket that has gone away.
+std::shared_ptr<DataTransport> g_dataClient;
+
+// seqnum, channel count, samplerate_fs, trig_fs, wfms_s
+static const size_t FRAME_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(int64_t) + sizeof(uint64_t) + sizeof(double);
+// channel ID, memory depth
+static const size_t CHANNEL_ID_SIZE = sizeof(size_t) * 2;
+
+// Frames with more sample data than this are always sent in pieces of STREAM_PIECE_SAMPLES as
+// MESSAGE_FRAME_BEGIN/CHUNK/END, rather than built whole
+static const size_t STREAM_MIN_BYTES = 64 << 20;
+static const size_t STREAM_PIECE_SAMPLES = 1 << 20;
+
+// Only frames needing at most this much buffer (scratch included) are batched, and a batch
+// message is sized to hold whatever fits in BATCH_MAX_BYTES rather than DATA:BATCH whole frames
+static const size_t BATCH_MAX_FRAME_BYTES = 256 << 10;
+static const size_t BATCH_MAX_BYTES = 4 << 20;
+
+static void put_frame_header(FrameBuffer& frame, uint32_t seqnum, uint16_t numchans, int64_t samplerate_fs, double wfms_s) {
+	frame.Put(seqnum);
+	frame.Put(numchans);
+	frame.Put(samplerate_fs);
+
+	uint64_t trig_fs = g_trigfs;
+	frame.Put(trig_fs);
+
+	frame.Put(wfms_s);
+}
+
+/**
+	@brief Send the completed average as one frame, in the client's selected sample format
+ */
+static void send_average(DataTransport* client, uint32_t seqnum, int64_t samplerate_fs, double wfms_s) {
+	const vector<size_t>& chnums = avg_channels();
+	size_t num_samples = avg_depth();
+
+	int format = g_sampleFormat == SAMPLE_RAW ? SAMPLE_AVG_U16 : g_sampleFormat;
+	size_t sample_size = cal_sample_size(format);
+	size_t chheader_size = sizeof(float) * 3 + sizeof(bool) + sizeof(uint8_t);
+
+	// The client now holds samples that aren't the delta reference
+	delta_reset();
+
+	size_t capacity = FRAME_HEADER_SIZE
+		+ chnums.size() * (CHANNEL_ID_SIZE + chheader_size + num_samples * sample_size)
+		+ num_samples * sizeof(uint16_t);
+
+	std::shared_ptr<FrameBuffer> frame = client->Acquire(capacity);
+	put_frame_header(*frame, seqnum, chnums.size(), samplerate_fs, wfms_s);
+
+	uint16_t* fixed = format == SAMPLE_AVG_U16 ? NULL : (uint16_t*)frame->Scratch(num_samples * sizeof(uint16_t));
+
+	for (size_t chnum : chnums) {
+		frame->Put(chnum);
+		frame->Put(num_samples);
+
+		float config[3];
+		if (format == SAMPLE_AVG_U16) {
+			compute_scale_and_offset(g_channels[chnum], config[0], config[1]);
+			config[0] /= 256;
+		} else {
+			config[0] = (format == SAMPLE_CAL_I16) ? cal_i16_scale(chnum) : 1;
+			config[1] = 0;
+		}
+		config[2] = avg_trigphase(chnum);
+		frame->Put(config);
+
+		bool clipping = avg_clipping(chnum);
+		frame->Put(clipping);
+		frame->Put((uint8_t)format);
+
+		uint8_t* samples = frame->Append(num_samples * sample_size);
+		if (format == SAMPLE_AVG_U16) {
+			avg_output(chnum, (uint16_t*)samples);
+		} else {
+			avg_output(chnum, fixed);
+			cal_convert_fixed(chnum, format, fixed, samples, num_samples);
+		}
+	}
+
+	client->Send(frame);
+}
+
+// Per channel header: scale, offset, trigphase and clipping (plus the format byte when calibrated)
+// for analog channels, first sample for logic
+static size_t channel_header_size(int format) {
+	if (!g_deviceIsScope)
+		return sizeof(int32_t);
+
+	return sizeof(float) * 3 + sizeof(bool) + (format != SAMPLE_RAW ? sizeof(uint8_t) : 0);
+}
+
+// Volts = sample * scale - offset, for samples of channel `chnum` in `format`
+static void channel_scale(size_t chnum, int format, float& scale, float& offset) {
+	if (format == SAMPLE_CAL_I16 || format == SAMPLE_CAL_F32) {
+		// Calibrated stream: samples are already in (scaled) volts
+		scale = (format == SAMPLE_CAL_I16) ? cal_i16_scale(chnum) : 1;
+		offset = 0;
+	} else {
+		compute_scale_and_offset(g_channels[chnum], scale, offset);
+	}
+}
+
+static void put_channel_header(uint8_t* p, size_t chnum, int format, float trigphase, bool clipping, int32_t first_sample) {
+	if (g_deviceIsScope) {
+		// An extra format byte at the end tells the client how wide calibrated samples are
+		float config[3];
+		channel_scale(chnum, format, config[0], config[1]);
+		config[2] = trigphase;
+
+		memcpy(p, config, sizeof(config));
+		p += sizeof(config);
+
+		memcpy(p, &clipping, sizeof(clipping));
+		p += sizeof(clipping);
+
+		if (format != SAMPLE_RAW)
+			*p = format;
+	} else {
+		memcpy(p, &first_sample, sizeof(first_sample));
+	}
+}
+
+static int32_t logic_first_sample(size_t num_samples) {
+	uint32_t nominal_trigpos_in_bits = num_samples * 8 * g_trigpct / 100;
+	// Where in the bitstream SHOULD the trigger be
+
+	uint32_t trigpos_in_bits = g_lastTrigPos * 8 * 2 / count_enabled_channels();
+	// Where in the bitstream DID the trigger happen
+
+	return nominal_trigpos_in_bits - trigpos_in_bits;
+}
+
+/**
+	@brief A frame has been handed to the client: feed the auto-tuner, and stop if in oneshot mode
+ */
+static void frame_delivered(uint64_t start_us) {
+	tune_frame_sent(start_us, now_us());
+
+	if (g_oneShot) {
+		LogDebug("Stopping after oneshot\n");
+		g_run = false;
+		sr_session_stop();
+	}
+}
+
+// Pieces of frames that are sent while the rest is still being built. Two in flight are enough to
+// keep the link busy.
+static SendQueue& frame_sender() {
+	static SendQueue s_sender(2);
+	return s_sender;
+}
+
+/**
+	@brief Send a reply from the ack thread behind any frame pieces still queued for `client`
+ */
+void send_in_order(std::shared_ptr<DataTransport> client, std::shared_ptr<FrameBuffer> msg) {
+	frame_sender().Push(client, msg);
+}
+
+/**
+	@brief Trigger phase of a DSO capture, from only the samples around the trigger
+
+	Reads straight from the interleaved packet, padding with the edge sample near either end.
+ */
+static float interleaved_trigphase(const uint8_t* in, size_t numchans, size_t num_samples, int trigindex) {
+	static const size_t WINDOW = 48;
+	uint8_t window[WINDOW];
+	int64_t nominal = num_samples * g_trigpct / 100;
+	for (size_t i = 0; i < WINDOW; i++) {
+		int64_t sample = std::clamp<int64_t>(nominal - (int64_t)WINDOW / 2 + i, 0, num_samples - 1);
+		window[i] = in[sample * numchans + trigindex];
+	}
+
+	float trigphase = InterpolateTriggerTime(g_channels[g_selectedTriggerChannel], window, WINDOW / 2);
+	return trigphase == 999 ? 0 : trigphase;
+}
+
+/**
+	@brief Stream one capture as MESSAGE_FRAME_BEGIN, MESSAGE_FRAME_CHUNKs of `chunk` samples, MESSAGE_FRAME_END
+
+	Each chunk is deinterleaved into a buffer of its own and queued for the sender thread, so
+	it is on the wire while the next one is built and the client can draw it straight away.
+	MESSAGE_FRAME_BEGIN carries what is needed to draw a chunk: per channel its number and depth,
+	then scale and offset (float each) for scope channels or the first sample index (i32) for
+	logic ones. For scope channels MESSAGE_FRAME_END then carries trigphase (float) and clipping
+	(bool), which are only known once the whole capture has been looked at.
+ */
+static void send_chunked_frame(std::shared_ptr<DataTransport> client, uint32_t seqnum, const uint8_t* in, bool logic,
+	size_t num_samples, const vector<int>& sample_channels, const vector<bool>& sent, int trigindex,
+	int64_t samplerate_fs, double wfms_s, size_t chunk) {
+	size_t numchans = sample_channels.size();
+	int format = g_deviceIsScope ? g_sampleFormat : SAMPLE_RAW;
+	size_t sample_size = cal_sample_size(format);
+	delta_reset();
+
+	vector<size_t> chans;
+	for (size_t ch = 0; ch < numchans; ch++) {
+		if (sent[ch])
+			chans.push_back(ch);
+	}
+
+	int32_t first_sample = logic ? logic_first_sample(num_samples) : 0;
+
+	auto begin = client->Acquire(FRAME_HEADER_SIZE + 8 + chans.size() * (CHANNEL_ID_SIZE + 2 * sizeof(float)));
+	begin->Put(MESSAGE_TAG);
+	begin->Put((uint8_t)MESSAGE_FRAME_BEGIN);
+	put_frame_header(*begin, seqnum, chans.size(), samplerate_fs, wfms_s);
+	begin->Put((uint8_t)format);
+	for (size_t ch : chans) {
+		begin->Put((size_t)sample_channels[ch]);
+		begin->Put(num_samples);
+
+		if (logic) {
+			begin->Put(first_sample);
+		} else {
+			float scale, offset;
+			channel_scale(sample_channels[ch], format, scale, offset);
+			begin->Put(scale);
+			begin->Put(offset);
+		}
+	}
+	frame_sender().Push(client, begin);
+
+	vector<bool> clipping(numchans, false);
+	vector<uint8_t*> samples(numchans, NULL);
+	vector<uint8_t*> raw(numchans, NULL);
+	std::unique_ptr<bool[]> clipped(new bool[numchans]);
+
+	for (size_t first = 0; first < num_samples; first += chunk) {
+		uint32_t count = std::min(chunk, num_samples - first);
+
+		auto buf = client->Acquire(32 + chans.size() * count * (sample_size + 1));
+		buf->Put(MESSAGE_TAG);
+		buf->Put((uint8_t)MESSAGE_FRAME_CHUNK);
+		buf->Put((uint64_t)first);
+		buf->Put(count);
+
+		for (size_t ch : chans) {
+			samples[ch] = buf->Append(count * sample_size);
+			raw[ch] = format == SAMPLE_RAW ? samples[ch] : buf->Scratch(count);
+		}
+
+		if (logic) {
+			deinterleave_logic(in + first * numchans, numchans, count, raw.data());
+		} else {
+			deinterleave_dso(in + first * numchans, numchans, count, raw.data(), clipped.get());
+			for (size_t ch : chans)
+				clipping[ch] = clipping[ch] || clipped[ch];
+		}
+
+		if (format != SAMPLE_RAW) {
+			for (size_t ch : chans)
+				cal_convert(sample_channels[ch], format, raw[ch], samples[ch], count);
+		}
+
+		frame_sender().Push(client, buf);
+	}
+
+	auto end = client->Acquire(8 + chans.size() * (sizeof(float) + sizeof(bool)));
+	end->Put(MESSAGE_TAG);
+	end->Put((uint8_t)MESSAGE_FRAME_END);
+	if (!logic) {
+		float trigphase = interleaved_trigphase(in, numchans, num_samples, trigindex);
+		for (size_t ch : chans) {
+			end->Put(trigphase);
+			end->Put((bool)clipping[ch]);
+		}
+	}
+	frame_sender().Push(client, end);
+}
+
+/**
+	@brief Send a logic capture as one MESSAGE_BUS message: a word per sample, bit i = i-th sent channel
+
+	Layout after the tag and type: u32 seqnum, i64 samplerate_fs, u64 trig_fs, double wfms_s,
+	u8 word size in bytes, u8 channel count, that many u8 hardware channel numbers (bit order),
+	i32 first_sample, u64 word count, then the little endian words.
+ */
+static void send_bus_frame(DataTransport* client, uint32_t seqnum, const uint8_t* in, size_t num_samples,
+	const vector<int>& sample_channels, const vector<bool>& sent, int64_t samplerate_fs, double wfms_s) {
+	vector<int> rows;
+	for (size_t ch = 0; ch < sample_channels.size() && rows.size() < 32; ch++) {
+		if (sent[ch])
+			rows.push_back(ch);
+	}
+
+	size_t word_bytes = bus_word_bytes(rows.size());
+	uint64_t num_words = (num_samples & ~(size_t)7) * 8;
+
+	auto msg = client->Acquire(64 + rows.size() + num_words * word_bytes);
+	msg->Put(MESSAGE_TAG);
+	msg->Put((uint8_t)MESSAGE_BUS);
+	msg->Put(seqnum);
+	msg->Put(samplerate_fs);
+	uint64_t trig_fs = g_trigfs;
+	msg->Put(trig_fs);
+	msg->Put(wfms_s);
+	msg->Put((uint8_t)word_bytes);
+	msg->Put((uint8_t)rows.size());
+	for (int row : rows)
+		msg->Put((uint8_t)sample_channels[row]);
+	msg->Put(logic_first_sample(num_samples));
+	msg->Put(num_words);
+
+	transpose_logic(in, sample_channels.size(), num_samples, rows.data(), rows.size(), msg->Append(num_words * word_bytes));
+
+	client->Send(msg);
+}
+
+/**
+	@brief Send a logic capture as one MESSAGE_EDGES message: where each sent channel changes level
+
+	Layout after the tag and type: u32 seqnum, i64 samplerate_fs, u64 trig_fs, double wfms_s,
+	i32 first_sample, u64 samples per channel, u8 channel count, then per channel u8 hardware
+	channel number, u8 level of the first sample, u32 edge count and that many u32 sample positions.
+
+	Returns false, having sent nothing, if the edges would take more room than the samples do;
+	the caller then sends a regular frame.
+ */
+static bool send_edge_frame(DataTransport* client, uint32_t seqnum, const uint8_t* in, size_t num_samples,
+	const vector<int>& sample_channels, const vector<bool>& sent, int64_t samplerate_fs, double wfms_s) {
+	uint64_t num_bits = (num_samples & ~(size_t)7) * 8;
+	if (num_bits > UINT32_MAX)
+		return false;
+
+	size_t numchans = sample_channels.size();
+	vector<size_t> counts(numchans);
+	logic_edge_counts(in, numchans, num_samples, counts.data());
+
+	size_t raw_bytes = 0;
+	size_t edge_bytes = 0;
+	uint8_t numsent = 0;
+	for (size_t ch = 0; ch < numchans; ch++) {
+		if (!sent[ch])
+			continue;
+
+		raw_bytes += CHANNEL_ID_SIZE + sizeof(int32_t) + num_samples;
+		edge_bytes += 2 * sizeof(uint8_t) + sizeof(uint32_t) + counts[ch] * sizeof(uint32_t);
+		numsent++;
+	}
+
+	s_edgeRawBytes += raw_bytes;
+	if (edge_bytes >= raw_bytes) {
+		s_edgeSentBytes += raw_bytes;
+		return false;
+	}
+	s_edgeSentBytes += edge_bytes;
+
+	auto msg = client->Acquire(64 + edge_bytes);
+	msg->Put(MESSAGE_TAG);
+	msg->Put((uint8_t)MESSAGE_EDGES);
+	msg->Put(seqnum);
+	msg->Put(samplerate_fs);
+	uint64_t trig_fs = g_trigfs;
+	msg->Put(trig_fs);
+	msg->Put(wfms_s);
+	msg->Put(logic_first_sample(num_samples));
+	msg->Put(num_bits);
+	msg->Put(numsent);
+
+	vector<uint32_t*> positions(numchans, NULL);
+	vector<uint8_t*> levels(numchans, NULL);
+	for (size_t ch = 0; ch < numchans; ch++) {
+		if (!sent[ch])
+			continue;
+
+		msg->Put((uint8_t)sample_channels[ch]);
+		levels[ch] = msg->Append(sizeof(uint8_t));
+		msg->Put((uint32_t)counts[ch]);
+		positions[ch] = (uint32_t*)msg->Append(counts[ch] * sizeof(uint32_t));
+	}
+
+	vector<uint8_t> first(numchans);
+	logic_edges(in, numchans, num_samples, positions.data(), first.data());
+	for (size_t ch = 0; ch < numchans; ch++) {
+		if (levels[ch])
+			*levels[ch] = first[ch];
+	}
+
+	client->Send(msg);
+	return true;
+}
+
+/**
+	@brief Samples captured per byte sent for logic captures in the EDGES layout so far (1 if none)
+ */
+double edge_compression() {
+	uint64_t sent = s_edgeSentBytes;
+	return sent ? (double)s_edgeRawBytes / sent : 1;
+}
+
+/**
+	@brief Frames being collected into one MESSAGE_BATCH for the client
+
+	Layout after the tag and type: u16 frame count, then per frame u64 capture time (us, steady
+	clock), u64 frame length and the frame exactly as it would have been sent on its own. One ack
+	asks for the next batch.
+ */
+struct frame_batch {
+	std::shared_ptr<DataTransport> client;
+	std::shared_ptr<FrameBuffer> msg;
+	size_t countOffset = 0;
+	size_t lengthOffset = 0;
+	uint16_t count = 0;
+	uint64_t start_us = 0;
+	uint64_t callback_start_us = 0;
+};
+
+// Guards s_batch. The capture path holds it for the whole of each capture, so the timer only
+// ever sees a batch between frames and never flushes under a capture that already claimed an ack.
+static std::mutex s_batchMutex;
+static frame_batch s_batch;
+
+static void batch_flush() {
+	if (!s_batch.msg)
+		return;
+
+	s_batch.client->Send(s_batch.msg);
+	s_batch.client = NULL;
+	s_batch.msg = NULL;
+
+	g_pendingAcquisition = false;
+	frame_delivered(s_batch.callback_start_us);
+}
+
+/**
+	@brief Owns the "batch" thread, which sends an open batch once DATA:BATCHWAIT has passed
+
+	The capture path only looks at the deadline when a capture comes in, and when the trigger goes
+	quiet none does. Started with the first batch; all state is under s_batchMutex.
+ */
+class BatchTimer
+{
+public:
+	~BatchTimer();
+
+	void Arm();
+
+protected:
+	void Run();
+
+	std::thread m_thread;
+	std::condition_variable m_wake;
+	bool m_stop = false;
+};
+
+static BatchTimer s_batchTimer;
+
+BatchTimer::~BatchTimer() {
+	{
+		std::lock_guard<std::mutex> lock(s_batchMutex);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+/**
+	@brief Wake the timer for a newly opened batch; called with s_batchMutex held
+ */
+void BatchTimer::Arm() {
+	if (!m_thread.joinable())
+		m_thread = std::thread(&BatchTimer::Run, this);
+	m_wake.notify_one();
+}
+
+void BatchTimer::Run() {
+	apply_thread_policy("batch");
+
+	std::unique_lock<std::mutex> lock(s_batchMutex);
+	while (!m_stop) {
+		if (!s_batch.msg) {
+			m_wake.wait(lock);
+			continue;
+		}
+
+		uint64_t deadline = s_batch.start_us + g_batchWaitMs * 1000ULL;
+		uint64_t now = now_us();
+		if (now < deadline) {
+			m_wake.wait_for(lock, std::chrono::microseconds(deadline - now));
+			continue;
+		}
+
+		batch_flush();
+	}
+}
+
+/**
+	@brief The buffer to build the next frame in, with its batch entry header already written
+ */
+static std::shared_ptr<FrameBuffer> batch_begin_frame(std::shared_ptr<DataTransport> client, size_t capacity, uint64_t timestamp_us) {
+	size_t entry = sizeof(uint64_t) * 2 + capacity;
+
+	if (s_batch.msg && s_batch.client != client) {
+		// Client went away mid-batch
+		s_batch.client = NULL;
+		s_batch.msg = NULL;
+	} else if (s_batch.msg && s_batch.msg->Available() < entry) {
+		batch_flush();
+	}
+
+	if (!s_batch.msg) {
+		s_batch.client = client;
+		size_t frames_bytes = std::max(entry, std::min(g_batchFrames * entry, BATCH_MAX_BYTES));
+		s_batch.msg = client->Acquire(sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t) + frames_bytes);
+		s_batch.msg->Put(MESSAGE_TAG);
+		s_batch.msg->Put((uint8_t)MESSAGE_BATCH);
+		s_batch.countOffset = s_batch.msg->Length();
+		s_batch.msg->Put((uint16_t)0);
+		s_batch.count = 0;
+		s_batch.start_us = timestamp_us;
+		s_batchTimer.Arm();
+	}
+
+	s_batch.msg->Put(timestamp_us);
+	s_batch.lengthOffset = s_batch.msg->Length();
+	s_batch.msg->Put((uint64_t)0);
+	s_batch.callback_start_us = timestamp_us;
+
+	return s_batch.msg;
+}
+
+/**
+	@brief Close the frame just built; sends the batch if it is full or has been open long enough
+ */
+static void batch_end_frame() {
+	FrameBuffer& msg = *s_batch.msg;
+	uint64_t length = msg.Length() - s_batch.lengthOffset - sizeof(uint64_t);
+	memcpy(msg.Data() + s_batch.lengthOffset, &length, sizeof(length));
+
+	s_batch.count++;
+	memcpy(msg.Data() + s_batch.countOffset, &s_batch.count, sizeof(s_batch.count));
+
+	// The frame is built, so its scratch space is free for the next one
+	msg.ReleaseScratch();
+
+	// Would waiting for one more capture take the batch past its latency limit?
+	double hz = g_hwRateClock.GetAverageHz();
+	uint64_t period_us = hz > 0 ? 1e6 / hz : 0;
+	uint64_t open_us = now_us() - s_batch.start_us;
+
+	if (s_batch.count >= g_batchFrames || g_oneShot || open_us + period_us >= g_batchWaitMs * 1000ULL) {
+		batch_flush();
+	} else {
+		// Keep taking captures for this batch without waiting for another ack
+		g_pendingAcquisition = true;
+	}
+}
+
+void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafeed_packet *packet, void*) {
 
 	if (packet->type == SR_DF_HEADER) {
 		struct sr_datafeed_header* header = (struct sr_datafeed_header*)packet->payload;
@@ -77,6 +673,10 @@ void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafe
 	} else if (packet->type == SR_DF_END) {
 		// LogDebug("SR_DF_END; Capture Ended\n");
 
+		// No more captures are coming to fill it
+		std::lock_guard<std::mutex> lock(s_batchMutex);
+		batch_flush();
+
 	} else if (packet->type == SR_DF_TRIGGER) {
 		struct ds_trigger_pos* trigger = (struct ds_trigger_pos*)packet->payload;
 		(void) trigger;
@@ -86,7 +686,11 @@ void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafe
 
             g_lastTrigPos = trig_pos;
 		}
+	} else if (depth_probe_active()) {
+		depth_probe_packet(packet);
 	} else if (packet->type == SR_DF_LOGIC || packet->type == SR_DF_DSO) {
+		uint64_t callback_start_us = now_us();
+		std::lock_guard<std::mutex> batchLock(s_batchMutex);
 		uint32_t seqnum = g_seqnum++;
 		g_hwRateClock.Tick();
 
@@ -98,12 +702,34 @@ void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafe
 		}
 		// Don't send further data packets after stop requested
 
-		if (!g_pendingAcquisition) {
+		std::shared_ptr<DataTransport> client = std::atomic_load(&g_dataClient);
+		bool calibrating = g_deviceIsScope && cal_point_pending();
+
+		// Averaging and persistence take in every capture, whether or not the client is waiting for a frame
+		bool averaging = g_deviceIsScope && avg_enabled();
+		bool persisting = g_deviceIsScope && persist_enabled();
+
+		// Spectrum frames are sent by the FFT worker when it has one, not per capture
+		bool spectrum = g_deviceIsScope && spectrum_enabled();
+
+		// Measurements are taken on every capture, for SCPI clients that never open the data plane
+		bool measuring = meas_enabled();
+
+		// So is the mask test, so that no failing capture goes uncounted
+		bool masking = g_deviceIsScope && mask_enabled();
+
+		// Bandwidth limited channels need the whole capture at once, so they are never streamed
+		bool filtering = g_deviceIsScope && bw_enabled();
+
+		if (!g_pendingAcquisition || !client) {
 			// LogWarning("Feed: !g_pendingAcquisition; ignoring to avoid buffering\n");
-			return;
-		}
+			client = NULL;
 
-		g_pendingAcquisition = false;
+			if (!calibrating && !averaging && !persisting && !spectrum && !measuring && !masking)
+				return;
+		} else if (!averaging && !spectrum) {
+			g_pendingAcquisition = false;
+		}
 
 		vector<int> sample_channels;
 		int chindex = 0;
@@ -126,14 +752,26 @@ void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafe
 			samplerate_hz /= 2;
 		}
 
-        size_t num_samples;
-        vector<uint8_t*> deinterleaved_buffers;
-        float trigphase = 0;
-        int32_t first_sample = 0;
-        uint32_t nominal_trigpos_in_samples = 0;
-        vector<bool> clipping;
-        for (int ch = 0; ch < numchans; ch++) clipping.push_back(false);
+		// Only channels the client subscribed to are deinterleaved and sent; the hardware keeps
+		// capturing (and triggering on) everything that is enabled.
+		uint64_t mask = (client || averaging || persisting || spectrum) ? (uint64_t)g_channelMask : 0;
+		vector<bool> sent;
+		uint16_t numsent = 0;
+		int trigindex = 0;
+		for (int ch = 0; ch < numchans; ch++) {
+			bool subscribed = (mask >> sample_channels[ch]) & 1;
+			sent.push_back(subscribed);
+			if (subscribed) numsent++;
+
+			if (sample_channels[ch] == g_selectedTriggerChannel)
+				trigindex = ch;
+		}
+
+		int64_t samplerate_fs = 1000000000000000 / samplerate_hz;
+		double wfms_s = g_hwRateClock.GetAverageHz();
 
+		size_t num_samples;
+		const uint8_t* in;
 		if (packet->type == SR_DF_LOGIC) {
 			struct sr_datafeed_logic* logic = (struct sr_datafeed_logic*)packet->payload;
 
@@ -146,163 +784,392 @@ void waveform_callback (const struct sr_dev_inst *device, const struct sr_datafe
 			// // ->format is always LA_CROSS_DATA
 			// // ->length appears to be in bytes
 
-			// // For N channels, yields 8 samples for each of the channels, then repeats
-			// // Each sample is 8 bits, with the most significant bit sampled last
-
 			num_samples = logic->length / numchans; // u8s per channel
-			for (int ch = 0; ch < numchans; ch++) {
-				deinterleaved_buffers.push_back(new uint8_t[num_samples]);
-			}
+			in = (const uint8_t*)logic->data;
+		} else {
+			struct sr_datafeed_dso* dso = (struct sr_datafeed_dso*)packet->payload;
 
-			uint8_t* p = (uint8_t*)logic->data;
-			for (size_t sample = 0; sample < num_samples; sample+=8) {
-				for (int ch = 0; ch < numchans; ch++) {
-					for (int i = 0; i < 8; i++) {
-						deinterleaved_buffers[ch][sample + i] = *(p++);
-					}
-				}
+			num_samples = dso->num_samples;
+			in = (const uint8_t*)dso->data;
+		}
+
+		// The whole message is laid out in one buffer: frame header, then for each sent channel its
+		// header and samples. Raw samples are deinterleaved straight into the message; channels that
+		// are only needed locally (the trigger channel, calibration) go to the buffer's scratch area.
+		int format = g_deviceIsScope ? g_sampleFormat : SAMPLE_RAW;
+		size_t sample_size = cal_sample_size(format);
+		size_t chheader_size = channel_header_size(format);
+
+		if (masking && mask_test(in, num_samples, sample_channels)) {
+			unsigned keep = mask_get_keep();
+			if (keep) {
+				retain_pin_capture(keep, seqnum, false, in, num_samples, sample_channels, samplerate_fs,
+					interleaved_trigphase(in, numchans, num_samples, trigindex), 0);
 			}
 
-        	uint32_t nominal_trigpos_in_bits = num_samples * 8 * g_trigpct / 100;
-        	// Where in the bitstream SHOULD the trigger be
+			if (mask_get_stop()) {
+				LogNotice("Capture %u failed the mask test; stopping\n", seqnum);
+				g_run = false;
+				sr_session_stop();
+			}
+		}
 
-        	uint32_t trigpos_in_bits = g_lastTrigPos * 8 * 2 / count_enabled_channels();
-        	// Where in the bitstream DID the trigger happen
+		if (measuring)
+			meas_submit(packet->type == SR_DF_LOGIC, in, num_samples, sample_channels, samplerate_fs);
 
-			first_sample = nominal_trigpos_in_bits - trigpos_in_bits;
+		if ((measuring || masking) && !client && !calibrating && !averaging && !persisting && !spectrum)
+			return;
 
-		} else { // DSO
-			struct sr_datafeed_dso* dso = (struct sr_datafeed_dso*)packet->payload;
+		if (client && !averaging && !spectrum && retain_enabled()) {
+			bool logic = packet->type == SR_DF_LOGIC;
+			retain_capture(seqnum, logic, in, num_samples, sample_channels, samplerate_fs,
+				logic ? 0 : interleaved_trigphase(in, numchans, num_samples, trigindex),
+				logic ? logic_first_sample(num_samples) : 0);
+		}
 
-			num_samples = dso->num_samples;
+		size_t chunk = g_chunkSamples & ~(size_t)7;
+
+		// Delta encoded channels are deinterleaved to scratch and encoded into the frame at the end
+		bool delta = client && g_deviceIsScope && format == SAMPLE_RAW && delta_enabled()
+			&& !calibrating && !averaging && !persisting && !spectrum;
+
+		size_t capacity = FRAME_HEADER_SIZE
+			+ numsent * (CHANNEL_ID_SIZE + chheader_size + num_samples * sample_size)
+			+ numchans * num_samples;
+		if (delta)
+			capacity += numsent * (channel_header_size(SAMPLE_DELTA_U8) + delta_max_size(num_samples));
+
+		// Small frames can be collected into a batch that costs the client one ack. A capture that
+		// goes out any other way flushes the open batch first, so frames stay in order.
+		bool batching = client && g_batchFrames > 1 && !calibrating && !averaging && !persisting && !spectrum
+			&& (packet->type != SR_DF_LOGIC || g_logicLayout == LAYOUT_CHANNEL)
+			&& (filtering || !(chunk && num_samples > chunk))
+			&& capacity <= BATCH_MAX_FRAME_BYTES;
+		if (!batching)
+			batch_flush();
+
+		if (client && packet->type == SR_DF_LOGIC && g_logicLayout == LAYOUT_BUS) {
+			send_bus_frame(client.get(), seqnum, in, num_samples, sample_channels, sent, samplerate_fs, wfms_s);
+			frame_delivered(callback_start_us);
+			return;
+		}
 
-			uint8_t* buf = (uint8_t*) dso->data;
+		if (client && packet->type == SR_DF_LOGIC && g_logicLayout == LAYOUT_EDGES
+			&& send_edge_frame(client.get(), seqnum, in, num_samples, sample_channels, sent, samplerate_fs, wfms_s)) {
+			frame_delivered(callback_start_us);
+			return;
+		}
 
-			for (int i = 0; i < numchans; i++) {
-				deinterleaved_buffers.push_back(new uint8_t[num_samples]);
-			}
+		// Deep captures can go out in pieces, each on the wire while the next is deinterleaved
+		if (chunk && client && num_samples > chunk && !calibrating && !averaging && !persisting && !spectrum && !filtering) {
+			send_chunked_frame(client, seqnum, in, packet->type == SR_DF_LOGIC, num_samples, sample_channels, sent,
+				trigindex, samplerate_fs, wfms_s, chunk);
+			frame_delivered(callback_start_us);
+			return;
+		}
 
-			uint8_t* p = buf;
-			for (size_t sample = 0; sample < num_samples; sample++) {
-				for (int ch = 0; ch < numchans; ch++) {
-					uint8_t d = *p;
-					if (d <= g_hwmin || d >= g_hwmax) {
-						clipping[ch] = true;
-					}
+		// Too deep to build as one message: the same pieces, whatever DATA:CHUNK says
+		if (client && numsent * num_samples * sample_size > STREAM_MIN_BYTES
+			&& !calibrating && !averaging && !persisting && !spectrum && !filtering) {
+			send_chunked_frame(client, seqnum, in, packet->type == SR_DF_LOGIC, num_samples, sample_channels, sent,
+				trigindex, samplerate_fs, wfms_s, STREAM_PIECE_SAMPLES);
+			frame_delivered(callback_start_us);
+			return;
+		}
 
-					deinterleaved_buffers[ch][sample] = d;
-					p++;
+		static std::shared_ptr<FramePool> s_localPool = std::make_shared<FramePool>(2);
+		std::shared_ptr<FrameBuffer> frame;
+		if (batching)
+			frame = batch_begin_frame(client, capacity, callback_start_us);
+		else
+			frame = client ? client->Acquire(capacity) : s_localPool->Acquire(capacity);
+
+		put_frame_header(*frame, seqnum, numsent, samplerate_fs, wfms_s);
+
+		vector<uint8_t*> deinterleaved_buffers(numchans, NULL);
+		vector<uint8_t*> channel_headers(numchans, NULL);
+		vector<uint8_t*> converted(numchans, NULL);
+		for (int ch = 0; ch < numchans; ch++) {
+			if (sent[ch] && delta) {
+				deinterleaved_buffers[ch] = frame->Scratch(num_samples);
+			} else if (sent[ch]) {
+				//Channel ID, memory depth
+				frame->Put((size_t)sample_channels[ch]);
+				frame->Put(num_samples);
+				channel_headers[ch] = frame->Append(chheader_size);
+
+				if (format == SAMPLE_RAW || averaging) {
+					deinterleaved_buffers[ch] = frame->Append(num_samples);
+				} else {
+					converted[ch] = frame->Append(num_samples * sample_size);
+					deinterleaved_buffers[ch] = frame->Scratch(num_samples);
 				}
+			} else if (calibrating || (g_deviceIsScope && ch == trigindex)) {
+				deinterleaved_buffers[ch] = frame->Scratch(num_samples);
 			}
+		}
+
+        float trigphase = 0;
+        int32_t first_sample = 0;
+        uint32_t nominal_trigpos_in_samples = 0;
+        std::unique_ptr<bool[]> clipping(new bool[numchans]());
+
+		if (packet->type == SR_DF_LOGIC) {
+			// // For N channels, yields 8 samples for each of the channels, then repeats
+			// // Each sample is 8 bits, with the most significant bit sampled last
+
+			deinterleave_logic(in, numchans, num_samples, deinterleaved_buffers.data());
+
+			first_sample = logic_first_sample(num_samples);
+
+		} else { // DSO
+			deinterleave_dso(in, numchans, num_samples, deinterleaved_buffers.data(), clipping.get());
 
 			// Why not use g_lastTrigPos? It's not updated if we update the trigger unless we stop/start capture
 			//  again.
         	nominal_trigpos_in_samples = num_samples * g_trigpct / 100;
 
-			trigphase = InterpolateTriggerTime(g_channels[g_selectedTriggerChannel], deinterleaved_buffers[g_selectedTriggerChannel], nominal_trigpos_in_samples);
+			trigphase = InterpolateTriggerTime(g_channels[g_selectedTriggerChannel], deinterleaved_buffers[trigindex], nominal_trigpos_in_samples);
 			if (trigphase == 999) trigphase = 0;
 			// trigphase needs to come from the channel that the trigger is on for all channels.
 			// TODO: does this mean we need to offset the other channel by samplerate_fs/2 though if the
 			// ADC sample is 180deg out of phase?
 		}
 
-		client->SendLooped((uint8_t*)&seqnum, sizeof(seqnum));
-
-		client->SendLooped((uint8_t*)&numchans, sizeof(numchans));
+		if (calibrating) {
+			for (int ch = 0; ch < numchans; ch++)
+				cal_accumulate(sample_channels[ch], deinterleaved_buffers[ch], num_samples);
+		}
 
-		int64_t samplerate_fs = 1000000000000000 / samplerate_hz;
-		client->SendLooped((uint8_t*)&samplerate_fs, sizeof(samplerate_fs));
+		// Everything from here on sees bandwidth limited samples. IIR filters delay the signal, which
+		// each channel's trigger phase makes up for.
+		vector<float> trigdelay(numchans, 0);
+		if (filtering) {
+			for (int ch = 0; ch < numchans; ch++) {
+				if (sent[ch])
+					trigdelay[ch] = bw_filter(sample_channels[ch], deinterleaved_buffers[ch], num_samples, samplerate_fs);
+			}
+		}
 
-		uint64_t trig_fs = g_trigfs;
-		client->SendLooped((uint8_t*)&trig_fs, sizeof(trig_fs));
+		vector<size_t> chnums;
+		vector<const uint8_t*> chsamples;
+		vector<int> chshifts;
+		for (int ch = 0; ch < numchans; ch++) {
+			if (sent[ch]) {
+				chnums.push_back(sample_channels[ch]);
+				chsamples.push_back(deinterleaved_buffers[ch]);
+				chshifts.push_back(lroundf(trigphase + trigdelay[ch]));
+			}
+		}
 
-		double delta_s = ((double)(get_ms() - g_session_start_ms)) / 1000;
+		if (persisting)
+			persist_accumulate(chnums, chsamples, chshifts, num_samples, samplerate_fs);
 
-		double wfms_s = g_hwRateClock.GetAverageHz();
+		if (spectrum) {
+			// Takes precedence over averaging
+			spectrum_submit(seqnum, chnums, chsamples, num_samples, samplerate_fs);
+			return;
+		}
 
-		client->SendLooped((uint8_t*)&wfms_s, sizeof(wfms_s));
+		if (averaging) {
+			// A finished average waiting for the client's ack holds off the next one
+			if (avg_begin_frame(chnums, num_samples, samplerate_fs)) {
+				for (int ch = 0; ch < numchans; ch++) {
+					if (sent[ch])
+						avg_accumulate(sample_channels[ch], deinterleaved_buffers[ch], num_samples, trigphase + trigdelay[ch], clipping[ch]);
+				}
+				avg_end_frame();
+			}
 
-		if ((delta_s - g_lastReportedRate) > 10) {
-			g_lastReportedRate = delta_s;
+			if (client && avg_complete() && !chnums.empty()) {
+				g_pendingAcquisition = false;
+				send_average(client.get(), seqnum, samplerate_fs, wfms_s);
+				avg_reset();
+			}
 
-			LogDebug("WaveformServerThread/bus: Seq#%u: %lu samples on %d channels, HW WFMs/s=%f\n", seqnum, num_samples, numchans, wfms_s);
+			return;
 		}
 
-		chindex = 0;
-		for (size_t chnum : sample_channels) {
-			//Send channel ID, memory depth
-			client->SendLooped((uint8_t*)&chnum, sizeof(chnum));
-			client->SendLooped((uint8_t*)&num_samples, sizeof(num_samples));
+		if (!client) {
+			return;
+		}
 
-			struct sr_channel* ch = g_channels[chnum];
+		double delta_s = ((double)(get_ms() - g_session_start_ms)) / 1000;
 
-			if (g_deviceIsScope) {
-				float scale, offset;
-				compute_scale_and_offset(ch, scale, offset);
+		if ((delta_s - g_lastReportedRate) > 10) {
+			g_lastReportedRate = delta_s;
 
-				float config[3] = {scale, offset, trigphase};
-				client->SendLooped((uint8_t*)&config, sizeof(config));
+			LogDebug("WaveformServerThread/bus: Seq#%u: %lu samples on %d/%d channels, HW WFMs/s=%f\n", seqnum, num_samples, numsent, numchans, wfms_s);
+		}
 
-				bool ch_clipping = clipping[chindex];
-				client->SendLooped((uint8_t*)&ch_clipping, sizeof(ch_clipping));
-			} else {
-				client->SendLooped((uint8_t*)&first_sample, sizeof(first_sample));
-			}
+		for (int ch = 0; ch < numchans; ch++) {
+			if (!channel_headers[ch])
+				continue;
 
-			//Send the actual waveform data
-			client->SendLooped(deinterleaved_buffers[chindex], num_samples * sizeof(int8_t));
+			size_t chnum = sample_channels[ch];
+			put_channel_header(channel_headers[ch], chnum, format, trigphase + trigdelay[ch], clipping[ch], first_sample);
 
-			chindex++;
+			if (format != SAMPLE_RAW)
+				cal_convert(chnum, format, deinterleaved_buffers[ch], converted[ch], num_samples);
 		}
 
-		for (auto i : deinterleaved_buffers) {
-			delete[] i;
+		if (delta) {
+			bool key = delta_begin_frame(num_samples);
+			size_t chheader_delta = channel_header_size(SAMPLE_DELTA_U8);
+			for (int ch = 0; ch < numchans; ch++) {
+				if (!sent[ch])
+					continue;
+
+				size_t chnum = sample_channels[ch];
+				frame->Put(chnum);
+				frame->Put(num_samples);
+				put_channel_header(frame->Append(chheader_delta), chnum, SAMPLE_DELTA_U8, trigphase + trigdelay[ch],
+					clipping[ch], first_sample);
+				delta_encode_channel(chnum, deinterleaved_buffers[ch], num_samples, key, *frame);
+			}
+		} else {
+			// Full samples (or calibrated ones) replace the client's reference
+			delta_reset();
 		}
 
-		if (g_oneShot) {
-			LogDebug("Stopping after oneshot\n");
-			g_run = false;
-			sr_session_stop();
+		if (batching) {
+			batch_end_frame();
+			return;
 		}
+
+		client->Send(frame);
+		frame_delivered(callback_start_us);
 	}
 }
 
-void syncWaitThread(Socket* client) {
+void syncWait(std::shared_ptr<DataTransport> client) {
 	for (;;) {
 		uint8_t r = '0';
-		client->RecvLooped(&r, 1);
-		if (r != 'K') {
+		if (!client->RecvAck(r)) {
 			// Disconnected
 			return;
 		}
 
-		g_pendingAcquisition = true;
+		if (r == 'K') {
+			g_pendingAcquisition = true;
+			spectrum_notify_ack();
+			tune_frame_acked();
+		} else if (r == 'H') {
+			// Persistence snapshot, sent from here so it doesn't hold up the capture path
+			persist_snapshot(client);
+		} else if (r == 'Q') {
+			// Range of a retained capture
+			if (!retain_query(client))
+				return;
+		} else {
+			return;
+		}
 	}
 }
 
+/**
+	@brief The data plane client, if it is waiting for a frame; claims the frame it asked for
+ */
+std::shared_ptr<DataTransport> take_pending_client()
+{
+	std::shared_ptr<DataTransport> client = std::atomic_load(&g_dataClient);
+	if (!client || !g_pendingAcquisition.exchange(false))
+		return NULL;
+
+	return client;
+}
+
+/**
+	@brief Drop the current data plane client, if any, and unblock its ack reader
+ */
+void disconnect_data_client()
+{
+	std::shared_ptr<DataTransport> client = std::atomic_exchange(&g_dataClient, std::shared_ptr<DataTransport>());
+	if (client)
+		client->Shutdown();
+}
+
+/**
+	@brief Accepts data plane connections for the lifetime of one control plane client
+
+	Each accepted socket is published as the callback's sink until it disconnects. The capture
+	session itself is owned by SessionThread and keeps running across reconnects.
+ */
 void WaveformServerThread()
 {
-	#ifdef __linux__
-	pthread_setname_np(pthread_self(), "WaveformServerThread");
-	#endif
+	apply_thread_policy("waveform");
+
+	while (!g_quit) {
+		// Poll so that we notice the control plane going away while nobody is connecting
+		pollfd pfds[2] = {{g_dataSocket, POLLIN, 0}, {g_shmListener, POLLIN, 0}};
+		nfds_t npfds = g_shmListener >= 0 ? 2 : 1;
+		uint64_t start = now_us();
+		if (poll(pfds, npfds, 100) <= 0) {
+			note_wakeup(100000, now_us() - start);
+			continue;
+		}
 
-	Socket client = g_dataSocket.Accept();
-	LogVerbose("Client connected to data plane socket\n");
+		std::shared_ptr<DataTransport> client;
+		if (pfds[0].revents & POLLIN) {
+			Socket accepted = g_dataSocket.Accept();
+			if(!accepted.IsValid())
+				continue;
 
-	if(!client.IsValid())
-		return;
-	if(!client.DisableNagle())
-		LogWarning("Failed to disable Nagle on socket, performance may be poor\n");
+			if(!accepted.DisableNagle())
+				LogWarning("Failed to disable Nagle on socket, performance may be poor\n");
 
-	sr_session_datafeed_callback_add(waveform_callback, &client);
+			client = make_data_transport(accepted.Detach());
+		} else {
+			int fd = accept4(g_shmListener, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
 
-	std::thread dataThread(syncWaitThread, &client);
+			client = make_shm_transport(fd);
+		}
 
-	for (;;) {
-		if (g_quit) {
-			return;
-		} else if (!g_run) {
-			usleep(100);
+		serve_data_client(client);
+	}
+}
+
+/**
+	@brief Make `client` the callback's sink and handle its requests until it goes away
+ */
+void serve_data_client(std::shared_ptr<DataTransport> client)
+{
+	LogVerbose("Client connected to data plane (%s)\n", client->GetName());
+
+	// A new client always starts by requesting a waveform, and has no frame to take deltas against
+	g_pendingAcquisition = false;
+	delta_reset();
+	std::atomic_store(&g_dataClient, client);
+
+	syncWait(client);
+
+	// Only clear the sink if it is still ours (disconnect_data_client may have beaten us to it)
+	std::atomic_compare_exchange_strong(&g_dataClient, &client, std::shared_ptr<DataTransport>());
+	LogVerbose("Client disconnected from data plane (%s)\n", client->GetName());
+}
+
+/**
+	@brief Owns the libsigrok session for the lifetime of the process
+
+	The datafeed callback is registered exactly once here, so that reconnecting clients do not
+	accumulate callbacks, and the device stays armed while no client is attached.
+ */
+void SessionThread()
+{
+	apply_thread_policy("session");
+	deinterleave_init();
+
+	sr_session_datafeed_callback_add(waveform_callback, NULL);
+
+	if (g_probeDepths)
+		probe_sample_depths();
+	g_sessionReady = true;
+
+	while (!g_shutdown) {
+		if (!g_run) {
+			policed_usleep(100);
 			continue;
 		}
 
@@ -315,14 +1182,16 @@ void WaveformServerThread()
 		int err;
 		if ((err = sr_session_start()) != SR_OK) {
 			LogError("session_start returned failure: %d\n", err);
-			return;
+			g_running = false;
+			g_run = false;
+			continue;
 		}
 
 		// force_correct_sample_config();
 
 		if ((err = sr_session_run()) != SR_OK) {
 			LogError("session_run returned failure: %d\n", err);
-			return;
+			g_run = false;
 		}
 
 		g_running = false;
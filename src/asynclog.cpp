@@ -0,0 +1,214 @@
+
+#include "asynclog.h"
+#include "server.h"
+#include "threading.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+AsyncLogSink* g_asyncLog = NULL;
+
+AsyncLogSink::AsyncLogSink(LogSink* inner, Severity min_severity)
+	: LogSink(min_severity)
+	, m_inner(inner)
+	, m_slots(new slot[SLOTS])
+	, m_head(0)
+	, m_tail(0)
+	, m_dropped(0)
+	, m_droppedTotal(0)
+	, m_lastSeverity(Severity::DEBUG)
+	, m_repeats(0)
+	, m_repeatsSinceMs(0)
+	, m_windowStartMs(get_ms())
+	, m_windowLines(0)
+	, m_suppressed(0)
+	, m_stop(false)
+{
+	for (size_t i = 0; i < SLOTS; i++)
+		m_slots[i].seq = i;
+
+	m_thread = std::thread(&AsyncLogSink::Run, this);
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+	m_stop = true;
+	m_thread.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Producer side, on whatever thread is logging
+
+/**
+	@brief Reserve the next free slot, or NULL (and count a drop) if the ring is full
+
+	Bounded MPSC ring: each slot's seq says whose turn it is. A slot is free for position `pos`
+	when seq == pos and holds a message for the reader when seq == pos + 1.
+ */
+AsyncLogSink::slot* AsyncLogSink::Claim()
+{
+	size_t pos = m_head.load(std::memory_order_relaxed);
+	for (;;) {
+		slot* s = &m_slots[pos % SLOTS];
+		size_t seq = s->seq.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return s;
+		} else if (diff < 0) {
+			m_dropped++;
+			m_droppedTotal++;
+			return NULL;
+		} else {
+			pos = m_head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void AsyncLogSink::Publish(slot* s, Severity severity)
+{
+	s->severity = severity;
+	s->seq.store(s->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void AsyncLogSink::Log(Severity severity, const std::string &msg)
+{
+	if (severity > m_minSeverity)
+		return;
+
+	if (severity == Severity::FATAL) {
+		m_inner->Log(severity, msg);
+		return;
+	}
+
+	slot* s = Claim();
+	if (!s)
+		return;
+
+	size_t len = std::min(msg.size(), LINE_MAX - 1);
+	memcpy(s->text, msg.c_str(), len);
+	s->text[len] = 0;
+	Publish(s, severity);
+}
+
+void AsyncLogSink::Log(Severity severity, const char *format, va_list va)
+{
+	if (severity > m_minSeverity)
+		return;
+
+	if (severity == Severity::FATAL) {
+		m_inner->Log(severity, format, va);
+		return;
+	}
+
+	slot* s = Claim();
+	if (!s)
+		return;
+
+	// Long messages are cut short, but keep their line ending
+	int len = vsnprintf(s->text, LINE_MAX, format, va);
+	if (len >= (int)LINE_MAX && format[strlen(format) - 1] == '\n')
+		strcpy(s->text + LINE_MAX - 5, "...\n");
+	else if (len < 0)
+		s->text[0] = 0;
+
+	Publish(s, severity);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Logger thread
+
+void AsyncLogSink::Run()
+{
+	apply_thread_policy("logger");
+
+	while (!m_stop) {
+		Drain();
+		policed_usleep(10000);
+	}
+
+	Drain();
+	FlushRepeats();
+	ReportLosses();
+}
+
+void AsyncLogSink::Drain()
+{
+	for (;;) {
+		slot* s = &m_slots[m_tail % SLOTS];
+		if (s->seq.load(std::memory_order_acquire) != m_tail + 1)
+			break;
+
+		if (s->severity == m_lastSeverity && m_last == s->text) {
+			if (!m_repeats)
+				m_repeatsSinceMs = get_ms();
+			m_repeats++;
+		} else {
+			FlushRepeats();
+			m_last = s->text;
+			m_lastSeverity = s->severity;
+			Emit(s->severity, s->text);
+		}
+
+		// Hand the slot back for the producers' next lap of the ring
+		s->seq.store(m_tail + SLOTS, std::memory_order_release);
+		m_tail++;
+	}
+
+	// Don't sit on a repeat count forever if the storm simply stops
+	if (m_repeats && get_ms() - m_repeatsSinceMs >= 1000)
+		FlushRepeats();
+
+	if (get_ms() - m_windowStartMs >= 1000)
+		ReportLosses();
+}
+
+/**
+	@brief Write one line to the wrapped sink, unless this second's quota is used up
+ */
+void AsyncLogSink::Emit(Severity severity, const char* text)
+{
+	if (m_windowLines >= LOG_RATE_LINES) {
+		m_suppressed++;
+		return;
+	}
+
+	m_windowLines++;
+	m_inner->Log(severity, std::string(text));
+}
+
+void AsyncLogSink::FlushRepeats()
+{
+	if (!m_repeats)
+		return;
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "(last message repeated %lu more times)\n", (unsigned long)m_repeats);
+	m_repeats = 0;
+	Emit(m_lastSeverity, buf);
+}
+
+/**
+	@brief Say how many messages were lost to the rate limit and the full ring, then start a new second
+ */
+void AsyncLogSink::ReportLosses()
+{
+	char buf[96];
+
+	if (m_suppressed) {
+		snprintf(buf, sizeof(buf), "Log: %lu messages suppressed by rate limit\n", (unsigned long)m_suppressed);
+		m_inner->Log(Severity::WARNING, std::string(buf));
+		m_suppressed = 0;
+	}
+
+	uint64_t dropped = m_dropped.exchange(0);
+	if (dropped) {
+		snprintf(buf, sizeof(buf), "Log: %lu messages dropped (queue full)\n", (unsigned long)dropped);
+		m_inner->Log(Severity::WARNING, std::string(buf));
+	}
+
+	m_windowStartMs = get_ms();
+	m_windowLines = 0;
+}
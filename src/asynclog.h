@@ -0,0 +1,79 @@
+
+#ifndef asynclog_h
+#define asynclog_h
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "log/log.h"
+
+/**
+	@brief Log sink that takes messages off the calling thread
+
+	Log() formats into a slot of a fixed-size lock-free ring and returns; a "logger" thread drains
+	the ring into the wrapped sink. So a warning on the session thread costs one bounded
+	vsnprintf and a compare-and-swap, never terminal I/O. When the ring is full the message is
+	dropped and counted.
+
+	The logger thread also collapses runs of identical messages into one line plus a repeat count,
+	and holds output to LOG_RATE_LINES lines per second, reporting how many it suppressed and
+	dropped. Fatal messages are written straight through, since the process is about to go.
+ */
+class AsyncLogSink : public LogSink
+{
+public:
+	AsyncLogSink(LogSink* inner, Severity min_severity);
+	virtual ~AsyncLogSink();
+
+	virtual void Log(Severity severity, const std::string &msg);
+	virtual void Log(Severity severity, const char *format, va_list va);
+
+	uint64_t GetDropped() const { return m_droppedTotal; }
+
+protected:
+	static const size_t SLOTS = 1024;
+	static const size_t LINE_MAX = 256;
+	static const unsigned LOG_RATE_LINES = 100;
+
+	struct slot {
+		std::atomic<size_t> seq;
+		Severity severity;
+		char text[LINE_MAX];
+	};
+
+	slot* Claim();
+	void Publish(slot* s, Severity severity);
+
+	void Run();
+	void Drain();
+	void Emit(Severity severity, const char* text);
+	void FlushRepeats();
+	void ReportLosses();
+
+	std::unique_ptr<LogSink> m_inner;
+	std::unique_ptr<slot[]> m_slots;
+	std::atomic<size_t> m_head;
+	size_t m_tail;
+
+	std::atomic<uint64_t> m_dropped;
+	std::atomic<uint64_t> m_droppedTotal;
+
+	// Logger thread state
+	std::string m_last;
+	Severity m_lastSeverity;
+	uint64_t m_repeats;
+	uint64_t m_repeatsSinceMs;
+	uint64_t m_windowStartMs;
+	unsigned m_windowLines;
+	uint64_t m_suppressed;
+
+	std::atomic<bool> m_stop;
+	std::thread m_thread;
+};
+
+extern AsyncLogSink* g_asyncLog;
+
+#endif // asynclog_h
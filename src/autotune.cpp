@@ -0,0 +1,192 @@
+
+#include "autotune.h"
+#include "server.h"
+#include "devicequeue.h"
+#include "threading.h"
+#include "log/log.h"
+
+#include <algorithm>
+#include <mutex>
+
+// Measurements are judged over at least this long, and this many frames
+static const uint64_t TUNE_WINDOW_US = 1000000;
+static const uint64_t TUNE_WINDOW_FRAMES = 3;
+
+// Predicted frame time must be this far under budget before moving to a faster rate
+static const double TUNE_UP_MARGIN = 0.8;
+
+// DSLogic won't take captures this short (as in GetSampleDepths)
+static const uint64_t LOGIC_MIN_DEPTH = 1000;
+
+static std::atomic<bool> s_enabled{false};
+
+static std::mutex s_mutex;
+static double s_target = 10;
+static double s_span = 0;
+static double s_measured = 0;
+
+// Current window
+static uint64_t s_windowStart = 0;
+static uint64_t s_frames = 0;
+static uint64_t s_busy = 0;
+static uint64_t s_lastSent = 0;
+static uint64_t s_lastCallback = 0;
+
+// The first window after a change still has frames captured with the old setting
+static bool s_settling = false;
+
+void tune_set_enabled(bool enabled) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_enabled = enabled;
+	s_windowStart = 0;
+	s_lastSent = 0;
+}
+
+bool tune_enabled() {
+	return s_enabled;
+}
+
+void tune_set_target(double wfms) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_target = wfms;
+}
+
+double tune_get_target() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return s_target;
+}
+
+void tune_set_span(double seconds) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_span = seconds;
+}
+
+double tune_get_span() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return s_span;
+}
+
+std::string tune_state() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return std::to_string(g_rate) + "," + std::to_string(g_depth) + "," + std::to_string(s_measured);
+}
+
+/**
+	@brief Note a frame handed to the client: when its callback started and when it was sent
+ */
+void tune_frame_sent(uint64_t start_us, uint64_t end_us) {
+	if (!s_enabled)
+		return;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_lastCallback = end_us - start_us;
+	s_lastSent = end_us;
+}
+
+/**
+	@brief Pick the rate and depth predicted to meet the target, from one window's measurements
+ */
+static void retune(double cycle_s, double busy_s) {
+	uint64_t rate = g_rate;
+	uint64_t depth = g_depth;
+	if (!rate || !depth)
+		return;
+
+	// Frame time = overhead + depth * per_sample + depth / rate
+	double per_sample_s = busy_s / depth;
+	double overhead_s = std::max(0.0, cycle_s - busy_s - (double)depth / rate);
+	double budget_s = 1 / s_target;
+
+	std::vector<uint64_t> rates = g_rate_options;
+	std::sort(rates.begin(), rates.end());
+
+	std::vector<uint64_t> depths;
+	for (uint64_t d : sample_depth_steps(max_capture_depth())) {
+		if (g_deviceIsScope || d > LOGIC_MIN_DEPTH)
+			depths.push_back(d);
+	}
+	if (rates.empty() || depths.empty())
+		return;
+
+	uint64_t best_rate = 0, best_depth = 0;
+	for (auto r = rates.rbegin(); r != rates.rend() && !best_rate; r++) {
+		double limit_s = budget_s * (*r > rate ? TUNE_UP_MARGIN : 1);
+		for (auto d = depths.rbegin(); d != depths.rend(); d++) {
+			if ((double)*d / *r < s_span)
+				break;
+
+			if (overhead_s + *d * per_sample_s + (double)*d / *r <= limit_s) {
+				best_rate = *r;
+				best_depth = *d;
+				break;
+			}
+		}
+	}
+
+	if (!best_rate) {
+		// Nothing meets the target; the span still has to be covered, as cheaply as possible
+		best_rate = rates.front();
+		best_depth = depths.back();
+		for (uint64_t d : depths) {
+			if ((double)d / best_rate >= s_span) {
+				best_depth = d;
+				break;
+			}
+		}
+	}
+
+	if (best_rate == rate && best_depth == depth)
+		return;
+
+	LogDebug("Auto-tune: %.1f WFM/s at %lu S/s, %lu samples; now %lu S/s, %lu samples\n",
+		s_measured, rate, depth, best_rate, best_depth);
+
+	device_submit(device_key(DEVICE_RATE), [=]() {
+		set_rate(best_rate);
+	}, true);
+	device_submit(device_key(DEVICE_DEPTH), [=]() {
+		set_depth(best_depth);
+	}, true);
+
+	s_settling = true;
+}
+
+/**
+	@brief Note the client's ack of the last frame, retuning once a window is complete
+ */
+void tune_frame_acked() {
+	if (!s_enabled)
+		return;
+
+	uint64_t now = now_us();
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if (!s_lastSent)
+		return;
+
+	// Callback, then send until the client has taken the frame
+	s_busy += s_lastCallback + (now - s_lastSent);
+	s_lastSent = 0;
+
+	if (!s_windowStart) {
+		s_windowStart = now;
+		s_frames = 0;
+		s_busy = 0;
+		return;
+	}
+
+	s_frames++;
+	uint64_t elapsed = now - s_windowStart;
+	if (elapsed < TUNE_WINDOW_US || s_frames < TUNE_WINDOW_FRAMES)
+		return;
+
+	s_measured = s_frames * 1e6 / elapsed;
+	if (!s_settling)
+		retune((double)elapsed / s_frames / 1e6, (double)s_busy / s_frames / 1e6);
+	else
+		s_settling = false;
+
+	s_windowStart = now;
+	s_frames = 0;
+	s_busy = 0;
+}
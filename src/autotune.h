@@ -0,0 +1,31 @@
+
+#ifndef autotune_h
+#define autotune_h
+
+#include <stdint.h>
+#include <string>
+
+/*
+	Auto-tuning: with TUNE:ENABLE 1 the bridge chooses sample rate and depth itself, aiming for
+	TUNE:TARGET waveforms per second at the client while every capture still covers at least
+	TUNE:SPAN seconds. Rates come from the device's list and depths from the GetSampleDepths()
+	ladder, so the tuner never picks a setting a client couldn't.
+
+	Once a second it takes the measured time between acks, time spent in the callback and time from
+	send to ack, models a frame as fixed overhead + per-sample cost + acquisition time, and moves to
+	the highest rate (then deepest depth) predicted to meet the target. Moving up needs 20% headroom
+	so it doesn't oscillate. TUNE:STATE? reports "rate,depth,wfm/s" as last chosen and measured.
+ */
+
+void tune_set_enabled(bool enabled);
+bool tune_enabled();
+void tune_set_target(double wfms);
+double tune_get_target();
+void tune_set_span(double seconds);
+double tune_get_span();
+std::string tune_state();
+
+void tune_frame_sent(uint64_t start_us, uint64_t end_us);
+void tune_frame_acked();
+
+#endif // autotune_h
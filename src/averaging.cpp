@@ -0,0 +1,192 @@
+
+#include "averaging.h"
+#include "server.h"
+#include "log/log.h"
+
+#include <atomic>
+#include <algorithm>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AVG_HAVE_AVX2_PATH
+#endif
+
+struct avg_channel {
+	std::vector<uint32_t> acc;
+	uint64_t vdiv;
+	bool clipping;
+	double phaseSum;
+};
+
+static std::atomic<uint32_t> s_count{0};
+static std::atomic<bool> s_resetRequested{false};
+
+// Everything below belongs to the session thread
+static std::vector<size_t> s_chnums;
+static std::vector<avg_channel> s_channels;
+static size_t s_depth = 0;
+static int64_t s_samplerate_fs = 0;
+static uint32_t s_frames = 0;
+
+/**
+	@brief Set the number of captures per averaged frame; 0 or 1 turns averaging off
+ */
+void avg_set_count(uint32_t count) {
+	if (count > AVG_MAX_COUNT)
+		count = AVG_MAX_COUNT;
+
+	s_count = count;
+	s_resetRequested = true;
+}
+
+uint32_t avg_get_count() {
+	return s_count;
+}
+
+bool avg_enabled() {
+	return s_count > 1;
+}
+
+void avg_reset() {
+	s_frames = 0;
+	for (auto& ch : s_channels) {
+		std::fill(ch.acc.begin(), ch.acc.end(), 0);
+		ch.clipping = false;
+		ch.phaseSum = 0;
+	}
+}
+
+/**
+	@brief Start accumulating a capture of `chnums`, restarting the average if the configuration changed
+
+	Returns false if the previous average is complete and still waiting to be sent.
+ */
+bool avg_begin_frame(const std::vector<size_t>& chnums, size_t num_samples, int64_t samplerate_fs) {
+	bool changed = s_resetRequested.exchange(false)
+		|| chnums != s_chnums || num_samples != s_depth || samplerate_fs != s_samplerate_fs;
+
+	if (!changed) {
+		for (size_t chnum : chnums) {
+			if (s_channels[chnum].vdiv != get_vdiv(chnum))
+				changed = true;
+		}
+	}
+
+	if (changed) {
+		if (s_frames)
+			LogDebug("Configuration changed, restarting average after %u frames\n", s_frames);
+
+		s_chnums = chnums;
+		s_depth = num_samples;
+		s_samplerate_fs = samplerate_fs;
+
+		s_channels.resize(g_channels.size());
+		for (size_t chnum : chnums) {
+			s_channels[chnum].acc.assign(num_samples, 0);
+			s_channels[chnum].vdiv = get_vdiv(chnum);
+		}
+
+		avg_reset();
+	}
+
+	return !avg_complete();
+}
+
+static void widening_add_scalar(uint32_t* acc, const uint8_t* in, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		acc[i] += in[i];
+}
+
+#ifdef AVG_HAVE_AVX2_PATH
+__attribute__((target("avx2")))
+static void widening_add_avx2(uint32_t* acc, const uint8_t* in, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i codes = _mm_loadu_si128((const __m128i*)(in + i));
+		__m256i lo = _mm256_cvtepu8_epi32(codes);
+		__m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(codes, 8));
+
+		__m256i* a = (__m256i*)(acc + i);
+		_mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), lo));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), hi));
+	}
+
+	widening_add_scalar(acc + i, in + i, count - i);
+}
+
+static const bool s_haveAVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+static void widening_add(uint32_t* acc, const uint8_t* in, size_t count) {
+	#ifdef AVG_HAVE_AVX2_PATH
+	if (s_haveAVX2) {
+		widening_add_avx2(acc, in, count);
+		return;
+	}
+	#endif
+	widening_add_scalar(acc, in, count);
+}
+
+/**
+	@brief Add one channel of a capture, shifted by whole samples to line up its trigger
+
+	`trigphase` is the channel's trigger phase, including any delay its filtering added. It is
+	rounded to a shift, so aligned sample j is captured sample j + shift, and the remainder is
+	averaged. Samples shifted in at either end repeat the edge sample.
+ */
+void avg_accumulate(size_t chnum, const uint8_t* samples, size_t count, float trigphase, bool clipping) {
+	avg_channel& ch = s_channels[chnum];
+	uint32_t* acc = ch.acc.data();
+	int shift = lroundf(trigphase);
+
+	size_t s = std::min((size_t)abs(shift), count - 1);
+	if (shift >= 0) {
+		widening_add(acc, samples + s, count - s);
+		for (size_t i = count - s; i < count; i++)
+			acc[i] += samples[count - 1];
+	} else {
+		for (size_t i = 0; i < s; i++)
+			acc[i] += samples[0];
+		widening_add(acc + s, samples, count - s);
+	}
+
+	ch.clipping |= clipping;
+	ch.phaseSum += trigphase - shift;
+}
+
+void avg_end_frame() {
+	s_frames++;
+}
+
+bool avg_complete() {
+	return s_frames && s_frames >= s_count;
+}
+
+const std::vector<size_t>& avg_channels() {
+	return s_chnums;
+}
+
+size_t avg_depth() {
+	return s_depth;
+}
+
+float avg_trigphase(size_t chnum) {
+	return s_frames ? s_channels[chnum].phaseSum / s_frames : 0;
+}
+
+bool avg_clipping(size_t chnum) {
+	return s_channels[chnum].clipping;
+}
+
+/**
+	@brief Averaged ADC codes of channel `chnum` in 8.8 fixed point, avg_depth() of them
+ */
+void avg_output(size_t chnum, uint16_t* out) {
+	const uint32_t* acc = s_channels[chnum].acc.data();
+	uint64_t frames = s_frames;
+
+	for (size_t i = 0; i < s_depth; i++)
+		out[i] = (((uint64_t)acc[i] << 8) + frames / 2) / frames;
+}
@@ -0,0 +1,38 @@
+
+#ifndef averaging_h
+#define averaging_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+	Server-side averaging of analog frames. With a count N > 1 set, every capture is accumulated
+	(whether or not the client is waiting for one) and the client receives one frame per N
+	captures, with samples in SAMPLE_AVG_U16 (or the selected calibrated format).
+
+	Frames are aligned on the trigger to the nearest sample before being summed; the remaining
+	sub-sample phase is averaged per channel and sent as that channel's trigphase.
+ */
+
+// Longest average; keeps the 8.8 output and its rounding in range
+static const uint32_t AVG_MAX_COUNT = 65536;
+
+void avg_set_count(uint32_t count);
+uint32_t avg_get_count();
+bool avg_enabled();
+
+bool avg_begin_frame(const std::vector<size_t>& chnums, size_t num_samples, int64_t samplerate_fs);
+void avg_accumulate(size_t chnum, const uint8_t* samples, size_t count, float trigphase, bool clipping);
+void avg_end_frame();
+
+bool avg_complete();
+void avg_reset();
+
+const std::vector<size_t>& avg_channels();
+size_t avg_depth();
+float avg_trigphase(size_t chnum);
+bool avg_clipping(size_t chnum);
+void avg_output(size_t chnum, uint16_t* out);
+
+#endif // averaging_h
@@ -0,0 +1,359 @@
+
+#include "bridge.h"
+#include "server.h"
+#include "SigrokSCPIServer.h"
+#include "calibration.h"
+#include "threading.h"
+#include "devicequeue.h"
+#include "autotune.h"
+#include "delta.h"
+#include "log/log.h"
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/**
+	@brief Data plane "connection" to a client in the same process
+
+	Send() hands the message buffer itself to the client's handler. Requests the client makes are
+	queued as bytes and read back by syncWait() through RecvAck() and RecvArgs(), exactly as if
+	they had come off a socket.
+ */
+// Set while this thread is running a client's handler
+static thread_local bool s_inHandler = false;
+
+class InProcessTransport : public DataTransport
+{
+public:
+	InProcessTransport(bridge_handler handler) : DataTransport(-1), m_handler(handler), m_closed(false) {}
+
+	virtual const char* GetName() { return "in-process"; }
+
+	virtual bool Send(std::shared_ptr<FrameBuffer> buf)
+	{
+		std::lock_guard<std::mutex> lock(m_sendMutex);
+		if (m_closed)
+			return false;
+
+		AccountSent(buf->Length());
+		s_inHandler = true;
+		m_handler(buf);
+		s_inHandler = false;
+		return true;
+	}
+
+	virtual bool RecvAck(uint8_t& ack)
+	{
+		return RecvArgs(&ack, 1);
+	}
+
+	virtual bool RecvArgs(void* buf, size_t len)
+	{
+		std::unique_lock<std::mutex> lock(m_requestMutex);
+		m_requestReady.wait(lock, [&]() { return m_closed || m_requests.size() >= len; });
+		if (m_requests.size() < len)
+			return false;
+
+		std::copy(m_requests.begin(), m_requests.begin() + len, (uint8_t*)buf);
+		m_requests.erase(m_requests.begin(), m_requests.begin() + len);
+		return true;
+	}
+
+	// No more messages for the handler and no more requests, without waiting for anything
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_requestMutex);
+		m_closed = true;
+		m_requestReady.notify_all();
+	}
+
+	// Also waits out a Send() that is already running, so the handler is never called afterwards
+	virtual void Shutdown()
+	{
+		Close();
+		std::lock_guard<std::mutex> lock(m_sendMutex);
+	}
+
+	void Request(const uint8_t* data, size_t len)
+	{
+		std::lock_guard<std::mutex> lock(m_requestMutex);
+		m_requests.insert(m_requests.end(), data, data + len);
+		m_requestReady.notify_all();
+	}
+
+protected:
+	bridge_handler m_handler;
+
+	std::mutex m_requestMutex;
+	std::condition_variable m_requestReady;
+	std::deque<uint8_t> m_requests;
+	std::atomic<bool> m_closed;
+};
+
+static std::thread s_sessionThread;
+static std::thread s_deviceThread;
+
+// The in-process client, if any. Loaded atomically by bridge_request(), which a handler may call
+// while bridge_disconnect() holds s_clientMutex and waits for that handler to return.
+static std::mutex s_clientMutex;
+static std::shared_ptr<InProcessTransport> s_client;
+static std::thread s_scpiThread;
+static std::thread s_dataThread;
+static int s_controlSocket = -1;
+
+// Whether a client, in-process or TCP, has the bridge. Clients share the data plane settings,
+// g_quit and the data client slot, so only one may be attached at a time.
+static std::atomic<bool> s_claimed{false};
+
+/**
+	@brief Take the bridge for a new client; false if another client already has it
+ */
+bool bridge_claim_client()
+{
+	return !s_claimed.exchange(true);
+}
+
+void bridge_release_client()
+{
+	s_claimed = false;
+}
+
+/**
+	@brief Find and open the device and start the capture session; nonzero on failure
+ */
+int bridge_open(const char* drivername, int bus, int dev)
+{
+	LogNotice("libsigrok4DSL ver: '%s'\n", sr_package_version_string_get());
+
+	if (init_and_find_device(drivername, bus, dev) != 0)
+		return 1;
+
+	if (g_deviceIsScope)
+		load_calibration(g_calPath);
+
+	//The capture session outlives individual clients so reconnects find the device already armed
+	s_sessionThread = std::thread(SessionThread);
+
+	while (!g_sessionReady)
+		policed_usleep(1000);
+
+	//All configuration from the control plane is applied here, off the SCPI thread
+	s_deviceThread = std::thread(DeviceOwnerThread);
+
+	return 0;
+}
+
+/**
+	@brief Disconnect any in-process client, then stop the session and device-owner threads
+ */
+void bridge_close()
+{
+	bridge_disconnect();
+
+	device_queue_stop();
+	if (s_deviceThread.joinable())
+		s_deviceThread.join();
+
+	g_shutdown = true;
+	g_run = false;
+	sr_session_stop();
+	if (s_sessionThread.joinable())
+		s_sessionThread.join();
+}
+
+/**
+	@brief Data plane settings a new client starts from
+ */
+void bridge_reset_client()
+{
+	g_quit = false;
+	g_channelMask = ~0ULL;
+	g_chunkSamples = 0;
+	g_logicLayout = LAYOUT_CHANNEL;
+	g_batchFrames = 0;
+	delta_set_enabled(false);
+	tune_set_enabled(false);
+}
+
+/**
+	@brief Become the bridge's client; `handler` gets every data plane message from then on
+ */
+bool bridge_connect(bridge_handler handler)
+{
+	std::lock_guard<std::mutex> lock(s_clientMutex);
+	if (!bridge_claim_client()) {
+		LogError("bridge_connect: another client is connected\n");
+		return false;
+	}
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		LogError("socketpair failed: %s\n", strerror(errno));
+		bridge_release_client();
+		return false;
+	}
+
+	bridge_reset_client();
+
+	s_controlSocket = fds[0];
+	ZSOCKET serverSocket = fds[1];
+	s_scpiThread = std::thread([serverSocket]() {
+		apply_thread_policy("scpi");
+
+		SigrokSCPIServer server(serverSocket);
+		server.MainLoop();
+	});
+
+	std::shared_ptr<InProcessTransport> client = std::make_shared<InProcessTransport>(handler);
+	std::atomic_store(&s_client, client);
+	s_dataThread = std::thread([client]() {
+		apply_thread_policy("waveform");
+		serve_data_client(client);
+	});
+
+	return true;
+}
+
+/**
+	@brief Disconnect `client` if it is still the in-process client (any client if NULL)
+ */
+static void disconnect_client(std::shared_ptr<InProcessTransport> client)
+{
+	std::lock_guard<std::mutex> lock(s_clientMutex);
+	if (!s_client || (client && s_client != client))
+		return;
+
+	g_quit = true;
+	disconnect_data_client();
+	s_client->Shutdown();
+	s_dataThread.join();
+	std::atomic_store(&s_client, std::shared_ptr<InProcessTransport>());
+
+	shutdown(s_controlSocket, SHUT_RDWR);
+	s_scpiThread.join();
+	close(s_controlSocket);
+	s_controlSocket = -1;
+
+	bridge_release_client();
+}
+
+/**
+	@brief Stop delivering messages to the in-process client; its handler is not called after this
+
+	Called from the handler itself, it only stops further messages and returns: the rest waits for
+	the handler to return, on a thread of its own.
+ */
+void bridge_disconnect()
+{
+	if (s_inHandler) {
+		std::shared_ptr<InProcessTransport> client = std::atomic_load(&s_client);
+		if (!client)
+			return;
+
+		client->Close();
+		std::thread(disconnect_client, client).detach();
+		return;
+	}
+
+	disconnect_client(NULL);
+}
+
+static bool send_line(const std::string& line)
+{
+	std::string msg = line + "\n";
+	const char* p = msg.data();
+	size_t left = msg.size();
+	while (left) {
+		ssize_t n = send(s_controlSocket, p, left, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		p += n;
+		left -= n;
+	}
+
+	return true;
+}
+
+// Keeps a query's line and its reply together when several threads configure the device
+static std::mutex s_controlMutex;
+
+/**
+	@brief Run a SCPI command, e.g. "RATE 1000000"; false if the control channel is gone
+ */
+bool bridge_command(const std::string& line)
+{
+	std::lock_guard<std::mutex> lock(s_controlMutex);
+	return s_controlSocket >= 0 && send_line(line);
+}
+
+/**
+	@brief Run a SCPI query, e.g. "DEPTHS?", and return its reply without the newline
+
+	Only for lines that produce a reply: anything without a '?' is rejected, and an unrecognised
+	query (which gets no reply) returns "" after BRIDGE_QUERY_TIMEOUT_MS.
+ */
+std::string bridge_query(const std::string& line)
+{
+	if (line.find('?') == std::string::npos) {
+		LogWarning("bridge_query: '%s' is not a query\n", line.c_str());
+		return "";
+	}
+
+	std::lock_guard<std::mutex> lock(s_controlMutex);
+	if (s_controlSocket < 0)
+		return "";
+
+	// A reply that turned up after an earlier query timed out must not be taken for this one's
+	char c;
+	while (recv(s_controlSocket, &c, 1, MSG_DONTWAIT) == 1)
+		;
+
+	if (!send_line(line))
+		return "";
+
+	std::string reply;
+	for (;;) {
+		pollfd pfd = {s_controlSocket, POLLIN, 0};
+		if (poll(&pfd, 1, BRIDGE_QUERY_TIMEOUT_MS) <= 0) {
+			LogWarning("bridge_query: no reply to '%s'\n", line.c_str());
+			return "";
+		}
+
+		if (recv(s_controlSocket, &c, 1, 0) != 1 || c == '\n')
+			break;
+		reply += c;
+	}
+
+	return reply;
+}
+
+/**
+	@brief Ask for the next frame
+ */
+void bridge_ack()
+{
+	bridge_request('K');
+}
+
+/**
+	@brief Send a data plane request and its arguments, as a TCP client would on the data socket
+ */
+void bridge_request(uint8_t request, const void* args, size_t len)
+{
+	std::shared_ptr<InProcessTransport> client = std::atomic_load(&s_client);
+	if (!client)
+		return;
+
+	// Queued in one go, so that an ack from another thread can't come between a request and its arguments
+	std::vector<uint8_t> bytes(1 + len);
+	bytes[0] = request;
+	if (len)
+		memcpy(bytes.data() + 1, args, len);
+	client->Request(bytes.data(), bytes.size());
+}
@@ -0,0 +1,59 @@
+
+#ifndef bridge_h
+#define bridge_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <memory>
+#include <functional>
+
+#include "DataTransport.h"
+
+/*
+	The bridge as a library: device setup, the capture session and the frame pipeline, for use
+	in-process as well as behind the TCP servers of the scopehal-sigrok-bridge executable.
+
+	bridge_open() finds and opens the device and starts the session and device-owner threads.
+	libsigrok4DSL loads firmware and bitstreams relative to the working directory, which the bridge
+	leaves alone: the caller has to be in DSView's resource directory (main.cpp changes to it).
+	An in-process client then calls bridge_connect() with a handler for data plane messages; these
+	are the same messages a TCP client would receive (frames, chunks, histograms, ...), each handed
+	over as the pooled FrameBuffer it was built in. Nothing is copied or sent through a socket: the
+	handler may keep the buffer as long as it likes, and it goes back to the pool when the last
+	reference is dropped. The handler runs on bridge threads, one message at a time, so it should
+	hand anything slow off to a thread of its own. It may call bridge_disconnect(), which then
+	returns at once and finishes disconnecting once the handler has returned.
+
+	Configuration is the SCPI command set: bridge_command() and bridge_query() run a line through
+	the same SigrokSCPIServer a TCP client talks to (over a local socket pair). bridge_query() is for
+	lines that produce a reply (containing '?') and gives up on one after BRIDGE_QUERY_TIMEOUT_MS;
+	settings go through bridge_command(), which does not wait.
+
+	bridge_ack() asks for the next frame like 'K' on the data socket; bridge_request() sends any
+	other data plane request ('H', 'Q' with its arguments).
+
+	There is one device and so at most one client at a time, in-process or TCP. Whichever kind
+	serves clients takes the bridge with bridge_claim_client() first and gives it back with
+	bridge_release_client(); bridge_connect() does this itself and fails while a TCP client has it.
+ */
+
+typedef std::function<void(std::shared_ptr<FrameBuffer> msg)> bridge_handler;
+
+static const int BRIDGE_QUERY_TIMEOUT_MS = 5000;
+
+int bridge_open(const char* drivername, int bus = -1, int dev = -1);
+void bridge_close();
+void bridge_reset_client();
+bool bridge_claim_client();
+void bridge_release_client();
+
+bool bridge_connect(bridge_handler handler);
+void bridge_disconnect();
+
+bool bridge_command(const std::string& line);
+std::string bridge_query(const std::string& line);
+void bridge_ack();
+void bridge_request(uint8_t request, const void* args = NULL, size_t len = 0);
+
+#endif // bridge_h
@@ -0,0 +1,266 @@
+
+#include "bwfilter.h"
+#include "deinterleave.h"
+#include "log/log.h"
+
+#include <math.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BW_HAVE_AVX2_PATH
+#endif
+
+static const size_t BW_MAX_CHANNELS = 64;
+
+// FIR work (samples * taps) from which the capture is split over the OpenMP team
+static const size_t FIR_PARALLEL_MIN = 1 << 24;
+
+static std::atomic<uint64_t> s_limit[BW_MAX_CHANNELS];
+static std::atomic<int> s_type{BW_FIR};
+
+/**
+	@brief Coefficients for one channel, redesigned when its limit, type or sample rate change
+ */
+struct bw_design {
+	uint64_t hz = 0;
+	int64_t samplerate_fs = 0;
+	int type = -1;
+
+	// Whether the IIR is used; also true for FIR when the limit needs more than FIR_MAX_TAPS
+	bool iir = false;
+
+	std::vector<float> taps;
+
+	// Biquads as b0, b1, b2, a1, a2 (a0 = 1)
+	double biquads[2][5];
+	float delay = 0;
+};
+
+// Session thread only
+static bw_design s_design[BW_MAX_CHANNELS];
+
+void bw_set_limit(size_t chnum, uint64_t hz) {
+	if (chnum < BW_MAX_CHANNELS)
+		s_limit[chnum] = hz;
+}
+
+uint64_t bw_get_limit(size_t chnum) {
+	return chnum < BW_MAX_CHANNELS ? s_limit[chnum].load() : 0;
+}
+
+bool bw_enabled() {
+	for (auto& limit : s_limit) {
+		if (limit)
+			return true;
+	}
+
+	return false;
+}
+
+void bw_set_type(int type) {
+	s_type = type;
+}
+
+int bw_get_type() {
+	return s_type;
+}
+
+static void design_fir(bw_design& d, double fc) {
+	// Hamming: transition width ~3.3 / taps (as a fraction of the sample rate); make it ~fc wide
+	size_t n = (size_t)ceil(3.3 / fc) | 1;
+	int mid = n / 2;
+
+	d.taps.resize(n);
+	double sum = 0;
+	for (size_t k = 0; k < n; k++) {
+		int m = (int)k - mid;
+		double sinc = m ? sin(2 * M_PI * fc * m) / (M_PI * m) : 2 * fc;
+		double window = 0.54 - 0.46 * cos(2 * M_PI * k / (n - 1));
+		d.taps[k] = sinc * window;
+		sum += d.taps[k];
+	}
+
+	// Unity gain at DC
+	for (float& tap : d.taps)
+		tap /= sum;
+
+	d.delay = 0;
+}
+
+static void design_iir(bw_design& d, double fc) {
+	// 4th order Butterworth as two sections, bilinear transform with prewarping
+	static const double q[2] = {0.54119610, 1.30656296};
+	double k = tan(M_PI * fc);
+
+	d.delay = 0;
+	for (int s = 0; s < 2; s++) {
+		double norm = 1 / (1 + k / q[s] + k * k);
+		double* c = d.biquads[s];
+		c[0] = k * k * norm;
+		c[1] = 2 * c[0];
+		c[2] = c[0];
+		c[3] = 2 * (k * k - 1) * norm;
+		c[4] = (1 - k / q[s] + k * k) * norm;
+
+		// Group delay at DC: sum(n b_n) / sum(b_n) - sum(n a_n) / sum(a_n)
+		d.delay += (c[1] + 2 * c[2]) / (c[0] + c[1] + c[2]) - (c[3] + 2 * c[4]) / (1 + c[3] + c[4]);
+	}
+}
+
+/**
+	@brief Current coefficients for a channel; false if it isn't limited at this sample rate
+ */
+static bool update_design(size_t chnum, int64_t samplerate_fs) {
+	bw_design& d = s_design[chnum];
+	uint64_t hz = s_limit[chnum];
+	int type = s_type;
+
+	// Limit as a fraction of the sample rate
+	double fc = hz * (samplerate_fs * 1e-15);
+	if (!hz || fc >= 0.5)
+		return false;
+
+	if (d.hz != hz || d.samplerate_fs != samplerate_fs || d.type != type) {
+		d.hz = hz;
+		d.samplerate_fs = samplerate_fs;
+		d.type = type;
+		d.iir = type == BW_IIR;
+
+		// A narrower transition would need more taps than we allow, and fewer would leave it wider
+		// than the limit itself, letting through far more than asked for
+		if (!d.iir && ceil(3.3 / fc) > FIR_MAX_TAPS) {
+			LogWarning("Channel %zu: %lu Hz limit needs more than %zu FIR taps at this sample rate, using IIR\n",
+				chnum, (unsigned long)hz, FIR_MAX_TAPS);
+			d.iir = true;
+		}
+
+		if (d.iir)
+			design_iir(d, fc);
+		else
+			design_fir(d, fc);
+	}
+
+	return true;
+}
+
+static inline uint8_t to_code(float v) {
+	return std::min(255.f, std::max(0.f, v + 0.5f));
+}
+
+static void fir_range_scalar(const float* x, const float* taps, size_t ntaps, uint8_t* out, size_t first, size_t last) {
+	for (size_t i = first; i < last; i++) {
+		float acc = 0;
+		#pragma omp simd reduction(+:acc)
+		for (size_t k = 0; k < ntaps; k++)
+			acc += taps[k] * x[i + k];
+		out[i] = to_code(acc);
+	}
+}
+
+#ifdef BW_HAVE_AVX2_PATH
+__attribute__((target("avx2,fma")))
+static void fir_range_avx2(const float* x, const float* taps, size_t ntaps, uint8_t* out, size_t first, size_t last) {
+	size_t i = first;
+	for (; i + 32 <= last; i += 32) {
+		// 32 outputs at once, one broadcast tap per step, in four independent accumulators so
+		// the FMAs don't wait on each other
+		__m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+		for (size_t k = 0; k < ntaps; k++) {
+			__m256 tap = _mm256_set1_ps(taps[k]);
+			for (int j = 0; j < 4; j++)
+				acc[j] = _mm256_fmadd_ps(tap, _mm256_loadu_ps(x + i + k + j * 8), acc[j]);
+		}
+
+		// Round and clamp to codes: float -> int32 -> packed u8
+		__m256i lo = _mm256_packs_epi32(_mm256_cvtps_epi32(acc[0]), _mm256_cvtps_epi32(acc[1]));
+		__m256i hi = _mm256_packs_epi32(_mm256_cvtps_epi32(acc[2]), _mm256_cvtps_epi32(acc[3]));
+		__m256i codes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+		_mm256_storeu_si256((__m256i*)(out + i), codes);
+	}
+
+	fir_range_scalar(x, taps, ntaps, out, i, last);
+}
+
+static const bool s_haveAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+
+static void run_fir(const bw_design& d, uint8_t* samples, size_t count) {
+	size_t ntaps = d.taps.size();
+	size_t mid = ntaps / 2;
+
+	// Samples as floats, padded at both ends with the edge sample so the output keeps its length
+	static std::vector<float> s_padded;
+	s_padded.resize(count + ntaps - 1);
+	for (size_t i = 0; i < mid; i++) {
+		s_padded[i] = samples[0];
+		s_padded[mid + count + i] = samples[count - 1];
+	}
+	#pragma omp simd
+	for (size_t i = 0; i < count; i++)
+		s_padded[mid + i] = samples[i];
+
+	const float* x = s_padded.data();
+	const float* taps = d.taps.data();
+	int threads = count * ntaps >= FIR_PARALLEL_MIN ? std::max(g_deinterleaveThreads, 1) : 1;
+	int64_t pieces = threads;
+
+	#pragma omp parallel for num_threads(threads) schedule(static)
+	for (int64_t piece = 0; piece < pieces; piece++) {
+		size_t first = count * piece / pieces;
+		size_t last = count * (piece + 1) / pieces;
+
+		#ifdef BW_HAVE_AVX2_PATH
+		if (s_haveAVX2) {
+			fir_range_avx2(x, taps, ntaps, samples, first, last);
+			continue;
+		}
+		#endif
+		fir_range_scalar(x, taps, ntaps, samples, first, last);
+	}
+}
+
+static void run_iir(const bw_design& d, uint8_t* samples, size_t count) {
+	// Start from the steady state for the first sample, so there is no step at the start
+	double state[2][2];
+	double in0 = samples[0];
+	for (int s = 0; s < 2; s++) {
+		const double* c = d.biquads[s];
+		// Transposed direct form II at rest with input = output = in0 (unity DC gain)
+		state[s][1] = c[2] * in0 - c[4] * in0;
+		state[s][0] = c[1] * in0 - c[3] * in0 + state[s][1];
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		double v = samples[i];
+		for (int s = 0; s < 2; s++) {
+			const double* c = d.biquads[s];
+			double y = c[0] * v + state[s][0];
+			state[s][0] = c[1] * v - c[3] * y + state[s][1];
+			state[s][1] = c[2] * v - c[4] * y;
+			v = y;
+		}
+		samples[i] = to_code(v);
+	}
+}
+
+/**
+	@brief Low-pass one channel's samples in place; returns the delay it added, in samples
+ */
+float bw_filter(size_t chnum, uint8_t* samples, size_t count, int64_t samplerate_fs) {
+	if (chnum >= BW_MAX_CHANNELS || !count || !update_design(chnum, samplerate_fs))
+		return 0;
+
+	const bw_design& d = s_design[chnum];
+	if (d.iir) {
+		run_iir(d, samples, count);
+		return d.delay;
+	}
+
+	run_fir(d, samples, count);
+	return 0;
+}
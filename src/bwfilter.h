@@ -0,0 +1,44 @@
+
+#ifndef bwfilter_h
+#define bwfilter_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	Bandwidth limiting in the bridge: "<chan>:BWLIMIT <Hz>" low-pass filters that analog channel's
+	samples before they are sent (and before averaging, persistence and spectrum see them), so the
+	client never has to fetch the unfiltered data. 0 turns it off, as does a limit at or above
+	Nyquist. Trigger phase, measurements, mask tests and retained captures use the raw samples.
+
+	BWLIMIT:TYPE selects the filter for all channels:
+
+	FIR		Hamming windowed sinc with a transition band about as wide as the limit, up to
+			FIR_MAX_TAPS taps. Applied centred, so it has no delay. A limit below about
+			3.3 / FIR_MAX_TAPS of the sample rate would need more taps; that channel gets the IIR
+			instead, with a warning.
+	IIR		4th order Butterworth (two biquads). Much cheaper on deep captures and with a sharper
+			knee, but it delays the signal; its group delay at DC is added to the channel's
+			trigger phase, and to its alignment for averaging and persistence, so edges still
+			line up with the trigger.
+
+	Samples stay 8 bit ADC codes, rounded. Deep captures are filtered by the deinterleave OpenMP
+	team, split by sample range.
+ */
+
+enum bw_filter_type {
+	BW_FIR,
+	BW_IIR
+};
+
+static const size_t FIR_MAX_TAPS = 255;
+
+void bw_set_limit(size_t chnum, uint64_t hz);
+uint64_t bw_get_limit(size_t chnum);
+bool bw_enabled();
+void bw_set_type(int type);
+int bw_get_type();
+
+float bw_filter(size_t chnum, uint8_t* samples, size_t count, int64_t samplerate_fs);
+
+#endif // bwfilter_h
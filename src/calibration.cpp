@@ -0,0 +1,391 @@
+
+#include "calibration.h"
+#include "server.h"
+#include "log/log.h"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CAL_HAVE_AVX2_PATH
+#endif
+
+int g_sampleFormat = SAMPLE_RAW;
+std::string g_calPath;
+
+// Number of frames averaged into each calibration point
+static const size_t CAL_FRAMES_PER_POINT = 16;
+
+struct cal_table {
+	float volts[256];
+	int32_t i16[256];	// volts / i16 lsb, held as int32 so it can be gathered directly
+};
+
+struct cal_point {
+	double code;
+	double volts;
+};
+
+typedef std::pair<size_t, uint64_t> cal_key;	// (channel, vdiv in mV)
+
+static std::mutex s_calMutex;
+static std::map<cal_key, cal_table> s_tables;
+static std::map<cal_key, std::vector<cal_point>> s_points;
+
+// Set and cleared under s_calMutex, read without it on every capture
+static std::atomic<bool> s_pointPending{false};
+static size_t s_pointChannel;
+static double s_pointVolts;
+static double s_pointCodeSum;
+static size_t s_pointSamples;
+static size_t s_pointFrames;
+
+static uint64_t current_vdiv(size_t chnum) {
+	return get_vdiv(chnum);
+}
+
+static float i16_lsb(uint64_t vdiv_mV) {
+	// Full throw of the ADC maps to half the int16 range, leaving headroom for codes the table
+	// places beyond the nominal range.
+	return ((float)vdiv_mV / 1000 * g_numdivs) / 32768;
+}
+
+static void fill_i16(cal_table& table, uint64_t vdiv_mV) {
+	float lsb = i16_lsb(vdiv_mV);
+	for (int code = 0; code < 256; code++) {
+		float v = roundf(table.volts[code] / lsb);
+		table.i16[code] = std::clamp(v, -32768.f, 32767.f);
+	}
+}
+
+// Table matching the uncalibrated linear mapping, used for channels/vdivs with no calibration
+static void fill_linear(cal_table& table, size_t chnum, uint64_t vdiv_mV) {
+	float scale, offset;
+	compute_scale_and_offset(g_channels[chnum], scale, offset);
+
+	for (int code = 0; code < 256; code++)
+		table.volts[code] = code * scale - offset;
+
+	fill_i16(table, vdiv_mV);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Persistence
+
+bool load_calibration(const std::string& path) {
+	FILE* fp = fopen(path.c_str(), "r");
+	if (!fp) {
+		LogDebug("No calibration file at %s\n", path.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	size_t loaded = 0;
+	char line[8192];
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		char* p = line;
+		char* end;
+		size_t chnum = strtoul(p, &end, 10);
+		if (end == p) continue;
+		p = end;
+		uint64_t vdiv = strtoull(p, &end, 10);
+		if (end == p) continue;
+		p = end;
+
+		cal_table table;
+		int code;
+		for (code = 0; code < 256; code++) {
+			table.volts[code] = strtof(p, &end);
+			if (end == p) break;
+			p = end;
+		}
+
+		if (code != 256) {
+			LogWarning("Ignoring truncated calibration entry for ch%zu @ %lu mV/div\n", chnum, vdiv);
+			continue;
+		}
+
+		fill_i16(table, vdiv);
+		s_tables[cal_key(chnum, vdiv)] = table;
+		loaded++;
+	}
+
+	fclose(fp);
+
+	LogNotice("Loaded %zu calibration tables from %s\n", loaded, path.c_str());
+	return true;
+}
+
+bool save_calibration(const std::string& path) {
+	FILE* fp = fopen(path.c_str(), "w");
+	if (!fp) {
+		LogError("Failed to open %s for writing calibration\n", path.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	fprintf(fp, "# scopehal-sigrok-bridge calibration: %s %s\n", g_sr_device->vendor, g_sr_device->model);
+	fprintf(fp, "# <channel> <vdiv mV> <volts for ADC code 0..255>\n");
+
+	for (auto& it : s_tables) {
+		fprintf(fp, "%zu %lu", it.first.first, it.first.second);
+		for (int code = 0; code < 256; code++)
+			fprintf(fp, " %.9g", it.second.volts[code]);
+		fprintf(fp, "\n");
+	}
+
+	fclose(fp);
+
+	LogDebug("Saved %zu calibration tables to %s\n", s_tables.size(), path.c_str());
+	return true;
+}
+
+void clear_calibration(size_t chnum) {
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	uint64_t vdiv = current_vdiv(chnum);
+	s_tables.erase(cal_key(chnum, vdiv));
+	s_points.erase(cal_key(chnum, vdiv));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Calibration capture
+
+/**
+	@brief Start recording a calibration point: channel `chnum` currently has `volts` applied
+
+	The mean ADC code over the next CAL_FRAMES_PER_POINT captured frames is recorded against the
+	channel's present vdiv.
+ */
+void cal_begin_point(size_t chnum, double volts) {
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	s_pointChannel = chnum;
+	s_pointVolts = volts;
+	s_pointCodeSum = 0;
+	s_pointSamples = 0;
+	s_pointFrames = 0;
+	s_pointPending = true;
+}
+
+bool cal_point_pending() {
+	return s_pointPending;
+}
+
+void cal_accumulate(size_t chnum, const uint8_t* samples, size_t count) {
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	if (!s_pointPending || chnum != s_pointChannel)
+		return;
+
+	uint64_t sum = 0;
+	for (size_t i = 0; i < count; i++)
+		sum += samples[i];
+
+	s_pointCodeSum += sum;
+	s_pointSamples += count;
+
+	if (++s_pointFrames < CAL_FRAMES_PER_POINT)
+		return;
+
+	cal_point point = {s_pointCodeSum / s_pointSamples, s_pointVolts};
+	s_points[cal_key(chnum, current_vdiv(chnum))].push_back(point);
+	s_pointPending = false;
+
+	LogDebug("Calibration point for ch%zu: %f V = code %.3f\n", chnum, point.volts, point.code);
+}
+
+/**
+	@brief Build the 256-entry table for the channel's present vdiv from the recorded points
+
+	Codes are mapped piecewise-linearly between points; beyond the outermost points the nearest
+	segment is extrapolated. With a single point the nominal gain is kept and only the offset is
+	corrected.
+ */
+bool cal_build_table(size_t chnum) {
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	uint64_t vdiv = current_vdiv(chnum);
+	auto it = s_points.find(cal_key(chnum, vdiv));
+	if (it == s_points.end() || it->second.empty()) {
+		LogWarning("No calibration points recorded for ch%zu @ %lu mV/div\n", chnum, vdiv);
+		return false;
+	}
+
+	std::vector<cal_point> points = it->second;
+	std::sort(points.begin(), points.end(), [](const cal_point& a, const cal_point& b) {
+		return a.code < b.code;
+	});
+
+	if (points.size() == 1) {
+		float scale, offset;
+		compute_scale_and_offset(g_channels[chnum], scale, offset);
+
+		cal_point p = points[0];
+		points.push_back({p.code + 1, p.volts + scale});
+	}
+
+	cal_table table;
+	size_t seg = 0;
+	for (int code = 0; code < 256; code++) {
+		while (seg + 2 < points.size() && code > points[seg + 1].code)
+			seg++;
+
+		const cal_point& a = points[seg];
+		const cal_point& b = points[seg + 1];
+		double slope = (b.code == a.code) ? 0 : (b.volts - a.volts) / (b.code - a.code);
+		table.volts[code] = a.volts + (code - a.code) * slope;
+	}
+
+	fill_i16(table, vdiv);
+	s_tables[cal_key(chnum, vdiv)] = table;
+
+	LogDebug("Built calibration table for ch%zu @ %lu mV/div from %zu points\n", chnum, vdiv, it->second.size());
+	return true;
+}
+
+bool cal_have_table(size_t chnum) {
+	std::lock_guard<std::mutex> lock(s_calMutex);
+
+	return s_tables.count(cal_key(chnum, current_vdiv(chnum))) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Conversion
+
+size_t cal_sample_size(int format) {
+	switch (format) {
+		case SAMPLE_CAL_I16: return sizeof(int16_t);
+		case SAMPLE_CAL_F32: return sizeof(float);
+		case SAMPLE_AVG_U16: return sizeof(uint16_t);
+		default:             return sizeof(uint8_t);
+	}
+}
+
+float cal_i16_scale(size_t chnum) {
+	return i16_lsb(current_vdiv(chnum));
+}
+
+static void convert_f32_scalar(const float* lut, const uint8_t* in, float* out, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		out[i] = lut[in[i]];
+}
+
+static void convert_i16_scalar(const int32_t* lut, const uint8_t* in, int16_t* out, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		out[i] = lut[in[i]];
+}
+
+#ifdef CAL_HAVE_AVX2_PATH
+__attribute__((target("avx2")))
+static void convert_f32_avx2(const float* lut, const uint8_t* in, float* out, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i codes = _mm_loadu_si128((const __m128i*)(in + i));
+		__m256i lo = _mm256_cvtepu8_epi32(codes);
+		__m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(codes, 8));
+		_mm256_storeu_ps(out + i, _mm256_i32gather_ps(lut, lo, 4));
+		_mm256_storeu_ps(out + i + 8, _mm256_i32gather_ps(lut, hi, 4));
+	}
+
+	convert_f32_scalar(lut, in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_i16_avx2(const int32_t* lut, const uint8_t* in, int16_t* out, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i codes = _mm_loadu_si128((const __m128i*)(in + i));
+		__m256i lo = _mm256_i32gather_epi32((const int*)lut, _mm256_cvtepu8_epi32(codes), 4);
+		__m256i hi = _mm256_i32gather_epi32((const int*)lut, _mm256_cvtepu8_epi32(_mm_srli_si128(codes, 8)), 4);
+
+		// packs works per 128-bit lane, so put the lanes back in order afterwards
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i*)(out + i), packed);
+	}
+
+	convert_i16_scalar(lut, in + i, out + i, count - i);
+}
+
+static const bool s_haveAVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+/**
+	@brief Convert `count` ADC codes from channel `chnum` into calibrated samples of `format`
+
+	Uses the table for the channel's present vdiv, or the nominal linear mapping if there is none.
+ */
+void cal_convert(size_t chnum, int format, const uint8_t* in, void* out, size_t count) {
+	uint64_t vdiv = current_vdiv(chnum);
+
+	cal_table table;
+	{
+		std::lock_guard<std::mutex> lock(s_calMutex);
+		auto it = s_tables.find(cal_key(chnum, vdiv));
+		if (it != s_tables.end())
+			table = it->second;
+		else
+			fill_linear(table, chnum, vdiv);
+	}
+
+	if (format == SAMPLE_CAL_F32) {
+		#ifdef CAL_HAVE_AVX2_PATH
+		if (s_haveAVX2) {
+			convert_f32_avx2(table.volts, in, (float*)out, count);
+			return;
+		}
+		#endif
+		convert_f32_scalar(table.volts, in, (float*)out, count);
+	} else if (format == SAMPLE_CAL_I16) {
+		#ifdef CAL_HAVE_AVX2_PATH
+		if (s_haveAVX2) {
+			convert_i16_avx2(table.i16, in, (int16_t*)out, count);
+			return;
+		}
+		#endif
+		convert_i16_scalar(table.i16, in, (int16_t*)out, count);
+	}
+}
+
+/**
+	@brief Convert 8.8 fixed point ADC codes (e.g. averaged frames) into calibrated samples of `format`
+
+	Fractional codes are interpolated linearly between the two table entries around them.
+ */
+void cal_convert_fixed(size_t chnum, int format, const uint16_t* in, void* out, size_t count) {
+	uint64_t vdiv = current_vdiv(chnum);
+
+	cal_table table;
+	{
+		std::lock_guard<std::mutex> lock(s_calMutex);
+		auto it = s_tables.find(cal_key(chnum, vdiv));
+		if (it != s_tables.end())
+			table = it->second;
+		else
+			fill_linear(table, chnum, vdiv);
+	}
+
+	float lsb = i16_lsb(vdiv);
+	for (size_t i = 0; i < count; i++) {
+		unsigned code = in[i] >> 8;
+		float frac = (in[i] & 0xff) / 256.f;
+		float next = table.volts[std::min(code + 1, 255u)];
+		float volts = table.volts[code] + frac * (next - table.volts[code]);
+
+		if (format == SAMPLE_CAL_F32)
+			((float*)out)[i] = volts;
+		else
+			((int16_t*)out)[i] = std::clamp(roundf(volts / lsb), -32768.f, 32767.f);
+	}
+}
@@ -0,0 +1,43 @@
+
+#ifndef calibration_h
+#define calibration_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/**
+	@brief Sample encodings a client can choose for analog channels on the data plane
+
+	SAMPLE_RAW is the original stream: one ADC code per sample plus the linear scale/offset from
+	compute_scale_and_offset(). The calibrated formats run every code through the per-channel,
+	per-vdiv lookup table first. SAMPLE_AVG_U16 only appears in averaged frames sent with the RAW
+	format selected.
+ */
+enum sample_format {
+	SAMPLE_RAW = 0,
+	SAMPLE_CAL_I16 = 1,	// int16, volts = value * scale (scale sent in the channel header)
+	SAMPLE_CAL_F32 = 2,	// float32 volts
+	SAMPLE_AVG_U16 = 3,	// uint16 ADC code in 8.8 fixed point, volts = value * scale - offset
+	SAMPLE_DELTA_U8 = 4	// RAW ADC codes, delta encoded against the previous frame (see delta.h)
+};
+
+extern int g_sampleFormat;
+extern std::string g_calPath;
+
+bool load_calibration(const std::string& path);
+bool save_calibration(const std::string& path);
+void clear_calibration(size_t chnum);
+
+void cal_begin_point(size_t chnum, double volts);
+bool cal_point_pending();
+void cal_accumulate(size_t chnum, const uint8_t* samples, size_t count);
+bool cal_build_table(size_t chnum);
+bool cal_have_table(size_t chnum);
+
+size_t cal_sample_size(int format);
+float cal_i16_scale(size_t chnum);
+void cal_convert(size_t chnum, int format, const uint8_t* in, void* out, size_t count);
+void cal_convert_fixed(size_t chnum, int format, const uint16_t* in, void* out, size_t count);
+
+#endif // calibration_h
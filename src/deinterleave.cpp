@@ -0,0 +1,366 @@
+
+#include "deinterleave.h"
+#include "server.h"
+#include "threading.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 0 = pick at startup
+int g_deinterleaveThreads = 0;
+
+// Beyond this, extra threads mostly wait on memory bandwidth
+static const int DEFAULT_MAX_THREADS = 4;
+
+/**
+	@brief Size the OpenMP team and apply the "deinterleave" thread policy to its threads
+
+	Call from the thread that will deinterleave (the session thread). OpenMP keeps the team alive
+	between parallel regions, so this only has to happen once.
+ */
+void deinterleave_init() {
+	if (g_deinterleaveThreads <= 0)
+		g_deinterleaveThreads = std::min(omp_get_num_procs(), DEFAULT_MAX_THREADS);
+
+	if (g_deinterleaveThreads < 2)
+		return;
+
+	#pragma omp parallel num_threads(g_deinterleaveThreads)
+	{
+		// The master keeps the policy of the thread that called us
+		if (omp_get_thread_num() != 0)
+			apply_thread_policy("deinterleave");
+	}
+}
+
+static int team_size(size_t bytes) {
+	return bytes >= DEINTERLEAVE_PARALLEL_MIN ? g_deinterleaveThreads : 1;
+}
+
+/**
+	@brief Split a LA_CROSS_DATA capture: for each run of 8 samples, 8 bytes for every channel in turn
+
+	`out` has one entry per channel; channels with a NULL entry are skipped.
+ */
+void deinterleave_logic(const uint8_t* in, size_t numchans, size_t num_samples, uint8_t* const* out) {
+	size_t stride = numchans * 8;
+	int64_t blocks = num_samples / 8;
+
+	// Each thread takes a contiguous run of blocks, reading its part of the input once
+	#pragma omp parallel for num_threads(team_size(num_samples * numchans)) schedule(static)
+	for (int64_t block = 0; block < blocks; block++) {
+		const uint8_t* p = in + block * stride;
+		for (size_t ch = 0; ch < numchans; ch++) {
+			if (out[ch])
+				memcpy(out[ch] + block * 8, p + ch * 8, 8);
+		}
+	}
+}
+
+/**
+	@brief Split a DSO capture (one byte per channel per sample) and flag channels that hit the ADC rails
+ */
+void deinterleave_dso(const uint8_t* in, size_t numchans, size_t num_samples, uint8_t* const* out, bool* clipping) {
+	int threads = team_size(num_samples * numchans);
+	uint8_t hwmin = g_hwmin;
+	uint8_t hwmax = g_hwmax;
+
+	for (size_t ch = 0; ch < numchans; ch++) {
+		uint8_t* dst = out[ch];
+		clipping[ch] = false;
+		if (!dst)
+			continue;
+
+		const uint8_t* src = in + ch;
+		bool clipped = false;
+
+		#pragma omp parallel for num_threads(threads) schedule(static) reduction(|:clipped)
+		for (int64_t sample = 0; sample < (int64_t)num_samples; sample++) {
+			uint8_t d = src[sample * numchans];
+			clipped |= (d <= hwmin || d >= hwmax);
+			dst[sample] = d;
+		}
+
+		clipping[ch] = clipped;
+	}
+}
+
+/**
+	@brief Bytes per bus word for `numrows` channels: 1, 2 or 4
+ */
+size_t bus_word_bytes(size_t numrows) {
+	return numrows <= 8 ? 1 : numrows <= 16 ? 2 : 4;
+}
+
+// The 64 samples of one LA_CROSS_DATA block for channel `row` of the bus, or zeros past the last row
+static inline uint64_t bus_row(const uint8_t* block, const int* rows, size_t numrows, size_t row) {
+	uint64_t bits = 0;
+	if (row < numrows)
+		memcpy(&bits, block + rows[row] * 8, 8);
+	return bits;
+}
+
+#ifdef __SSE2__
+
+/**
+	@brief Transpose the 8x8 bit matrix in each 64-bit lane, held one row per byte (bit 8*row + col)
+ */
+static inline __m128i transpose8_epi64(__m128i x) {
+	__m128i t;
+	t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 7)), _mm_set1_epi64x(0x00AA00AA00AA00AALL));
+	x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, 7));
+	t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 14)), _mm_set1_epi64x(0x0000CCCC0000CCCCLL));
+	x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, 14));
+	t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 28)), _mm_set1_epi64x(0x00000000F0F0F0F0LL));
+	x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, 28));
+	return x;
+}
+
+/**
+	@brief One byte of every sample in a 64-sample block, for bus channels 8*group to 8*group+7
+
+	The eight 64-bit channel rows are byte-transposed with unpacks, so that each 64-bit lane holds
+	one byte (8 samples) from every channel, then bit-transposed in place. out[i] holds samples
+	16*i to 16*i+15.
+ */
+static inline void transpose_group(const uint8_t* block, const int* rows, size_t numrows, size_t group, __m128i out[4]) {
+	__m128i r[8];
+	for (size_t i = 0; i < 8; i++)
+		r[i] = _mm_cvtsi64_si128(bus_row(block, rows, numrows, group * 8 + i));
+
+	__m128i b01 = _mm_unpacklo_epi8(r[0], r[1]);
+	__m128i b23 = _mm_unpacklo_epi8(r[2], r[3]);
+	__m128i b45 = _mm_unpacklo_epi8(r[4], r[5]);
+	__m128i b67 = _mm_unpacklo_epi8(r[6], r[7]);
+
+	__m128i w0 = _mm_unpacklo_epi16(b01, b23);
+	__m128i w1 = _mm_unpackhi_epi16(b01, b23);
+	__m128i w2 = _mm_unpacklo_epi16(b45, b67);
+	__m128i w3 = _mm_unpackhi_epi16(b45, b67);
+
+	out[0] = transpose8_epi64(_mm_unpacklo_epi32(w0, w2));
+	out[1] = transpose8_epi64(_mm_unpackhi_epi32(w0, w2));
+	out[2] = transpose8_epi64(_mm_unpacklo_epi32(w1, w3));
+	out[3] = transpose8_epi64(_mm_unpackhi_epi32(w1, w3));
+}
+
+static void transpose_block(const uint8_t* block, const int* rows, size_t numrows, size_t word_bytes, uint8_t* out) {
+	__m128i g[4][4];
+	for (size_t group = 0; group < word_bytes; group++)
+		transpose_group(block, rows, numrows, group, g[group]);
+
+	__m128i* dst = (__m128i*)out;
+	for (size_t i = 0; i < 4; i++) {
+		if (word_bytes == 1) {
+			_mm_storeu_si128(dst + i, g[0][i]);
+		} else if (word_bytes == 2) {
+			_mm_storeu_si128(dst + i * 2, _mm_unpacklo_epi8(g[0][i], g[1][i]));
+			_mm_storeu_si128(dst + i * 2 + 1, _mm_unpackhi_epi8(g[0][i], g[1][i]));
+		} else {
+			__m128i lo = _mm_unpacklo_epi8(g[0][i], g[1][i]);
+			__m128i hi = _mm_unpackhi_epi8(g[0][i], g[1][i]);
+			__m128i lo2 = _mm_unpacklo_epi8(g[2][i], g[3][i]);
+			__m128i hi2 = _mm_unpackhi_epi8(g[2][i], g[3][i]);
+			_mm_storeu_si128(dst + i * 4, _mm_unpacklo_epi16(lo, lo2));
+			_mm_storeu_si128(dst + i * 4 + 1, _mm_unpackhi_epi16(lo, lo2));
+			_mm_storeu_si128(dst + i * 4 + 2, _mm_unpacklo_epi16(hi, hi2));
+			_mm_storeu_si128(dst + i * 4 + 3, _mm_unpackhi_epi16(hi, hi2));
+		}
+	}
+}
+
+#else
+
+static inline uint64_t transpose8(uint64_t x) {
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+static void transpose_block(const uint8_t* block, const int* rows, size_t numrows, size_t word_bytes, uint8_t* out) {
+	for (size_t group = 0; group < word_bytes; group++) {
+		uint8_t r[8][8];
+		for (size_t i = 0; i < 8; i++) {
+			uint64_t bits = bus_row(block, rows, numrows, group * 8 + i);
+			memcpy(r[i], &bits, 8);
+		}
+
+		for (size_t k = 0; k < 8; k++) {
+			uint64_t x = 0;
+			for (size_t i = 0; i < 8; i++)
+				x |= (uint64_t)r[i][k] << (8 * i);
+			x = transpose8(x);
+
+			for (size_t j = 0; j < 8; j++)
+				out[(k * 8 + j) * word_bytes + group] = x >> (8 * j);
+		}
+	}
+}
+
+#endif
+
+/**
+	@brief Turn a LA_CROSS_DATA capture into sample-major bus words
+
+	Bit i of each word is channel rows[i] (an index into the capture's channels); words are
+	bus_word_bytes(numrows) wide, little endian. Every block of 8 bytes per channel becomes 64 words.
+ */
+void transpose_logic(const uint8_t* in, size_t numchans, size_t num_samples, const int* rows, size_t numrows, uint8_t* out) {
+	size_t stride = numchans * 8;
+	size_t word_bytes = bus_word_bytes(numrows);
+	int64_t blocks = num_samples / 8;
+
+	#pragma omp parallel for num_threads(team_size(num_samples * numchans)) schedule(static)
+	for (int64_t block = 0; block < blocks; block++)
+		transpose_block(in + block * stride, rows, numrows, word_bytes, out + block * 64 * word_bytes);
+}
+
+/**
+	@brief Bit i set where sample i of a 64 sample word differs from the sample before it
+
+	`prev` carries the last sample of the previous word in and out.
+ */
+static inline uint64_t edge_bits(uint64_t word, uint64_t& prev) {
+	uint64_t edges = word ^ ((word << 1) | prev);
+	prev = word >> 63;
+	return edges;
+}
+
+static inline void count_edges(const uint8_t* in, size_t numchans, size_t blocks, uint64_t* prev, size_t* counts) {
+	const uint8_t* p = in;
+	for (size_t block = 0; block < blocks; block++) {
+		for (size_t ch = 0; ch < numchans; ch++, p += 8) {
+			uint64_t word;
+			memcpy(&word, p, sizeof(word));
+			counts[ch] += __builtin_popcountll(edge_bits(word, prev[ch]));
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Without POPCNT the builtin is a dozen instructions, which is most of the cost of a quiet capture
+__attribute__((target("popcnt")))
+static void count_edges_popcnt(const uint8_t* in, size_t numchans, size_t blocks, uint64_t* prev, size_t* counts) {
+	count_edges(in, numchans, blocks, prev, counts);
+}
+
+static const bool s_havePopcnt = __builtin_cpu_supports("popcnt");
+#endif
+
+/**
+	@brief Number of level changes on each channel of a logic capture, over whole 8 byte blocks
+
+	One pass over the capture and one popcount per 64 samples, so quiet channels cost little more
+	than reading them.
+ */
+void logic_edge_counts(const uint8_t* in, size_t numchans, size_t num_samples, size_t* counts) {
+	size_t blocks = num_samples / 8;
+	std::vector<uint64_t> prev(numchans);
+	for (size_t ch = 0; ch < numchans; ch++) {
+		counts[ch] = 0;
+		prev[ch] = blocks ? in[ch * 8] & 1 : 0;
+	}
+
+	#if defined(__x86_64__) || defined(__i386__)
+	if (s_havePopcnt) {
+		count_edges_popcnt(in, numchans, blocks, prev.data(), counts);
+		return;
+	}
+	#endif
+	count_edges(in, numchans, blocks, prev.data(), counts);
+}
+
+/**
+	@brief Write the sample positions at which each channel with a non-null `out` changes level
+
+	`out[ch]` needs room for the count from logic_edge_counts(); `first[ch]` gets the channel's
+	first level. The level after the k-th position is the first level inverted k times.
+ */
+void logic_edges(const uint8_t* in, size_t numchans, size_t num_samples, uint32_t* const* out, uint8_t* first) {
+	size_t blocks = num_samples / 8;
+	std::vector<uint64_t> prev(numchans);
+	std::vector<uint32_t*> dst(out, out + numchans);
+	for (size_t ch = 0; ch < numchans; ch++) {
+		prev[ch] = blocks ? in[ch * 8] & 1 : 0;
+		first[ch] = prev[ch];
+	}
+
+	const uint8_t* p = in;
+	for (size_t block = 0; block < blocks; block++) {
+		uint32_t base = block * 64;
+		for (size_t ch = 0; ch < numchans; ch++, p += 8) {
+			if (!dst[ch])
+				continue;
+
+			uint64_t word;
+			memcpy(&word, p, sizeof(word));
+			for (uint64_t edges = edge_bits(word, prev[ch]); edges; edges &= edges - 1)
+				*dst[ch]++ = base + __builtin_ctzll(edges);
+		}
+	}
+}
+
+/**
+	@brief Print deinterleave throughput for team sizes 1..max_threads (0 = every core) on synthetic captures
+
+	Used to pick --deinterleave-threads for a machine: past some team size the figures stop
+	improving, because the loops are bound by memory bandwidth.
+ */
+void deinterleave_benchmark(int max_threads) {
+	if (max_threads <= 0)
+		max_threads = omp_get_num_procs();
+
+	static const size_t DSO_CHANS = 2;
+	static const size_t DSO_SAMPLES = 10000000;
+	static const size_t LOGIC_CHANS = 16;
+	static const size_t LOGIC_SAMPLES = 5000000;
+	static const int RUNS = 10;
+
+	std::vector<uint8_t> dso(DSO_CHANS * DSO_SAMPLES);
+	std::vector<uint8_t> logic(LOGIC_CHANS * LOGIC_SAMPLES);
+	for (size_t i = 0; i < dso.size(); i++)
+		dso[i] = i * 7;
+	for (size_t i = 0; i < logic.size(); i++)
+		logic[i] = i * 13;
+
+	std::vector<std::vector<uint8_t>> outs(LOGIC_CHANS, std::vector<uint8_t>(std::max(DSO_SAMPLES, LOGIC_SAMPLES)));
+	std::vector<uint8_t*> out;
+	for (auto& o : outs)
+		out.push_back(o.data());
+	bool clipping[DSO_CHANS];
+
+	printf("threads  dso %zuch x %zu MS (GB/s)  logic %zuch x %zu MS (GB/s)\n",
+		DSO_CHANS, DSO_SAMPLES / 1000000, LOGIC_CHANS, LOGIC_SAMPLES / 1000000);
+
+	int saved = g_deinterleaveThreads;
+	for (int threads = 1; threads <= max_threads; threads++) {
+		g_deinterleaveThreads = threads;
+
+		// One untimed pass to start the team and fault in the outputs
+		deinterleave_dso(dso.data(), DSO_CHANS, DSO_SAMPLES, out.data(), clipping);
+		uint64_t start = now_us();
+		for (int run = 0; run < RUNS; run++)
+			deinterleave_dso(dso.data(), DSO_CHANS, DSO_SAMPLES, out.data(), clipping);
+		double dso_gbps = (double)dso.size() * RUNS / (now_us() - start) / 1000;
+
+		deinterleave_logic(logic.data(), LOGIC_CHANS, LOGIC_SAMPLES, out.data());
+		start = now_us();
+		for (int run = 0; run < RUNS; run++)
+			deinterleave_logic(logic.data(), LOGIC_CHANS, LOGIC_SAMPLES, out.data());
+		double logic_gbps = (double)logic.size() * RUNS / (now_us() - start) / 1000;
+
+		printf("%7d  %22.2f  %24.2f\n", threads, dso_gbps, logic_gbps);
+	}
+	g_deinterleaveThreads = saved;
+}
@@ -0,0 +1,32 @@
+
+#ifndef deinterleave_h
+#define deinterleave_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	Splitting interleaved captures into per-channel sample arrays. Captures of at least
+	DEINTERLEAVE_PARALLEL_MIN bytes are split by sample range over g_deinterleaveThreads OpenMP
+	threads; smaller ones stay on the calling thread, where starting the team costs more than it
+	saves.
+ */
+
+static const size_t DEINTERLEAVE_PARALLEL_MIN = 1 << 20;
+
+extern int g_deinterleaveThreads;
+
+void deinterleave_init();
+
+void deinterleave_logic(const uint8_t* in, size_t numchans, size_t num_samples, uint8_t* const* out);
+void deinterleave_dso(const uint8_t* in, size_t numchans, size_t num_samples, uint8_t* const* out, bool* clipping);
+
+size_t bus_word_bytes(size_t numrows);
+void transpose_logic(const uint8_t* in, size_t numchans, size_t num_samples, const int* rows, size_t numrows, uint8_t* out);
+
+void logic_edge_counts(const uint8_t* in, size_t numchans, size_t num_samples, size_t* counts);
+void logic_edges(const uint8_t* in, size_t numchans, size_t num_samples, uint32_t* const* out, uint8_t* first);
+
+void deinterleave_benchmark(int max_threads);
+
+#endif // deinterleave_h
@@ -0,0 +1,212 @@
+
+#include "delta.h"
+#include "DataTransport.h"
+
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELTA_HAVE_AVX2_PATH
+#endif
+
+static const size_t DELTA_MAX_CHANNELS = 64;
+
+static std::atomic<bool> s_enabled{false};
+static std::atomic<unsigned> s_keyframeInterval{32};
+
+// Set from any thread; the session thread starts over with a keyframe when it sees it
+static std::atomic<bool> s_resetPending{true};
+
+// Session thread only: what the client last got for each channel
+static std::vector<uint8_t> s_reference[DELTA_MAX_CHANNELS];
+static size_t s_depth = 0;
+static unsigned s_sinceKeyframe = 0;
+
+void delta_set_enabled(bool enabled) {
+	s_enabled = enabled;
+	s_resetPending = true;
+}
+
+bool delta_enabled() {
+	return s_enabled;
+}
+
+void delta_set_keyframe_interval(unsigned frames) {
+	s_keyframeInterval = frames ? frames : 1;
+}
+
+unsigned delta_get_keyframe_interval() {
+	return s_keyframeInterval;
+}
+
+/**
+	@brief Forget the reference frames, e.g. because a new client connected
+ */
+void delta_reset() {
+	s_resetPending = true;
+}
+
+/**
+	@brief Start a frame; true if it has to be a keyframe
+ */
+bool delta_begin_frame(size_t num_samples) {
+	bool key = s_resetPending.exchange(false) || num_samples != s_depth || ++s_sinceKeyframe >= s_keyframeInterval;
+	if (key) {
+		s_depth = num_samples;
+		s_sinceKeyframe = 0;
+	}
+
+	return key;
+}
+
+static size_t kinds_size(size_t count) {
+	size_t blocks = (count + DELTA_BLOCK_SAMPLES - 1) / DELTA_BLOCK_SAMPLES;
+	return (blocks + 3) / 4;
+}
+
+/**
+	@brief Most bytes delta_encode_channel() can write for one channel
+ */
+size_t delta_max_size(size_t num_samples) {
+	return sizeof(uint8_t) + sizeof(uint64_t) + kinds_size(num_samples) + num_samples;
+}
+
+static inline void set_kind(uint8_t* kinds, size_t block, int kind) {
+	kinds[block / 4] |= kind << ((block % 4) * 2);
+}
+
+/**
+	@brief Encode one short or full block without SIMD; returns payload bytes written
+ */
+static size_t encode_block_scalar(const uint8_t* cur, const uint8_t* prev, size_t n, uint8_t* kinds, size_t block, uint8_t* out) {
+	uint8_t d[DELTA_BLOCK_SAMPLES];
+	uint8_t any = 0;
+	uint8_t wide = 0;
+	for (size_t i = 0; i < n; i++) {
+		d[i] = cur[i] - prev[i];
+		any |= d[i];
+		wide |= (uint8_t)(d[i] + 8) & 0xF0;
+	}
+
+	if (!any)
+		return 0;
+
+	if (!wide && n == DELTA_BLOCK_SAMPLES) {
+		set_kind(kinds, block, BLOCK_NIBBLE);
+		for (size_t i = 0; i < n / 2; i++)
+			out[i] = (d[i * 2] & 0x0F) | (d[i * 2 + 1] << 4);
+		return n / 2;
+	}
+
+	set_kind(kinds, block, BLOCK_FULL);
+	memcpy(out, d, n);
+	return n;
+}
+
+#ifdef DELTA_HAVE_AVX2_PATH
+__attribute__((target("avx2")))
+static size_t encode_blocks_avx2(const uint8_t* cur, const uint8_t* prev, size_t blocks, uint8_t* kinds, uint8_t* out) {
+	const __m256i bias = _mm256_set1_epi8(8);
+	const __m256i high = _mm256_set1_epi8((char)0xF0);
+	const __m256i lowNibble = _mm256_set1_epi16(0x000F);
+	const __m256i highNibble = _mm256_set1_epi16(0x00F0);
+
+	uint8_t* start = out;
+	for (size_t block = 0; block < blocks; block++) {
+		size_t i = block * DELTA_BLOCK_SAMPLES;
+		__m256i d = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(cur + i)), _mm256_loadu_si256((const __m256i*)(prev + i)));
+
+		if (_mm256_testz_si256(d, d))
+			continue;
+
+		if (_mm256_testz_si256(_mm256_add_epi8(d, bias), high)) {
+			// Pairs of bytes to one byte of two nibbles, then the two lanes' 8 bytes together
+			__m256i packed = _mm256_or_si256(_mm256_and_si256(d, lowNibble), _mm256_and_si256(_mm256_srli_epi16(d, 4), highNibble));
+			packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(packed, packed), 0x08);
+			_mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(packed));
+			set_kind(kinds, block, BLOCK_NIBBLE);
+			out += DELTA_BLOCK_SAMPLES / 2;
+		} else {
+			_mm256_storeu_si256((__m256i*)out, d);
+			set_kind(kinds, block, BLOCK_FULL);
+			out += DELTA_BLOCK_SAMPLES;
+		}
+	}
+
+	return out - start;
+}
+
+static const bool s_haveAVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+/**
+	@brief DELTA_BLOCKS payload for `cur` against `prev`; returns its size
+
+	`out` needs room for the block kinds plus `count` bytes.
+ */
+size_t delta_encode_blocks(const uint8_t* cur, const uint8_t* prev, size_t count, uint8_t* out) {
+	size_t blocks = count / DELTA_BLOCK_SAMPLES;
+	uint8_t* kinds = out;
+	memset(kinds, 0, kinds_size(count));
+	uint8_t* p = kinds + kinds_size(count);
+
+	size_t block = 0;
+	#ifdef DELTA_HAVE_AVX2_PATH
+	if (s_haveAVX2) {
+		p += encode_blocks_avx2(cur, prev, blocks, kinds, p);
+		block = blocks;
+	}
+	#endif
+
+	for (; block < blocks; block++) {
+		size_t i = block * DELTA_BLOCK_SAMPLES;
+		p += encode_block_scalar(cur + i, prev + i, DELTA_BLOCK_SAMPLES, kinds, block, p);
+	}
+
+	size_t tail = count % DELTA_BLOCK_SAMPLES;
+	if (tail)
+		p += encode_block_scalar(cur + count - tail, prev + count - tail, tail, kinds, blocks, p);
+
+	return p - out;
+}
+
+/**
+	@brief Append one channel's samples to `out`, as a delta against its last samples where that helps
+ */
+void delta_encode_channel(size_t chnum, const uint8_t* samples, size_t num_samples, bool key, FrameBuffer& out) {
+	std::vector<uint8_t>* ref = chnum < DELTA_MAX_CHANNELS ? &s_reference[chnum] : NULL;
+	if (!ref || ref->size() != num_samples)
+		key = true;
+
+	uint8_t* kind = out.Append(sizeof(uint8_t));
+	uint8_t* length = out.Append(sizeof(uint64_t));
+	uint64_t payload = 0;
+
+	if (!key && memcmp(samples, ref->data(), num_samples) == 0) {
+		*kind = DELTA_SAME;
+	} else {
+		// Room for the worst case; what isn't used is given back below
+		uint8_t* data = out.Append(kinds_size(num_samples) + num_samples);
+
+		*kind = DELTA_KEY;
+		if (!key) {
+			payload = delta_encode_blocks(samples, ref->data(), num_samples, data);
+			if (payload < num_samples)
+				*kind = DELTA_BLOCKS;
+		}
+
+		if (*kind == DELTA_KEY) {
+			memcpy(data, samples, num_samples);
+			payload = num_samples;
+		}
+
+		out.Truncate(data - out.Data() + payload);
+	}
+
+	memcpy(length, &payload, sizeof(payload));
+
+	if (ref)
+		ref->assign(samples, samples + num_samples);
+}
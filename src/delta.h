@@ -0,0 +1,60 @@
+
+#ifndef delta_h
+#define delta_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+class FrameBuffer;
+
+/*
+	Inter-frame delta encoding (DATA:DELTA 1) for analog channels sent RAW: each channel goes out
+	as the difference from the samples the same client got for it in the previous frame, marked
+	with format byte SAMPLE_DELTA_U8 in its channel header. The samples are replaced by
+
+		u8 kind, u64 payload length, payload
+
+	DELTA_KEY		payload is the raw ADC codes
+	DELTA_SAME		no payload; samples are identical to the previous frame's
+	DELTA_BLOCKS	2 bit kind per 32 sample block (LSB first, ceil(blocks / 4) bytes), then for
+					each block in order:
+						BLOCK_ZERO		nothing, unchanged
+						BLOCK_NIBBLE	16 bytes, two 4 bit signed deltas per byte, low nibble first
+						BLOCK_FULL		one u8 delta (mod 256) per sample; the last block may be short
+
+	Every DATA:KEYFRAME frames, on a new client, whenever the depth changes and after any frame
+	that went out some other way (in pieces, averaged or calibrated), all channels are
+	sent DELTA_KEY. A channel whose deltas wouldn't be smaller than its samples is sent DELTA_KEY
+	too, so the encoding never costs more than a few bytes per channel.
+ */
+
+enum delta_kind {
+	DELTA_KEY = 0,
+	DELTA_SAME = 1,
+	DELTA_BLOCKS = 2
+};
+
+enum delta_block {
+	BLOCK_ZERO = 0,
+	BLOCK_NIBBLE = 1,
+	BLOCK_FULL = 2
+};
+
+static const size_t DELTA_BLOCK_SAMPLES = 32;
+
+// Largest DATA:KEYFRAME
+static const unsigned DELTA_MAX_KEYFRAME_INTERVAL = 65536;
+
+void delta_set_enabled(bool enabled);
+bool delta_enabled();
+void delta_set_keyframe_interval(unsigned frames);
+unsigned delta_get_keyframe_interval();
+void delta_reset();
+
+size_t delta_max_size(size_t num_samples);
+bool delta_begin_frame(size_t num_samples);
+void delta_encode_channel(size_t chnum, const uint8_t* samples, size_t num_samples, bool key, FrameBuffer& out);
+
+size_t delta_encode_blocks(const uint8_t* cur, const uint8_t* prev, size_t count, uint8_t* out);
+
+#endif // delta_h
@@ -0,0 +1,101 @@
+
+#include "devicequeue.h"
+#include "server.h"
+#include "threading.h"
+#include "log/log.h"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+struct device_command {
+	uint32_t key;
+	bool fixup;
+	std::function<void()> apply;
+};
+
+static std::mutex s_mutex;
+static std::condition_variable s_wake;
+static std::deque<device_command> s_queue;
+static bool s_stop = false;
+
+static uint64_t s_coalesced = 0;
+static uint64_t s_applied = 0;
+static uint64_t s_lastReportMs = 0;
+
+void device_submit(uint32_t key, std::function<void()> apply, bool fixup) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	if (key != DEVICE_ORDERED) {
+		// Search back to the last ordered command; anything before it must keep its value
+		for (auto it = s_queue.rbegin(); it != s_queue.rend() && it->key != DEVICE_ORDERED; ++it) {
+			if (it->key == key) {
+				// Takes the old command's place, so it still runs in order with the other settings
+				it->fixup |= fixup;
+				it->apply = std::move(apply);
+				s_coalesced++;
+				return;
+			}
+		}
+	}
+
+	s_queue.push_back({key, fixup, std::move(apply)});
+	s_wake.notify_one();
+}
+
+/**
+	@brief Applies queued commands in batches for the lifetime of the process
+
+	Commands submitted while a batch is being applied (which can take a while, since
+	force_correct_config waits for the first frame) queue up and are coalesced before they run.
+ */
+void DeviceOwnerThread() {
+	apply_thread_policy("device");
+
+	std::unique_lock<std::mutex> lock(s_mutex);
+	for (;;) {
+		s_wake.wait(lock, [] { return s_stop || !s_queue.empty(); });
+		if (s_queue.empty())
+			break;
+
+		std::deque<device_command> batch;
+		batch.swap(s_queue);
+		lock.unlock();
+
+		bool fixup = false;
+		for (auto& command : batch) {
+			// Settings before a START/STOP must be fully in effect when it runs
+			if (command.key == DEVICE_ORDERED && fixup) {
+				force_correct_config();
+				fixup = false;
+			}
+
+			command.apply();
+			fixup |= command.fixup;
+		}
+
+		if (fixup)
+			force_correct_config();
+
+		lock.lock();
+		s_applied += batch.size();
+
+		uint64_t now = get_ms();
+		if (s_coalesced && now - s_lastReportMs > 10000) {
+			LogDebug("Device queue: applied %lu commands, %lu superseded before reaching hardware\n",
+				s_applied, s_coalesced);
+			s_lastReportMs = now;
+			s_applied = 0;
+			s_coalesced = 0;
+		}
+	}
+}
+
+/**
+	@brief Apply what is still queued, then end DeviceOwnerThread
+ */
+void device_queue_stop() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_stop = true;
+	s_wake.notify_one();
+}
@@ -0,0 +1,49 @@
+
+#ifndef devicequeue_h
+#define devicequeue_h
+
+#include <stdint.h>
+#include <functional>
+
+/*
+	All libsigrok configuration happens on one device-owner thread. The control plane submits
+	commands and returns immediately; queries are answered from state cached by the commands.
+
+	Commands carrying the same setting key replace each other while they wait, so a burst of
+	e.g. sample rate changes reaches the hardware once with the last value, at the first one's
+	place in the queue. A setting is never
+	coalesced across an ordered (DEVICE_ORDERED) command such as START or STOP.
+ */
+
+enum device_setting {
+	DEVICE_ORDERED = 0,
+	DEVICE_RATE,
+	DEVICE_DEPTH,
+	DEVICE_TRIGGER_DELAY,
+	DEVICE_TRIGGER_SOURCE,
+	DEVICE_TRIGGER_LEVEL,
+	DEVICE_TRIGGER_EDGE,
+	DEVICE_THRESHOLD,
+	DEVICE_ENABLE,
+	DEVICE_COUPLING,
+	DEVICE_RANGE,
+	DEVICE_RLE
+};
+
+// Key for a per-channel setting
+inline uint32_t device_key(device_setting setting, size_t chnum = 0) {
+	return (setting << 8) | chnum;
+}
+
+/**
+	@brief Queue `apply` for the device-owner thread
+
+	If `fixup`, force_correct_config() runs once after the batch the command ends up in, rather
+	than once per command.
+ */
+void device_submit(uint32_t key, std::function<void()> apply, bool fixup = false);
+
+void DeviceOwnerThread();
+void device_queue_stop();
+
+#endif // devicequeue_h
@@ -0,0 +1,91 @@
+
+#include "fft.h"
+
+#include <stdint.h>
+#include <math.h>
+
+FFTPlan::FFTPlan(size_t points)
+	: m_points(points)
+	, m_half(points / 2)
+	, m_bitrev(m_half)
+	, m_twRe(m_half)
+	, m_twIm(m_half)
+	, m_splitRe(m_half + 1)
+	, m_splitIm(m_half + 1)
+	, m_re(m_half)
+	, m_im(m_half)
+{
+	unsigned bits = 0;
+	while (((size_t)1 << bits) < m_half)
+		bits++;
+
+	for (size_t i = 0; i < m_half; i++) {
+		uint32_t r = 0;
+		for (unsigned b = 0; b < bits; b++)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		m_bitrev[i] = r;
+	}
+
+	for (size_t h = 1; h < m_half; h *= 2) {
+		for (size_t k = 0; k < h; k++) {
+			double angle = -M_PI * k / h;
+			m_twRe[h - 1 + k] = cos(angle);
+			m_twIm[h - 1 + k] = sin(angle);
+		}
+	}
+
+	for (size_t k = 0; k <= m_half; k++) {
+		double angle = -2 * M_PI * k / m_points;
+		m_splitRe[k] = cos(angle);
+		m_splitIm[k] = sin(angle);
+	}
+}
+
+void FFTPlan::Power(const float* in, float* power) {
+	float* re = m_re.data();
+	float* im = m_im.data();
+
+	// Even samples in the real part, odd in the imaginary, in bit reversed order
+	for (size_t i = 0; i < m_half; i++) {
+		uint32_t j = m_bitrev[i];
+		re[j] = in[2 * i];
+		im[j] = in[2 * i + 1];
+	}
+
+	for (size_t h = 1; h < m_half; h *= 2) {
+		const float* twRe = &m_twRe[h - 1];
+		const float* twIm = &m_twIm[h - 1];
+
+		for (size_t start = 0; start < m_half; start += 2 * h) {
+			float* aRe = re + start;
+			float* aIm = im + start;
+			float* bRe = aRe + h;
+			float* bIm = aIm + h;
+
+			#pragma omp simd
+			for (size_t k = 0; k < h; k++) {
+				float tr = bRe[k] * twRe[k] - bIm[k] * twIm[k];
+				float ti = bRe[k] * twIm[k] + bIm[k] * twRe[k];
+				bRe[k] = aRe[k] - tr;
+				bIm[k] = aIm[k] - ti;
+				aRe[k] += tr;
+				aIm[k] += ti;
+			}
+		}
+	}
+
+	// X[k] = E[k] + W^k O[k], E and O being the transforms of the even and odd samples
+	for (size_t k = 0; k <= m_half; k++) {
+		size_t k1 = k % m_half;
+		size_t k2 = (m_half - k) % m_half;
+
+		float eRe = (re[k1] + re[k2]) / 2;
+		float eIm = (im[k1] - im[k2]) / 2;
+		float oRe = (im[k1] + im[k2]) / 2;
+		float oIm = -(re[k1] - re[k2]) / 2;
+
+		float xRe = eRe + m_splitRe[k] * oRe - m_splitIm[k] * oIm;
+		float xIm = eIm + m_splitRe[k] * oIm + m_splitIm[k] * oRe;
+		power[k] = xRe * xRe + xIm * xIm;
+	}
+}
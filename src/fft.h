@@ -0,0 +1,44 @@
+
+#ifndef fft_h
+#define fft_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+	@brief Precomputed tables for a real-input FFT of one power-of-two size
+
+	The real input is packed into a complex FFT of half the size and split afterwards. Butterflies
+	work on separate real/imaginary arrays so the inner loops vectorize.
+ */
+class FFTPlan
+{
+public:
+	FFTPlan(size_t points);
+
+	size_t GetPoints() const { return m_points; }
+	size_t GetBins() const { return m_points / 2 + 1; }
+
+	// Power (|X|^2) of each of GetBins() bins of `in`, GetPoints() samples long
+	void Power(const float* in, float* power);
+
+protected:
+	size_t m_points;
+	size_t m_half;
+
+	std::vector<uint32_t> m_bitrev;
+
+	// Per stage butterfly twiddles, stage with span h starting at h-1
+	std::vector<float> m_twRe;
+	std::vector<float> m_twIm;
+
+	// exp(-2 pi i k / points), for splitting the packed transform
+	std::vector<float> m_splitRe;
+	std::vector<float> m_splitIm;
+
+	std::vector<float> m_re;
+	std::vector<float> m_im;
+};
+
+#endif // fft_h
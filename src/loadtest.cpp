@@ -0,0 +1,441 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+
+#include "log/log.h"
+#include "xptools/Socket.h"
+
+/*
+	bridge-loadtest: drives a running bridge the way a scopehal client does and reports what the
+	data plane sustains. Point it at a bridge started on real hardware or on the virtual-demo driver
+	(`scopehal-sigrok-bridge virtual-demo`).
+
+	It speaks the control plane just enough to configure and arm the device, then requests frames
+	('K') back to back on the data plane, parsing each one so that framing errors are caught. After
+	a warmup period it measures frames/s, MB/s and the latency from each ack to the end of the frame
+	it asked for.
+
+	--record writes the results to a baseline file; --baseline compares against one and exits with
+	status 1 if throughput dropped (or latency grew) by more than --tolerance.
+ */
+
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock clk;
+
+// Matches MESSAGE_TAG in DataTransport.h
+static const uint32_t MESSAGE_TAG = 0xFFFFFFFF;
+
+enum exit_status {
+	EXIT_PASS = 0,
+	EXIT_REGRESSION = 1,
+	EXIT_ERROR = 2
+};
+
+struct loadtest_config {
+	string host = "localhost";
+	uint16_t port = 5025;
+	double warmup_s = 2;
+	double seconds = 10;
+	uint64_t rate = 0;
+	uint64_t depth = 0;
+	string mask;
+	int logic = -1;		// -1: decide from *IDN?
+	string baselinePath;
+	string recordPath;
+	double tolerance = 0.1;
+};
+
+struct loadtest_result {
+	double frames_per_s;
+	double mb_per_s;
+	double latency_p50_ms;
+	double latency_p90_ms;
+	double latency_p99_ms;
+	double latency_max_ms;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Control plane
+
+static bool scpi_send(Socket& sock, const string& line)
+{
+	string s = line + "\n";
+	return sock.SendLooped((const unsigned char*)s.c_str(), s.size());
+}
+
+static bool scpi_query(Socket& sock, const string& line, string& reply)
+{
+	if (!scpi_send(sock, line))
+		return false;
+
+	reply.clear();
+	for (;;) {
+		unsigned char c;
+		if (!sock.RecvLooped(&c, 1))
+			return false;
+		if (c == '\n')
+			return true;
+		reply += c;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Data plane
+
+template<typename T> static bool recv_value(Socket& sock, T& value)
+{
+	return sock.RecvLooped((unsigned char*)&value, sizeof(T));
+}
+
+/**
+	@brief Receive and check one waveform frame, returning its size on the wire (0 on error)
+
+	Samples are read into a reused buffer and discarded; only the framing is validated.
+ */
+static size_t recv_frame(Socket& sock, bool logic, vector<uint8_t>& samples, uint32_t& seqnum)
+{
+	if (!recv_value(sock, seqnum))
+		return 0;
+
+	if (seqnum == MESSAGE_TAG) {
+		uint8_t type = 0;
+		recv_value(sock, type);
+		LogError("Unexpected data plane message (type %d); is chunked, histogram or spectrum mode on?\n", type);
+		return 0;
+	}
+
+	uint16_t numchans;
+	int64_t samplerate_fs;
+	uint64_t trig_fs;
+	double wfms_s;
+	if (!recv_value(sock, numchans) || !recv_value(sock, samplerate_fs) || !recv_value(sock, trig_fs) || !recv_value(sock, wfms_s))
+		return 0;
+
+	size_t total = sizeof(seqnum) + sizeof(numchans) + sizeof(samplerate_fs) + sizeof(trig_fs) + sizeof(wfms_s);
+
+	// Scope channels: scale, offset, trigphase and clipping. Logic channels: first sample index.
+	size_t chheader_size = logic ? sizeof(int32_t) : sizeof(float) * 3 + sizeof(bool);
+
+	for (uint16_t i = 0; i < numchans; i++) {
+		size_t chnum, num_samples;
+		if (!recv_value(sock, chnum) || !recv_value(sock, num_samples))
+			return 0;
+
+		if (chnum >= 64 || num_samples > (size_t)1 << 34) {
+			LogError("Frame %u: bad channel block (channel %zu, %zu samples)\n", seqnum, chnum, num_samples);
+			return 0;
+		}
+
+		uint8_t chheader[sizeof(float) * 3 + sizeof(bool)];
+		if (!sock.RecvLooped(chheader, chheader_size))
+			return 0;
+
+		// Raw 8-bit samples either way
+		if (samples.size() < num_samples)
+			samples.resize(num_samples);
+		if (num_samples && !sock.RecvLooped(samples.data(), num_samples))
+			return 0;
+
+		total += sizeof(chnum) + sizeof(num_samples) + chheader_size + num_samples;
+	}
+
+	return total;
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+
+	size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[i];
+}
+
+static double seconds_since(clk::time_point t)
+{
+	return std::chrono::duration<double>(clk::now() - t).count();
+}
+
+/**
+	@brief Request frames back to back until the measurement period is over
+ */
+static bool run_data_plane(const loadtest_config& config, bool logic, loadtest_result& result)
+{
+	Socket data(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if (!data.Connect(config.host, config.port + 1)) {
+		LogError("Could not connect to the data plane on %s:%d\n", config.host.c_str(), config.port + 1);
+		return false;
+	}
+	data.DisableNagle();
+
+	vector<uint8_t> samples;
+	vector<double> latencies;
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t received = 0;
+	uint32_t lastSeqnum = 0;
+	uint64_t skipped = 0;
+
+	clk::time_point start = clk::now();
+	clk::time_point measureStart = start;
+	bool measuring = false;
+
+	for (;;) {
+		double elapsed = seconds_since(start);
+		if (!measuring && elapsed >= config.warmup_s) {
+			measuring = true;
+			measureStart = clk::now();
+		}
+		if (elapsed >= config.warmup_s + config.seconds)
+			break;
+
+		clk::time_point ackTime = clk::now();
+		uint8_t ack = 'K';
+		if (!data.SendLooped(&ack, 1)) {
+			LogError("Data plane closed while sending an ack\n");
+			return false;
+		}
+
+		uint32_t seqnum;
+		size_t size = recv_frame(data, logic, samples, seqnum);
+		if (!size) {
+			LogError("Data plane closed or sent a malformed frame after %lu frames\n", (unsigned long)frames);
+			return false;
+		}
+
+		if (received++ && seqnum != lastSeqnum + 1)
+			skipped += seqnum - lastSeqnum - 1;
+		lastSeqnum = seqnum;
+
+		if (measuring) {
+			latencies.push_back(seconds_since(ackTime) * 1000);
+			frames++;
+			bytes += size;
+		}
+	}
+
+	double secs = seconds_since(measureStart);
+	if (!frames || secs <= 0) {
+		LogError("No frames received during the measurement period\n");
+		return false;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	result.frames_per_s = frames / secs;
+	result.mb_per_s = bytes / secs / 1e6;
+	result.latency_p50_ms = percentile(latencies, 0.50);
+	result.latency_p90_ms = percentile(latencies, 0.90);
+	result.latency_p99_ms = percentile(latencies, 0.99);
+	result.latency_max_ms = latencies.back();
+
+	if (skipped)
+		LogDebug("%lu hardware frames were captured while no request was pending\n", (unsigned long)skipped);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Baselines
+
+static std::map<string, double> result_fields(const loadtest_result& r)
+{
+	return {
+		{"frames_per_s", r.frames_per_s},
+		{"mb_per_s", r.mb_per_s},
+		{"latency_p50_ms", r.latency_p50_ms},
+		{"latency_p90_ms", r.latency_p90_ms},
+		{"latency_p99_ms", r.latency_p99_ms},
+		{"latency_max_ms", r.latency_max_ms}
+	};
+}
+
+static bool save_baseline(const string& path, const loadtest_result& result)
+{
+	FILE* fp = fopen(path.c_str(), "w");
+	if (!fp) {
+		LogError("Could not write baseline %s\n", path.c_str());
+		return false;
+	}
+
+	for (auto& it : result_fields(result))
+		fprintf(fp, "%s %f\n", it.first.c_str(), it.second);
+
+	fclose(fp);
+	return true;
+}
+
+static bool load_baseline(const string& path, std::map<string, double>& baseline)
+{
+	FILE* fp = fopen(path.c_str(), "r");
+	if (!fp) {
+		LogError("Could not read baseline %s\n", path.c_str());
+		return false;
+	}
+
+	// "<name> <value>" per line; lines starting with '#' are comments
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		char name[64];
+		double value;
+		if (line[0] != '#' && sscanf(line, "%63s %lf", name, &value) == 2)
+			baseline[name] = value;
+	}
+
+	fclose(fp);
+	return true;
+}
+
+/**
+	@brief Compare against a recorded baseline. Throughput may not fall, and p99 latency may not
+	grow, by more than the tolerance; the other latency figures are informational.
+ */
+static bool check_baseline(const std::map<string, double>& baseline, const loadtest_result& result, double tolerance)
+{
+	bool pass = true;
+
+	auto check = [&](const char* name, double value, bool higherIsBetter) {
+		auto it = baseline.find(name);
+		if (it == baseline.end())
+			return;
+
+		double limit = higherIsBetter ? it->second * (1 - tolerance) : it->second * (1 + tolerance);
+		bool ok = higherIsBetter ? value >= limit : value <= limit;
+		printf("%-16s %12.3f  baseline %12.3f  %s\n", name, value, it->second, ok ? "ok" : "REGRESSED");
+		pass &= ok;
+	};
+
+	check("frames_per_s", result.frames_per_s, true);
+	check("mb_per_s", result.mb_per_s, true);
+	check("latency_p99_ms", result.latency_p99_ms, false);
+
+	return pass;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Entry point
+
+static void usage(const char* argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("  --host <name>           bridge to test (default localhost)\n");
+	printf("  --port <n>              control plane port; data plane is the next one (default 5025)\n");
+	printf("  --seconds <s>           measurement period (default 10)\n");
+	printf("  --warmup <s>            frames discarded before measuring (default 2)\n");
+	printf("  --rate <hz>             sample rate to configure\n");
+	printf("  --depth <n>             sample depth to configure\n");
+	printf("  --mask <hex>            channel bitmask to stream, 0x for hex (DATA:MASK)\n");
+	printf("  --logic | --analog      override the channel type guessed from *IDN?\n");
+	printf("  --record <file>         save the results as a baseline\n");
+	printf("  --baseline <file>       fail (exit 1) if results regressed against this baseline\n");
+	printf("  --tolerance <fraction>  allowed regression (default 0.1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(Severity::VERBOSE));
+
+	loadtest_config config;
+
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool haveValue = i+1 < argc;
+
+		if (arg == "--host" && haveValue)
+			config.host = argv[++i];
+		else if (arg == "--port" && haveValue)
+			config.port = atoi(argv[++i]);
+		else if (arg == "--seconds" && haveValue)
+			config.seconds = atof(argv[++i]);
+		else if (arg == "--warmup" && haveValue)
+			config.warmup_s = atof(argv[++i]);
+		else if (arg == "--rate" && haveValue)
+			config.rate = strtoull(argv[++i], NULL, 10);
+		else if (arg == "--depth" && haveValue)
+			config.depth = strtoull(argv[++i], NULL, 10);
+		else if (arg == "--mask" && haveValue)
+			config.mask = argv[++i];
+		else if (arg == "--logic")
+			config.logic = 1;
+		else if (arg == "--analog")
+			config.logic = 0;
+		else if (arg == "--record" && haveValue)
+			config.recordPath = argv[++i];
+		else if (arg == "--baseline" && haveValue)
+			config.baselinePath = argv[++i];
+		else if (arg == "--tolerance" && haveValue)
+			config.tolerance = atof(argv[++i]);
+		else {
+			usage(argv[0]);
+			return EXIT_ERROR;
+		}
+	}
+
+	Socket scpi(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if (!scpi.Connect(config.host, config.port)) {
+		LogError("Could not connect to the control plane on %s:%d\n", config.host.c_str(), config.port);
+		return EXIT_ERROR;
+	}
+	scpi.DisableNagle();
+
+	string idn;
+	if (!scpi_query(scpi, "*IDN?", idn)) {
+		LogError("No reply to *IDN?\n");
+		return EXIT_ERROR;
+	}
+	LogNotice("Testing %s\n", idn.c_str());
+
+	bool logic = config.logic >= 0 ? config.logic : idn.find("DSLogic") != string::npos;
+
+	// Plain frames only: raw samples, no averaging or spectra; chunking is already off on a new
+	// connection
+	if (!logic) {
+		scpi_send(scpi, "CAL:FORMAT RAW");
+		scpi_send(scpi, "AVG:COUNT 0");
+		scpi_send(scpi, "FFT:ENABLE 0");
+	}
+	if (config.rate)
+		scpi_send(scpi, "RATE " + std::to_string(config.rate));
+	if (config.depth)
+		scpi_send(scpi, "DEPTH " + std::to_string(config.depth));
+	if (!config.mask.empty())
+		scpi_send(scpi, "DATA:MASK " + config.mask);
+	scpi_send(scpi, "START");
+
+	loadtest_result result;
+	bool ok = run_data_plane(config, logic, result);
+
+	scpi_send(scpi, "STOP");
+
+	if (!ok)
+		return EXIT_ERROR;
+
+	for (auto& it : result_fields(result))
+		printf("%-16s %12.3f\n", it.first.c_str(), it.second);
+
+	if (!config.recordPath.empty() && !save_baseline(config.recordPath, result))
+		return EXIT_ERROR;
+
+	if (!config.baselinePath.empty()) {
+		std::map<string, double> baseline;
+		if (!load_baseline(config.baselinePath, baseline))
+			return EXIT_ERROR;
+
+		if (!check_baseline(baseline, result, config.tolerance)) {
+			LogError("Performance regressed by more than %.0f%% against %s\n", config.tolerance * 100, config.baselinePath.c_str());
+			return EXIT_REGRESSION;
+		}
+	}
+
+	return EXIT_PASS;
+}
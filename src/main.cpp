@@ -3,40 +3,126 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
 
 #include <vector>
 #include <thread>
 
-#include <libsigrok4DSL/libsigrok.h>
-
 #include "log/log.h"
 
 #include "server.h"
-#include "srbinding.h"
+#include "bridge.h"
 #include "SigrokSCPIServer.h"
+#include "calibration.h"
+#include "threading.h"
+#include "DataTransport.h"
+#include "deinterleave.h"
+#include "asynclog.h"
+
+using std::string;
 
 Socket g_scpiSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-Socket g_dataSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 
 int main(int argc, char* argv[])
 {
-	char* drivername;
+	Severity console_verbosity = Severity::DEBUG;
+	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(console_verbosity));
 
-	if (argc != 2) {
-		printf("Usage: %s <driver name>\n", argv[0]);
+	char* drivername = NULL;
+	bool lockMemory = false;
+	bool useShm = true;
+	bool syncLog = false;
+	bool benchDeinterleave = false;
+	int scpi_port = 5025;
+	const char* resdir = "/usr/local/share/DSView/res/";
+
+	const char* home = getenv("HOME");
+	g_calPath = string(home ? home : ".") + "/.scopehal-sigrok-bridge.cal";
+
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+
+		if (arg == "--cal" && i+1 < argc) {
+			g_calPath = argv[++i];
+		} else if (arg == "--port" && i+1 < argc) {
+			scpi_port = atoi(argv[++i]);
+		} else if (arg == "--res" && i+1 < argc) {
+			resdir = argv[++i];
+		} else if (arg == "--threads" && i+1 < argc) {
+			if (!parse_thread_policy(argv[++i]))
+				return 1;
+		} else if (arg == "--thread-config" && i+1 < argc) {
+			if (!load_thread_policy(argv[++i]))
+				return 1;
+		} else if (arg == "--transport" && i+1 < argc) {
+			string kind(argv[++i]);
+			if (kind == "socket")
+				g_transportKind = TRANSPORT_SOCKET;
+			else if (kind == "zerocopy")
+				g_transportKind = TRANSPORT_ZEROCOPY;
+			else if (kind == "uring")
+				g_transportKind = TRANSPORT_URING;
+			else {
+				drivername = NULL;
+				break;
+			}
+		} else if (arg == "--no-shm") {
+			useShm = false;
+		} else if (arg == "--deinterleave-threads" && i+1 < argc) {
+			g_deinterleaveThreads = atoi(argv[++i]);
+		} else if (arg == "--bench-deinterleave") {
+			benchDeinterleave = true;
+		} else if (arg == "--probe-depths") {
+			g_probeDepths = true;
+		} else if (arg == "--sync-log") {
+			syncLog = true;
+		} else if (arg == "--mlockall") {
+			lockMemory = true;
+		} else if (arg[0] != '-' && !drivername) {
+			drivername = argv[i];
+		} else {
+			drivername = NULL;
+			break;
+		}
+	}
+
+	if (benchDeinterleave) {
+		deinterleave_benchmark(g_deinterleaveThreads);
+		return 0;
+	}
+
+	if (!drivername) {
+		printf("Usage: %s [options] <driver name>\n", argv[0]);
+		printf("  --cal <file>            analog calibration tables\n");
+		printf("  --port <n>              control plane port; the data plane is the next one (default 5025)\n");
+		printf("  --res <dir>             DSView firmware and bitstreams (default /usr/local/share/DSView/res/)\n");
+		printf("  --threads <spec>        thread placement, e.g. \"session=2@80;waveform=3;scpi=0-1\"\n");
+		printf("  --thread-config <file>  thread placement, one <name>=<cpus>[@<fifo priority>] per line\n");
+		printf("  --mlockall              lock all bridge memory into RAM\n");
+		printf("  --sync-log              write log messages from the thread that logs them (for debugging crashes)\n");
+		printf("  --probe-depths          find the deepest working capture at startup (takes a few seconds)\n");
+		printf("  --deinterleave-threads <n>  cores used to split deep captures (default: up to 4)\n");
+		printf("  --bench-deinterleave    print deinterleave throughput for 1..n threads (n from\n");
+		printf("                          --deinterleave-threads, default all cores) and exit\n");
+		printf("  --transport <kind>      data plane send path: socket (default), zerocopy or uring\n");
+		printf("  --no-shm                do not offer the shared memory data plane to local clients\n");
 		return 1;
 	}
 
-	drivername = argv[1];
 	int req_bus = -1;
 	int req_dev = -1;
 
-	Severity console_verbosity = Severity::DEBUG;
-	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(console_verbosity));
+	//From here on, console output happens on a thread of its own so that hot paths never block on it
+	if (!syncLog) {
+		LogSink* console = g_log_sinks[0].release();
+		g_asyncLog = new AsyncLogSink(console, console_verbosity);
+		g_log_sinks[0].reset(g_asyncLog);
+	}
 
-	chdir("/usr/local/share/DSView/res/");
+	if (lockMemory)
+		lock_process_memory();
 
-	LogNotice("libsigrok4DSL ver: '%s'\n", sr_package_version_string_get());
 	// sr_log_loglevel_set(4);
 	   //    0   None
 	   //    1   Error
@@ -46,15 +132,25 @@ int main(int argc, char* argv[])
 	   //    5   Spew
 	// virtual-demo, DSLogic, DSCope
 
-	if (init_and_find_device(drivername, req_bus, req_dev) != 0) return 1;
+	// libsigrok4DSL looks for firmware and bitstreams relative to the working directory
+	if (chdir(resdir) != 0) {
+		LogError("Cannot change to resource directory %s: %s\n", resdir, strerror(errno));
+		return 1;
+	}
+
+	if (bridge_open(drivername, req_bus, req_dev) != 0) return 1;
+
+	//Only now, so the session and device-owner threads do not start out with the accept loop's placement
+	apply_thread_policy("scpi");
 
-	int scpi_port = 5025;
 	int waveform_port = scpi_port+1;
 
 	//Configure the data plane socket
 	g_dataSocket.SetReuseaddr();
 	g_dataSocket.Bind(waveform_port);
 	g_dataSocket.Listen();
+	if (useShm)
+		open_shm_listener(waveform_port);
 
 	//Launch the control plane socket server
 	g_scpiSocket.SetReuseaddr();
@@ -67,8 +163,12 @@ int main(int argc, char* argv[])
 		if(!scpiClient.IsValid())
 			break;
 
-		g_quit = false;
-		g_run = false;
+		if (!bridge_claim_client()) {
+			LogWarning("Refusing control plane connection: an in-process client is connected\n");
+			continue;
+		}
+
+		bridge_reset_client();
 
 		//Create a server object for this connection
 		SigrokSCPIServer server(scpiClient.Detach());
@@ -80,9 +180,14 @@ int main(int argc, char* argv[])
 		server.MainLoop();
 
 		g_quit = true;
+		disconnect_data_client();
 
 		dataThread.join();
+
+		bridge_release_client();
 	}
 
+	bridge_close();
+
 	return 0;
 }
@@ -0,0 +1,229 @@
+
+#include "masktest.h"
+#include "log/log.h"
+
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MASK_HAVE_AVX2_PATH
+#endif
+
+static const size_t MASK_MAX_CHANNELS = 64;
+
+static std::atomic<bool> s_enabled{false};
+static std::atomic<unsigned> s_keep{0};
+static std::atomic<bool> s_stop{false};
+
+static std::atomic<uint64_t> s_pass{0};
+static std::atomic<uint64_t> s_fail{0};
+static std::atomic<uint64_t> s_channelFailures[MASK_MAX_CHANNELS];
+
+// Envelopes as uploaded, and the generation they are at
+static std::mutex s_mutex;
+static std::vector<uint8_t> s_lower[MASK_MAX_CHANNELS];
+static std::vector<uint8_t> s_upper[MASK_MAX_CHANNELS];
+static uint64_t s_generation = 0;
+
+/**
+	@brief Envelopes stretched to one capture's depth and interleaved like its samples
+
+	Built once per depth / channel set / upload, so testing a capture is one linear pass over the
+	packet as the driver delivered it. Channels without an envelope get 0..255.
+ */
+struct mask_layout {
+	uint64_t generation = ~0ULL;
+	size_t num_samples = 0;
+	std::vector<int> chnums;
+	std::vector<uint8_t> lower;
+	std::vector<uint8_t> upper;
+};
+
+static mask_layout s_layout;
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/**
+	@brief Replace a channel's lower or upper envelope; an empty or malformed string is rejected
+ */
+bool mask_set_envelope(size_t chnum, bool upper, const std::string& hex) {
+	if (chnum >= MASK_MAX_CHANNELS || hex.empty() || hex.size() % 2)
+		return false;
+
+	std::vector<uint8_t> points(hex.size() / 2);
+	for (size_t i = 0; i < points.size(); i++) {
+		int hi = hex_digit(hex[i * 2]);
+		int lo = hex_digit(hex[i * 2 + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		points[i] = hi * 16 + lo;
+	}
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	(upper ? s_upper : s_lower)[chnum] = std::move(points);
+	s_generation++;
+	return true;
+}
+
+void mask_clear(size_t chnum) {
+	if (chnum >= MASK_MAX_CHANNELS)
+		return;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_lower[chnum].clear();
+	s_upper[chnum].clear();
+	s_generation++;
+}
+
+void mask_set_enabled(bool enabled) {
+	s_enabled = enabled;
+}
+
+bool mask_enabled() {
+	return s_enabled;
+}
+
+void mask_set_keep(unsigned count) {
+	s_keep = std::min(count, MASK_MAX_KEEP);
+}
+
+unsigned mask_get_keep() {
+	return s_keep;
+}
+
+void mask_set_stop(bool stop) {
+	s_stop = stop;
+}
+
+bool mask_get_stop() {
+	return s_stop;
+}
+
+/**
+	@brief Zero the counters; pinned failures are cleared by the caller
+ */
+void mask_reset() {
+	s_pass = 0;
+	s_fail = 0;
+	for (auto& failures : s_channelFailures)
+		failures = 0;
+}
+
+void mask_counts(uint64_t& pass, uint64_t& fail, uint64_t& total) {
+	pass = s_pass;
+	fail = s_fail;
+	total = pass + fail;
+}
+
+uint64_t mask_channel_failures(size_t chnum) {
+	return chnum < MASK_MAX_CHANNELS ? s_channelFailures[chnum].load() : 0;
+}
+
+static void stretch(const std::vector<uint8_t>& points, uint8_t fill, size_t num_samples, size_t numchans, size_t ch,
+	std::vector<uint8_t>& out) {
+	for (size_t i = 0; i < num_samples; i++)
+		out[i * numchans + ch] = points.empty() ? fill : points[i * points.size() / num_samples];
+}
+
+static void update_layout(size_t num_samples, const std::vector<int>& sample_channels) {
+	if (s_layout.generation == s_generation && s_layout.num_samples == num_samples && s_layout.chnums == sample_channels)
+		return;
+
+	size_t numchans = sample_channels.size();
+	s_layout.generation = s_generation;
+	s_layout.num_samples = num_samples;
+	s_layout.chnums = sample_channels;
+	s_layout.lower.resize(num_samples * numchans);
+	s_layout.upper.resize(num_samples * numchans);
+
+	static const std::vector<uint8_t> none;
+	for (size_t ch = 0; ch < numchans; ch++) {
+		size_t chnum = sample_channels[ch];
+		stretch(chnum < MASK_MAX_CHANNELS ? s_lower[chnum] : none, 0, num_samples, numchans, ch, s_layout.lower);
+		stretch(chnum < MASK_MAX_CHANNELS ? s_upper[chnum] : none, 255, num_samples, numchans, ch, s_layout.upper);
+	}
+}
+
+#ifdef MASK_HAVE_AVX2_PATH
+__attribute__((target("avx2")))
+static bool inside_avx2(const uint8_t* in, const uint8_t* lower, const uint8_t* upper, size_t count) {
+	__m256i outside = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32) {
+		__m256i d = _mm256_loadu_si256((const __m256i*)(in + i));
+		__m256i lo = _mm256_loadu_si256((const __m256i*)(lower + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i*)(upper + i));
+
+		// Nonzero bytes where d < lo or d > hi (unsigned)
+		outside = _mm256_or_si256(outside, _mm256_xor_si256(d, _mm256_max_epu8(d, lo)));
+		outside = _mm256_or_si256(outside, _mm256_xor_si256(d, _mm256_min_epu8(d, hi)));
+	}
+
+	bool ok = _mm256_testz_si256(outside, outside);
+	for (; i < count; i++)
+		ok &= in[i] >= lower[i] && in[i] <= upper[i];
+	return ok;
+}
+
+static const bool s_haveAVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+static bool inside_scalar(const uint8_t* in, const uint8_t* lower, const uint8_t* upper, size_t count) {
+	uint8_t outside = 0;
+
+	#pragma omp simd reduction(|:outside)
+	for (size_t i = 0; i < count; i++)
+		outside |= (in[i] < lower[i]) | (in[i] > upper[i]);
+
+	return !outside;
+}
+
+static bool inside(const uint8_t* in, const uint8_t* lower, const uint8_t* upper, size_t count) {
+	#ifdef MASK_HAVE_AVX2_PATH
+	if (s_haveAVX2)
+		return inside_avx2(in, lower, upper, count);
+	#endif
+	return inside_scalar(in, lower, upper, count);
+}
+
+/**
+	@brief Check a DSO capture against the envelopes and count it; returns true if it failed
+ */
+bool mask_test(const uint8_t* in, size_t num_samples, const std::vector<int>& sample_channels) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	size_t numchans = sample_channels.size();
+	update_layout(num_samples, sample_channels);
+
+	const uint8_t* lower = s_layout.lower.data();
+	const uint8_t* upper = s_layout.upper.data();
+	if (inside(in, lower, upper, num_samples * numchans)) {
+		s_pass++;
+		return false;
+	}
+
+	// Rare: find out which channels were outside
+	for (size_t ch = 0; ch < numchans; ch++) {
+		for (size_t i = ch; i < num_samples * numchans; i += numchans) {
+			if (in[i] < lower[i] || in[i] > upper[i]) {
+				if ((size_t)sample_channels[ch] < MASK_MAX_CHANNELS)
+					s_channelFailures[sample_channels[ch]]++;
+				break;
+			}
+		}
+	}
+
+	s_fail++;
+	return true;
+}
@@ -0,0 +1,41 @@
+
+#ifndef masktest_h
+#define masktest_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+
+/*
+	Mask testing: each analog channel may have a lower and an upper ADC code envelope, uploaded
+	as hex strings of one byte per point ("<chan>:MASK:LOWER 1A1B1C..."). An envelope of M points is
+	stretched over the capture, point i covering samples [i * depth / M, (i+1) * depth / M).
+	A missing lower envelope is 0 and a missing upper one 255.
+
+	With MASK:ENABLE 1, every DSO capture the hardware delivers is checked on the session thread,
+	whether or not a client is waiting for it, and counted as a pass or a fail. The first
+	MASK:KEEP failing captures are pinned in the retained capture store, where 'Q' range queries
+	can fetch them by seqnum (MASK:FAILS? lists them). With MASK:STOP 1 the first failure also
+	stops acquisition.
+ */
+
+static const unsigned MASK_MAX_KEEP = 16;
+
+bool mask_set_envelope(size_t chnum, bool upper, const std::string& hex);
+void mask_clear(size_t chnum);
+
+void mask_set_enabled(bool enabled);
+bool mask_enabled();
+void mask_set_keep(unsigned count);
+unsigned mask_get_keep();
+void mask_set_stop(bool stop);
+bool mask_get_stop();
+
+void mask_reset();
+void mask_counts(uint64_t& pass, uint64_t& fail, uint64_t& total);
+uint64_t mask_channel_failures(size_t chnum);
+
+bool mask_test(const uint8_t* in, size_t num_samples, const std::vector<int>& sample_channels);
+
+#endif // masktest_h
@@ -0,0 +1,506 @@
+
+#include "measure.h"
+#include "deinterleave.h"
+#include "server.h"
+#include "threading.h"
+#include "log/log.h"
+
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <condition_variable>
+#include <math.h>
+#include <string.h>
+
+static const size_t MEAS_MAX_CHANNELS = 64;
+
+static const char* const s_typeNames[MEAS_TYPE_COUNT] = {"VPP", "MEAN", "RMS", "FREQ", "DUTY", "RISE"};
+
+// Types that make sense on a logic channel
+static const uint32_t LOGIC_TYPES = (1 << MEAS_FREQ) | (1 << MEAS_DUTY);
+
+/**
+	@brief Running statistics of one measurement over the captures it was taken on
+ */
+struct meas_stats {
+	double last = NAN;
+	double min = NAN;
+	double max = NAN;
+	double sum = 0;
+	uint64_t count = 0;
+
+	void Add(double value) {
+		last = value;
+		min = count ? std::min(min, value) : value;
+		max = count ? std::max(max, value) : value;
+		sum += value;
+		count++;
+	}
+};
+
+// Configuration and results, shared by the SCPI, session and measure threads
+static std::mutex s_mutex;
+static uint32_t s_types[MEAS_MAX_CHANNELS];		// bit per meas_type
+static meas_stats s_stats[MEAS_MAX_CHANNELS][MEAS_TYPE_COUNT];
+static std::atomic<bool> s_enabled{false};
+
+struct meas_job {
+	bool logic;
+	std::vector<size_t> chnums;
+	std::vector<std::vector<uint8_t>> samples;
+	size_t num_samples;
+	int64_t samplerate_fs;
+};
+
+/**
+	@brief Rising edges found in one capture, as fractional sample positions
+ */
+struct edge_summary {
+	uint64_t count = 0;
+	double first = 0;
+	double last = 0;
+
+	void Add(double t) {
+		if (!count)
+			first = t;
+		last = t;
+		count++;
+	}
+
+	// Average frequency over the whole periods between the first and last edge
+	bool Frequency(int64_t samplerate_fs, double& hz) const {
+		if (count < 2 || last <= first)
+			return false;
+		hz = 1e15 * (count - 1) / ((last - first) * samplerate_fs);
+		return true;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+/**
+	@brief Code range, sum and sum of squares of an analog channel in one vectorized pass
+ */
+static void analog_moments(const uint8_t* in, size_t n, uint8_t& lo, uint8_t& hi, uint64_t& sum, uint64_t& sumsq) {
+	uint8_t mn = 255, mx = 0;
+	uint64_t s = 0, s2 = 0;
+
+	#pragma omp simd reduction(min:mn) reduction(max:mx) reduction(+:s,s2)
+	for (size_t i = 0; i < n; i++) {
+		uint8_t d = in[i];
+		mn = std::min(mn, d);
+		mx = std::max(mx, d);
+		s += d;
+		s2 += (uint32_t)d * d;
+	}
+
+	lo = mn;
+	hi = mx;
+	sum = s;
+	sumsq = s2;
+}
+
+// Samples at or above `level` after XOR with `flip`
+static size_t analog_count_above(const uint8_t* in, size_t n, uint8_t flip, uint8_t level) {
+	size_t count = 0;
+
+	#pragma omp simd reduction(+:count)
+	for (size_t i = 0; i < n; i++)
+		count += (uint8_t)(in[i] ^ flip) >= level;
+
+	return count;
+}
+
+/**
+	@brief Rising edges (with hysteresis) and mean 10-90% rise time of an analog channel
+
+	Works on x = code ^ flip, so that x rises with the voltage whichever way round the ADC is.
+ */
+static void analog_edges(const uint8_t* in, size_t n, uint8_t flip, uint8_t lo, uint8_t hi,
+	edge_summary& edges, double& rise_sum, uint64_t& rise_count) {
+	double range = hi - lo;
+	double mid = lo + range / 2;
+	double arm = mid - range / 10;
+	double trip = mid + range / 10;
+	double l10 = lo + range / 10;
+	double l90 = lo + range * 9 / 10;
+
+	bool armed = false;
+	bool riseArmed = false;
+	double midCross = 0;
+	double up10 = 0;
+
+	for (size_t i = 1; i < n; i++) {
+		double prev = (uint8_t)(in[i - 1] ^ flip);
+		double cur = (uint8_t)(in[i] ^ flip);
+
+		if (cur > prev) {
+			if (prev < mid && cur >= mid)
+				midCross = i - 1 + (mid - prev) / (cur - prev);
+			if (prev < l10 && cur >= l10)
+				up10 = i - 1 + (l10 - prev) / (cur - prev);
+			if (riseArmed && prev < l90 && cur >= l90) {
+				rise_sum += i - 1 + (l90 - prev) / (cur - prev) - up10;
+				rise_count++;
+				riseArmed = false;
+			}
+		}
+
+		if (cur <= arm) {
+			armed = true;
+		} else if (armed && cur >= trip) {
+			edges.Add(midCross);
+			armed = false;
+		}
+
+		if (cur < l10)
+			riseArmed = true;
+	}
+}
+
+/**
+	@brief High samples and rising edges of a logic channel, 64 samples per word
+ */
+static void logic_edges(const uint8_t* in, size_t bytes, uint64_t& high, edge_summary& edges) {
+	size_t words = bytes / 8;
+	high = 0;
+
+	uint64_t carry = in[0] & 1;
+	for (size_t w = 0; w < words; w++) {
+		uint64_t bits;
+		memcpy(&bits, in + w * 8, 8);
+
+		high += __builtin_popcountll(bits);
+
+		// Bit j is sample 64w + j; a rising edge is a 1 whose predecessor is 0
+		uint64_t rising = bits & ~((bits << 1) | carry);
+		carry = bits >> 63;
+		if (!rising)
+			continue;
+
+		uint64_t n = __builtin_popcountll(rising);
+		double first = w * 64 + __builtin_ctzll(rising);
+		double last = w * 64 + 63 - __builtin_clzll(rising);
+		if (!edges.count)
+			edges.first = first;
+		edges.last = last;
+		edges.count += n;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Worker
+
+/**
+	@brief Owns the "measure" thread and the capture waiting for it
+ */
+class MeasureWorker
+{
+public:
+	~MeasureWorker();
+
+	void Start();
+	bool Submit(bool logic, const uint8_t* in, size_t num_samples,
+		const std::vector<int>& sample_channels, int64_t samplerate_fs);
+	uint64_t Dropped() { return m_droppedTotal; }
+
+	std::atomic<double> m_rate{0};
+
+protected:
+	void Run();
+	void Process(meas_job& job);
+	void MeasureAnalog(size_t chnum, uint32_t types, const uint8_t* in, size_t n, int64_t samplerate_fs, double* values, uint32_t& valid);
+	void MeasureLogic(uint32_t types, const uint8_t* in, size_t bytes, int64_t samplerate_fs, double* values, uint32_t& valid);
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	bool m_stop = false;
+	bool m_jobReady = false;
+	meas_job m_next;
+
+	std::atomic<uint64_t> m_droppedTotal{0};
+
+	// Worker thread only
+	uint64_t m_rateStartMs = 0;
+	uint64_t m_rateFrames = 0;
+	uint64_t m_rateDropped = 0;
+};
+
+static MeasureWorker s_worker;
+
+MeasureWorker::~MeasureWorker() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void MeasureWorker::Start() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_thread.joinable())
+		m_thread = std::thread(&MeasureWorker::Run, this);
+}
+
+/**
+	@brief Split out the measured channels of a capture for the worker, unless it is still busy
+ */
+bool MeasureWorker::Submit(bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_jobReady) {
+		m_droppedTotal++;
+		return false;
+	}
+
+	size_t numchans = sample_channels.size();
+	std::vector<uint8_t*> out(numchans, NULL);
+
+	m_next.logic = logic;
+	m_next.num_samples = num_samples;
+	m_next.samplerate_fs = samplerate_fs;
+	m_next.chnums.clear();
+	for (size_t ch = 0; ch < numchans; ch++) {
+		if (meas_channel_enabled(sample_channels[ch]))
+			m_next.chnums.push_back(sample_channels[ch]);
+	}
+
+	if (m_next.chnums.empty())
+		return false;
+
+	// Buffers are reused from capture to capture
+	m_next.samples.resize(m_next.chnums.size());
+	for (size_t ch = 0, i = 0; ch < numchans; ch++) {
+		if (i < m_next.chnums.size() && m_next.chnums[i] == (size_t)sample_channels[ch]) {
+			m_next.samples[i].resize(num_samples);
+			out[ch] = m_next.samples[i++].data();
+		}
+	}
+
+	if (logic) {
+		deinterleave_logic(in, numchans, num_samples, out.data());
+	} else {
+		std::unique_ptr<bool[]> clipping(new bool[numchans]);
+		deinterleave_dso(in, numchans, num_samples, out.data(), clipping.get());
+	}
+
+	m_jobReady = true;
+	m_wake.notify_one();
+	return true;
+}
+
+void MeasureWorker::Run() {
+	apply_thread_policy("measure");
+
+	meas_job job;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		m_wake.wait(lock, [this] { return m_stop || m_jobReady; });
+		if (m_stop)
+			return;
+
+		// Keep both jobs' buffers around so steady state does not allocate
+		std::swap(job, m_next);
+		m_jobReady = false;
+		lock.unlock();
+
+		Process(job);
+
+		lock.lock();
+	}
+}
+
+void MeasureWorker::MeasureAnalog(size_t chnum, uint32_t types, const uint8_t* in, size_t n, int64_t samplerate_fs,
+	double* values, uint32_t& valid) {
+	float scale, offset;
+	compute_scale_and_offset(g_channels[chnum], scale, offset);
+
+	uint8_t lo, hi;
+	uint64_t sum, sumsq;
+	analog_moments(in, n, lo, hi, sum, sumsq);
+
+	double mean = (double)sum / n;
+	double meansq = (double)sumsq / n;
+
+	values[MEAS_VPP] = fabs(scale) * (hi - lo);
+	values[MEAS_MEAN] = mean * scale - offset;
+	values[MEAS_RMS] = sqrt(std::max(0.0, scale * scale * meansq - 2.0 * scale * offset * mean + (double)offset * offset));
+	valid |= (1 << MEAS_VPP) | (1 << MEAS_MEAN) | (1 << MEAS_RMS);
+
+	// A flat trace has no edges, and too little range to tell noise from signal
+	if (!(types & ((1 << MEAS_FREQ) | (1 << MEAS_DUTY) | (1 << MEAS_RISE))) || hi - lo < 4)
+		return;
+
+	// The ADC is upside down when scale is negative; flip codes so that they rise with the voltage
+	uint8_t flip = scale < 0 ? 0xFF : 0;
+	uint8_t xlo = flip ? 255 - hi : lo;
+	uint8_t xhi = flip ? 255 - lo : hi;
+
+	values[MEAS_DUTY] = (double)analog_count_above(in, n, flip, (xlo + xhi + 1) / 2) / n;
+	valid |= 1 << MEAS_DUTY;
+
+	edge_summary edges;
+	double rise_sum = 0;
+	uint64_t rise_count = 0;
+	analog_edges(in, n, flip, xlo, xhi, edges, rise_sum, rise_count);
+
+	if (edges.Frequency(samplerate_fs, values[MEAS_FREQ]))
+		valid |= 1 << MEAS_FREQ;
+
+	if (rise_count) {
+		values[MEAS_RISE] = rise_sum / rise_count * samplerate_fs * 1e-15;
+		valid |= 1 << MEAS_RISE;
+	}
+}
+
+void MeasureWorker::MeasureLogic(uint32_t types, const uint8_t* in, size_t bytes, int64_t samplerate_fs,
+	double* values, uint32_t& valid) {
+	if (!(types & LOGIC_TYPES) || bytes < 8)
+		return;
+
+	uint64_t high;
+	edge_summary edges;
+	logic_edges(in, bytes, high, edges);
+
+	values[MEAS_DUTY] = (double)high / ((bytes & ~(size_t)7) * 8);
+	valid |= 1 << MEAS_DUTY;
+
+	if (edges.Frequency(samplerate_fs, values[MEAS_FREQ]))
+		valid |= 1 << MEAS_FREQ;
+}
+
+void MeasureWorker::Process(meas_job& job) {
+	for (size_t i = 0; i < job.chnums.size(); i++) {
+		size_t chnum = job.chnums[i];
+
+		uint32_t types;
+		{
+			std::lock_guard<std::mutex> lock(s_mutex);
+			types = s_types[chnum];
+		}
+
+		double values[MEAS_TYPE_COUNT];
+		uint32_t valid = 0;
+		if (job.logic)
+			MeasureLogic(types, job.samples[i].data(), job.num_samples, job.samplerate_fs, values, valid);
+		else if (job.num_samples)
+			MeasureAnalog(chnum, types, job.samples[i].data(), job.num_samples, job.samplerate_fs, values, valid);
+
+		std::lock_guard<std::mutex> lock(s_mutex);
+		for (int type = 0; type < MEAS_TYPE_COUNT; type++) {
+			// Types may have been removed while we worked
+			if ((valid & s_types[chnum]) & (1 << type))
+				s_stats[chnum][type].Add(values[type]);
+		}
+	}
+
+	m_rateFrames++;
+	uint64_t now = get_ms();
+	if (!m_rateStartMs) {
+		m_rateStartMs = now;
+	} else if (now - m_rateStartMs >= 10000) {
+		m_rate = m_rateFrames * 1000.0 / (now - m_rateStartMs);
+
+		uint64_t dropped = m_droppedTotal;
+		LogDebug("Measurements: %.1f captures/s measured, %lu dropped while busy\n", m_rate.load(), dropped - m_rateDropped);
+		m_rateDropped = dropped;
+		m_rateStartMs = now;
+		m_rateFrames = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Interface
+
+bool meas_parse_type(const std::string& name, int& type) {
+	for (int i = 0; i < MEAS_TYPE_COUNT; i++) {
+		if (name == s_typeNames[i]) {
+			type = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+	@brief Start taking measurement `type` on a channel, with fresh statistics
+ */
+void meas_add(size_t chnum, int type) {
+	if (chnum >= MEAS_MAX_CHANNELS)
+		return;
+
+	s_worker.Start();
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_types[chnum] |= 1 << type;
+	s_stats[chnum][type] = meas_stats();
+	s_enabled = true;
+}
+
+void meas_clear(size_t chnum) {
+	if (chnum >= MEAS_MAX_CHANNELS)
+		return;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_types[chnum] = 0;
+
+	bool any = false;
+	for (size_t ch = 0; ch < MEAS_MAX_CHANNELS; ch++)
+		any |= s_types[ch] != 0;
+	s_enabled = any;
+}
+
+void meas_reset_stats() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	for (auto& channel : s_stats) {
+		for (auto& stats : channel)
+			stats = meas_stats();
+	}
+}
+
+bool meas_enabled() {
+	return s_enabled;
+}
+
+bool meas_channel_enabled(size_t chnum) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return chnum < MEAS_MAX_CHANNELS && s_types[chnum];
+}
+
+/**
+	@brief "last,min,max,mean,count" for one measurement; values are nan until it has been taken once
+ */
+std::string meas_query(size_t chnum, int type) {
+	meas_stats stats;
+	if (chnum < MEAS_MAX_CHANNELS) {
+		std::lock_guard<std::mutex> lock(s_mutex);
+		stats = s_stats[chnum][type];
+	}
+
+	char buf[128];
+	snprintf(buf, sizeof(buf), "%g,%g,%g,%g,%lu", stats.last, stats.min, stats.max,
+		stats.count ? stats.sum / stats.count : NAN, (unsigned long)stats.count);
+	return buf;
+}
+
+// Captures measured per second over the last report interval
+double meas_rate() {
+	return s_worker.m_rate;
+}
+
+uint64_t meas_dropped() {
+	return s_worker.Dropped();
+}
+
+void meas_submit(bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs) {
+	s_worker.Submit(logic, in, num_samples, sample_channels, samplerate_fs);
+}
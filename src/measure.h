@@ -0,0 +1,46 @@
+
+#ifndef measure_h
+#define measure_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+
+/*
+	Continuous measurements: each channel can have a set of measurements that are taken on every
+	capture the hardware delivers, whether or not a data plane client is attached. Captures are
+	handed to a worker thread ("measure") and dropped while it is busy, so the capture path never
+	waits. Every measurement keeps running statistics over the captures it was taken on, read
+	back with "<chan>:MEAS:<type>?" as "last,min,max,mean,count".
+
+	Analog channels support all types, in volts, Hz, fraction and seconds. Logic channels only
+	support FREQ and DUTY. Edges are found with 10% hysteresis around the midpoint of each
+	capture's range; rise time runs from 10% to 90% of that range.
+ */
+
+enum meas_type {
+	MEAS_VPP,
+	MEAS_MEAN,
+	MEAS_RMS,
+	MEAS_FREQ,
+	MEAS_DUTY,
+	MEAS_RISE,
+	MEAS_TYPE_COUNT
+};
+
+bool meas_parse_type(const std::string& name, int& type);
+
+void meas_add(size_t chnum, int type);
+void meas_clear(size_t chnum);
+void meas_reset_stats();
+bool meas_enabled();
+bool meas_channel_enabled(size_t chnum);
+std::string meas_query(size_t chnum, int type);
+double meas_rate();
+uint64_t meas_dropped();
+
+void meas_submit(bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs);
+
+#endif // measure_h
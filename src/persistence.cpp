@@ -0,0 +1,294 @@
+
+#include "persistence.h"
+#include "server.h"
+#include "threading.h"
+#include "DataTransport.h"
+#include "log/log.h"
+
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+static const unsigned ROWS = 256;
+
+// Columns with fewer samples than this are counted straight into the histogram
+static const size_t SUBHIST_MIN_SAMPLES = 1024;
+
+static std::atomic<uint32_t> s_columns{0};
+static std::atomic<bool> s_resetRequested{false};
+
+// Histograms and their configuration; held by the session thread for a whole capture
+static std::mutex s_mutex;
+static std::vector<size_t> s_chnums;
+static std::vector<uint64_t> s_vdivs;
+static std::vector<std::vector<uint32_t>> s_hist;	// per channel, [column][code]
+static uint32_t s_histColumns = 0;
+static size_t s_depth = 0;
+static int64_t s_samplerate_fs = 0;
+static uint64_t s_frames = 0;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Worker pool
+
+/**
+	@brief Helper threads that each take a share of the columns of a capture
+
+	Workers own disjoint column ranges, so they never touch the same counters.
+ */
+class PersistPool
+{
+public:
+	~PersistPool() { Resize(0); }
+
+	void Resize(unsigned helpers);
+	unsigned Size() { return m_threads.size() + 1; }
+
+	// Run job(0..Size()-1), one index on the calling thread, and wait for all of them
+	void Run(std::function<void(unsigned)> job);
+
+protected:
+	void Worker(unsigned index, uint64_t generation);
+
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	std::vector<std::thread> m_threads;
+	std::function<void(unsigned)> m_job;
+	uint64_t m_generation = 0;
+	unsigned m_pending = 0;
+	bool m_stop = false;
+};
+
+void PersistPool::Resize(unsigned helpers) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_start.notify_all();
+	for (auto& t : m_threads)
+		t.join();
+
+	m_threads.clear();
+	m_stop = false;
+
+	for (unsigned i = 0; i < helpers; i++)
+		m_threads.emplace_back(&PersistPool::Worker, this, i + 1, m_generation);
+}
+
+void PersistPool::Run(std::function<void(unsigned)> job) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_job = job;
+		m_pending = m_threads.size();
+		m_generation++;
+	}
+	m_start.notify_all();
+
+	job(0);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this] { return m_pending == 0; });
+}
+
+void PersistPool::Worker(unsigned index, uint64_t seen) {
+	apply_thread_policy("persist");
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		m_start.wait(lock, [&] { return m_stop || m_generation != seen; });
+		if (m_stop)
+			return;
+
+		seen = m_generation;
+		lock.unlock();
+		m_job(index);
+		lock.lock();
+
+		if (--m_pending == 0)
+			m_done.notify_one();
+	}
+}
+
+static PersistPool s_pool;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+/**
+	@brief Set the number of time columns per histogram; 0 turns persistence off
+ */
+void persist_set_columns(uint32_t columns) {
+	if (columns > PERSIST_MAX_COLUMNS)
+		columns = PERSIST_MAX_COLUMNS;
+
+	s_columns = columns;
+	s_resetRequested = true;
+}
+
+uint32_t persist_get_columns() {
+	return s_columns;
+}
+
+bool persist_enabled() {
+	return s_columns != 0;
+}
+
+/**
+	@brief Spread histogram updates over `threads` cores (the session thread plus helpers)
+ */
+void persist_set_threads(unsigned threads) {
+	threads = std::min(threads, PERSIST_MAX_THREADS);
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_pool.Resize(threads > 1 ? threads - 1 : 0);
+}
+
+void persist_clear() {
+	s_resetRequested = true;
+}
+
+uint64_t persist_frames() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return s_frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Accumulation
+
+/**
+	@brief Count `count` codes into one 256-entry histogram column
+
+	Long runs are counted into four interleaved sub-histograms first, so that runs of equal codes
+	(the common case for slow signals) don't serialize on one counter, and then merged in with a
+	loop the compiler vectorizes.
+ */
+static void count_column(uint32_t* column, const uint8_t* in, size_t count) {
+	if (count < SUBHIST_MIN_SAMPLES) {
+		for (size_t i = 0; i < count; i++)
+			column[in[i]]++;
+		return;
+	}
+
+	uint32_t sub[4][ROWS] = {};
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		sub[0][in[i]]++;
+		sub[1][in[i + 1]]++;
+		sub[2][in[i + 2]]++;
+		sub[3][in[i + 3]]++;
+	}
+	for (; i < count; i++)
+		sub[0][in[i]]++;
+
+	for (unsigned code = 0; code < ROWS; code++)
+		column[code] += sub[0][code] + sub[1][code] + sub[2][code] + sub[3][code];
+}
+
+// First aligned sample index that falls in `column`
+static size_t column_start(size_t column) {
+	return (column * s_depth + s_histColumns - 1) / s_histColumns;
+}
+
+static void count_columns(size_t chindex, const uint8_t* in, int shift, size_t first, size_t last) {
+	uint32_t* hist = s_hist[chindex].data();
+
+	for (size_t column = first; column < last; column++) {
+		// Sample i lands at aligned index i - shift, as for averaging
+		int64_t start = (int64_t)column_start(column) + shift;
+		int64_t end = (int64_t)column_start(column + 1) + shift;
+		start = std::max<int64_t>(start, 0);
+		end = std::min<int64_t>(end, s_depth);
+
+		if (end > start)
+			count_column(hist + column * ROWS, in + start, end - start);
+	}
+}
+
+static bool config_changed(const std::vector<size_t>& chnums, size_t num_samples, int64_t samplerate_fs) {
+	if (chnums != s_chnums || num_samples != s_depth || samplerate_fs != s_samplerate_fs
+		|| s_columns != s_histColumns)
+		return true;
+
+	for (size_t i = 0; i < chnums.size(); i++) {
+		if (s_vdivs[i] != get_vdiv(chnums[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+	@brief Add one capture to the histograms, restarting them if the configuration changed
+
+	`shifts` holds each channel's trigger phase (with any filter delay) rounded to whole samples.
+ */
+void persist_accumulate(const std::vector<size_t>& chnums, const std::vector<const uint8_t*>& samples,
+	const std::vector<int>& shifts, size_t num_samples, int64_t samplerate_fs) {
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	if (s_resetRequested.exchange(false) || config_changed(chnums, num_samples, samplerate_fs)) {
+		s_chnums = chnums;
+		s_depth = num_samples;
+		s_samplerate_fs = samplerate_fs;
+		s_histColumns = s_columns;
+		s_frames = 0;
+
+		s_vdivs.clear();
+		for (size_t chnum : chnums)
+			s_vdivs.push_back(get_vdiv(chnum));
+
+		s_hist.assign(chnums.size(), std::vector<uint32_t>((size_t)s_histColumns * ROWS, 0));
+	}
+
+	if (!s_histColumns || !num_samples)
+		return;
+
+	unsigned workers = s_pool.Size();
+	s_pool.Run([&](unsigned worker) {
+		size_t first = s_histColumns * worker / workers;
+		size_t last = s_histColumns * (worker + 1) / workers;
+
+		for (size_t i = 0; i < chnums.size(); i++)
+			count_columns(i, samples[i], shifts[i], first, last);
+	});
+
+	s_frames++;
+}
+
+/**
+	@brief Send the current histograms to `client` as a MESSAGE_HISTOGRAM message
+ */
+bool persist_snapshot(std::shared_ptr<DataTransport> client) {
+	std::shared_ptr<FrameBuffer> msg;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+
+		size_t counts_size = (size_t)s_histColumns * ROWS * sizeof(uint32_t);
+		msg = client->Acquire(64 + s_chnums.size() * (sizeof(size_t) + 2 * sizeof(float) + counts_size));
+
+		msg->Put(MESSAGE_TAG);
+		msg->Put((uint8_t)MESSAGE_HISTOGRAM);
+		msg->Put((uint16_t)s_chnums.size());
+		msg->Put(s_histColumns);
+		msg->Put(s_frames);
+		msg->Put(s_samplerate_fs);
+		msg->Put((uint64_t)s_depth);
+
+		for (size_t i = 0; i < s_chnums.size(); i++) {
+			float scale, offset;
+			compute_scale_and_offset(g_channels[s_chnums[i]], scale, offset);
+
+			msg->Put(s_chnums[i]);
+			msg->Put(scale);
+			msg->Put(offset);
+			memcpy(msg->Append(counts_size), s_hist[i].data(), counts_size);
+		}
+	}
+
+	// Behind any pieces of a frame still queued, so it can't land in the middle of one
+	send_in_order(client, msg);
+	return true;
+}
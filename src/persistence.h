@@ -0,0 +1,39 @@
+
+#ifndef persistence_h
+#define persistence_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <memory>
+
+class DataTransport;
+
+/*
+	Persistence: a per-channel 2D histogram of (time column, ADC code) hit counts built from every
+	analog capture, including the ones the client never sees. The client asks for a snapshot by
+	sending 'H' on the data socket and receives a MESSAGE_HISTOGRAM message:
+
+		u32 MESSAGE_TAG, u8 MESSAGE_HISTOGRAM, u16 numchans, u32 columns, u64 frames,
+		i64 samplerate_fs, u64 samples per capture, then per channel
+		size_t chnum, float scale, float offset, u32 counts[columns][256]
+
+	Column c covers samples [c * samples / columns, (c+1) * samples / columns) after trigger
+	alignment; row r is ADC code r, volts = r * scale - offset.
+ */
+
+static const uint32_t PERSIST_MAX_COLUMNS = 4096;
+static const unsigned PERSIST_MAX_THREADS = 64;
+
+void persist_set_columns(uint32_t columns);
+uint32_t persist_get_columns();
+bool persist_enabled();
+void persist_set_threads(unsigned threads);
+void persist_clear();
+uint64_t persist_frames();
+
+void persist_accumulate(const std::vector<size_t>& chnums, const std::vector<const uint8_t*>& samples,
+	const std::vector<int>& shifts, size_t num_samples, int64_t samplerate_fs);
+bool persist_snapshot(std::shared_ptr<DataTransport> client);
+
+#endif // persistence_h
@@ -0,0 +1,266 @@
+
+#include "retain.h"
+#include "server.h"
+#include "DataTransport.h"
+#include "log/log.h"
+
+#include <string.h>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <deque>
+
+/**
+	@brief One capture as it came from the driver, plus what is needed to describe its channels
+ */
+struct retained_capture {
+	uint32_t seqnum;
+	bool logic;
+	size_t num_samples;		// per channel: samples (DSO) or bytes of 8 samples (logic)
+	std::vector<int> chnums;	// hardware channel of each interleaved channel
+	std::vector<float> scales;
+	std::vector<float> offsets;
+	int64_t samplerate_fs;
+	uint64_t trig_fs;
+	float trigphase;
+	int32_t first_sample;
+	std::vector<uint8_t> data;
+};
+
+static std::atomic<unsigned> s_count{0};
+
+// Newest at the back. Captures are shared with queries being answered, which build their reply
+// without holding s_mutex; storage of a dropped capture is reused once no query holds it.
+static std::mutex s_mutex;
+static std::deque<std::shared_ptr<retained_capture>> s_captures;
+static std::deque<std::shared_ptr<retained_capture>> s_pinned;
+
+void retain_set_count(unsigned count) {
+	count = std::min(count, RETAIN_MAX_COUNT);
+	s_count = count;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	while (s_captures.size() > count)
+		s_captures.pop_front();
+}
+
+unsigned retain_get_count() {
+	return s_count;
+}
+
+bool retain_enabled() {
+	return s_count > 0;
+}
+
+std::vector<uint32_t> retain_seqnums() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	std::vector<uint32_t> result;
+	for (auto& capture : s_captures)
+		result.push_back(capture->seqnum);
+	return result;
+}
+
+static void fill_capture(retained_capture& capture, uint32_t seqnum, bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs, float trigphase, int32_t first_sample) {
+	size_t numchans = sample_channels.size();
+
+	capture.seqnum = seqnum;
+	capture.logic = logic;
+	capture.num_samples = num_samples;
+	capture.chnums = sample_channels;
+	capture.scales.assign(numchans, 0);
+	capture.offsets.assign(numchans, 0);
+	capture.samplerate_fs = samplerate_fs;
+	capture.trig_fs = g_trigfs;
+	capture.trigphase = trigphase;
+	capture.first_sample = first_sample;
+
+	// Scale as set when the capture was taken, in case the client changes it while zoomed in
+	if (!logic) {
+		for (size_t ch = 0; ch < numchans; ch++)
+			compute_scale_and_offset(g_channels[sample_channels[ch]], capture.scales[ch], capture.offsets[ch]);
+	}
+
+	capture.data.assign(in, in + num_samples * numchans);
+}
+
+/**
+	@brief Keep a copy of a capture that is being delivered to the client, dropping the oldest
+ */
+void retain_capture(uint32_t seqnum, bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs, float trigphase, int32_t first_sample) {
+	unsigned count = s_count;
+	if (!count)
+		return;
+
+	std::shared_ptr<retained_capture> capture;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		if (s_captures.size() >= count) {
+			capture = std::move(s_captures.front());
+			s_captures.pop_front();
+		}
+	}
+
+	// Copied without the lock, so a query being answered never holds up the capture path
+	if (!capture || capture.use_count() > 1)
+		capture = std::make_shared<retained_capture>();
+	fill_capture(*capture, seqnum, logic, in, num_samples, sample_channels, samplerate_fs, trigphase, first_sample);
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_captures.push_back(std::move(capture));
+	while (s_captures.size() > s_count)
+		s_captures.pop_front();
+}
+
+/**
+	@brief Keep a copy of a capture until retain_clear_pinned(), if fewer than `limit` are pinned
+
+	Pinned captures (e.g. mask test failures) can be queried like recent ones, but are never
+	pushed out by newer captures.
+ */
+bool retain_pin_capture(size_t limit, uint32_t seqnum, bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs, float trigphase, int32_t first_sample) {
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		if (s_pinned.size() >= limit)
+			return false;
+	}
+
+	std::shared_ptr<retained_capture> capture = std::make_shared<retained_capture>();
+	fill_capture(*capture, seqnum, logic, in, num_samples, sample_channels, samplerate_fs, trigphase, first_sample);
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if (s_pinned.size() >= limit)
+		return false;
+
+	s_pinned.push_back(std::move(capture));
+	return true;
+}
+
+void retain_clear_pinned() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_pinned.clear();
+}
+
+std::vector<uint32_t> retain_pinned_seqnums() {
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	std::vector<uint32_t> result;
+	for (auto& capture : s_pinned)
+		result.push_back(capture->seqnum);
+	return result;
+}
+
+// Byte `index` of channel `ch` in a LA_CROSS_DATA capture: 8 bytes per channel per block
+static inline uint8_t logic_byte(const retained_capture& capture, size_t ch, size_t index) {
+	size_t numchans = capture.chnums.size();
+	return capture.data[(index / 8) * numchans * 8 + ch * 8 + index % 8];
+}
+
+/**
+	@brief Read a 'Q' request's arguments from the client and send back the MESSAGE_RANGE it asks for
+ */
+bool retain_query(std::shared_ptr<DataTransport> client) {
+	uint32_t seqnum;
+	uint64_t mask, first, count;
+	uint32_t decimation;
+	if (!client->RecvArgs(&seqnum, sizeof(seqnum)) || !client->RecvArgs(&mask, sizeof(mask))
+		|| !client->RecvArgs(&first, sizeof(first)) || !client->RecvArgs(&count, sizeof(count))
+		|| !client->RecvArgs(&decimation, sizeof(decimation)))
+		return false;
+
+	decimation = std::max(decimation, (uint32_t)1);
+
+	// Hold on to the capture rather than the lock while the (possibly large) reply is built
+	std::shared_ptr<const retained_capture> found;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+
+		if (seqnum == MESSAGE_TAG && !s_captures.empty())
+			found = s_captures.back();
+		for (auto& c : s_captures) {
+			if (c->seqnum == seqnum)
+				found = c;
+		}
+		for (auto& c : s_pinned) {
+			if (c->seqnum == seqnum)
+				found = c;
+		}
+	}
+	const retained_capture* capture = found.get();
+
+	// Window in the capture's own sample units, clamped to what it holds
+	bool logic = capture && capture->logic;
+	uint64_t total = !capture ? 0 : logic ? (capture->num_samples & ~(size_t)7) * 8 : capture->num_samples;
+	first = std::min(first, total);
+	count = std::min(count, total - first);
+	if (logic && decimation == 1) {
+		uint64_t end = std::min((first + count + 7) & ~(uint64_t)7, total);
+		first &= ~(uint64_t)7;
+		count = end - first;
+	}
+
+	uint64_t out_samples = (count + decimation - 1) / decimation;
+	size_t out_size = logic ? (out_samples + 7) / 8 : out_samples;
+
+	std::vector<size_t> chans;
+	if (capture) {
+		for (size_t ch = 0; ch < capture->chnums.size(); ch++) {
+			if ((mask >> capture->chnums[ch]) & 1)
+				chans.push_back(ch);
+		}
+	}
+
+	std::shared_ptr<FrameBuffer> msg = client->Acquire(128 + chans.size() * (sizeof(size_t) * 2 + 16 + out_size));
+	msg->Put(MESSAGE_TAG);
+	msg->Put((uint8_t)MESSAGE_RANGE);
+	msg->Put(capture ? capture->seqnum : seqnum);
+	msg->Put((uint16_t)chans.size());
+	msg->Put(capture ? capture->samplerate_fs * decimation : (int64_t)0);
+	msg->Put(capture ? capture->trig_fs : (uint64_t)0);
+	msg->Put(first);
+	msg->Put(decimation);
+
+	for (size_t ch : chans) {
+		msg->Put((size_t)capture->chnums[ch]);
+		msg->Put(out_size);
+
+		if (logic) {
+			msg->Put(capture->first_sample);
+
+			uint8_t* out = msg->Append(out_size);
+			if (decimation == 1) {
+				for (size_t i = 0; i < out_size; i++)
+					out[i] = logic_byte(*capture, ch, first / 8 + i);
+			} else {
+				memset(out, 0, out_size);
+				for (uint64_t i = 0; i < out_samples; i++) {
+					uint64_t bit = first + i * decimation;
+					if ((logic_byte(*capture, ch, bit / 8) >> (bit % 8)) & 1)
+						out[i / 8] |= 1 << (i % 8);
+				}
+			}
+		} else {
+			size_t numchans = capture->chnums.size();
+			float config[3] = {capture->scales[ch], capture->offsets[ch], capture->trigphase};
+			msg->Put(config);
+			bool* clipping = (bool*)msg->Append(sizeof(bool));
+
+			uint8_t* out = msg->Append(out_size);
+			const uint8_t* in = capture->data.data() + first * numchans + ch;
+			bool clipped = false;
+			for (uint64_t i = 0; i < out_samples; i++) {
+				uint8_t d = in[i * decimation * numchans];
+				clipped |= (d <= g_hwmin || d >= g_hwmax);
+				out[i] = d;
+			}
+			*clipping = clipped;
+		}
+	}
+
+	send_in_order(client, msg);
+	return true;
+}
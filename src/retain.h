@@ -0,0 +1,51 @@
+
+#ifndef retain_h
+#define retain_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <memory>
+
+class DataTransport;
+
+/*
+	Retained captures: the last RETAIN:COUNT captures delivered to the client are kept, still
+	interleaved as the driver produced them, so that a zoomed-in client can fetch a window at full
+	resolution instead of a whole new frame. The client sends 'Q' on the data socket followed by
+
+		u32 seqnum (MESSAGE_TAG for the newest), u64 channel mask, u64 first sample,
+		u64 sample count, u32 decimation (0 or 1 for every sample)
+
+	and receives a MESSAGE_RANGE message:
+
+		u32 MESSAGE_TAG, u8 MESSAGE_RANGE, u32 seqnum, u16 numchans, i64 samplerate_fs,
+		u64 trig_fs, u64 first sample, u32 decimation, then per channel
+		size_t chnum, size_t num_samples, the channel header of a RAW frame, samples
+
+	Samples and channel headers are as in RAW frames, whatever format frames are sent in. For
+	logic channels sample positions count bits, the window is widened to whole bytes and
+	num_samples counts bytes. samplerate_fs is that of the returned (decimated) samples. A capture
+	that is no longer retained comes back with no channels.
+
+	Captures can also be pinned (mask test failures are): these stay queryable by seqnum until
+	cleared, however many newer captures arrive.
+ */
+
+static const unsigned RETAIN_MAX_COUNT = 8;
+
+void retain_set_count(unsigned count);
+unsigned retain_get_count();
+bool retain_enabled();
+std::vector<uint32_t> retain_seqnums();
+
+void retain_capture(uint32_t seqnum, bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs, float trigphase, int32_t first_sample);
+bool retain_pin_capture(size_t limit, uint32_t seqnum, bool logic, const uint8_t* in, size_t num_samples,
+	const std::vector<int>& sample_channels, int64_t samplerate_fs, float trigphase, int32_t first_sample);
+void retain_clear_pinned();
+std::vector<uint32_t> retain_pinned_seqnums();
+
+bool retain_query(std::shared_ptr<DataTransport> client);
+
+#endif // retain_h
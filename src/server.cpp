@@ -3,7 +3,10 @@
 #include <libsigrok4DSL/libsigrok.h>
 #include "log/log.h"
 #include "srbinding.h"
+#include "threading.h"
 #include <math.h>
+#include <thread>
+#include <unistd.h>
 
 struct sr_context* g_sr_context = NULL;
 struct sr_dev_inst* g_sr_device = NULL;
@@ -11,6 +14,10 @@ struct sr_session* g_sr_session = NULL;
 
 std::vector<struct sr_channel*> g_channels{};
 std::vector<uint64_t> vdiv_options{};
+std::vector<uint64_t> g_rate_options{};
+
+// Per channel vdiv as last set, so the data path and queries don't have to ask the driver
+static std::vector<std::atomic<uint64_t>> s_vdiv;
 std::vector<uint64_t> g_attenuations{};
 
 bool g_quit;
@@ -36,6 +43,24 @@ uint8_t g_dev_usb_bus, g_dev_usb_dev;
 
 HzClock g_hwRateClock;
 
+// DSLogic hardware run-length compression is on (RLE:ENABLE)
+std::atomic<bool> g_rle{false};
+
+// Deepest capture known to work. Beyond 5 MS libsigrok4DSL typically fails with LIBUSB_ERROR_NO_MEM,
+// well short of SR_CONF_HW_DEPTH; --probe-depths finds the real limit.
+uint64_t g_maxDepth = 5000000;
+bool g_probeDepths = false;
+
+// Deepest capture the device can store with hardware RLE on (SR_CONF_RLE_SAMPLELIMITS); 0 if unknown
+static uint64_t s_rleDepth = 0;
+
+// How long a probe capture may take before it counts as failed
+static const uint64_t PROBE_TIMEOUT_MS = 5000;
+
+static std::atomic<bool> s_probing{false};
+static std::atomic<uint64_t> s_probeSamples{0};
+static std::atomic<bool> s_probeError{false};
+
 void update_trigger_internals();
 
 void set_trigger_channel(int ch) {
@@ -98,7 +123,7 @@ int count_enabled_channels() {
 }
 
 void compute_scale_and_offset(struct sr_channel* ch, float& scale, float& offset) {
-	float vdiv_mV = get_probe_config<uint64_t>(g_sr_device, ch, SR_CONF_PROBE_VDIV).value();
+	float vdiv_mV = get_vdiv(ch->index);
 
 	float full_throw_V = vdiv_mV / 1000 * g_numdivs;  // Volts indicated by most-positive value (255)
 	// g_hwrange_factor adjusts for incomplete range of ADC reports
@@ -218,6 +243,12 @@ int init_and_find_device(const char* wanted_driver, int req_usb_bus, int req_usb
 
     LogDebug("Device has %ld channels\n", g_channels.size());
 
+	s_vdiv = std::vector<std::atomic<uint64_t>>(g_channels.size());
+	for (size_t i = 0; i < g_channels.size(); i++)
+		s_vdiv[i] = get_probe_config<uint64_t>(g_sr_device, g_channels[i], SR_CONF_PROBE_VDIV).value_or(0);
+
+	g_rate_options = get_dev_config_options<uint64_t>(g_sr_device, SR_CONF_SAMPLERATE);
+
     // Must configure device language to make SR_CONF_OPERATION_MODE values meaningful...
 	set_dev_config<int16_t>(g_sr_device, SR_CONF_LANGUAGE, LANGUAGE_EN);
 
@@ -246,6 +277,10 @@ int init_and_find_device(const char* wanted_driver, int req_usb_bus, int req_usb
 
 		ds_trigger_set_mode(SIMPLE_TRIGGER);
 		ds_trigger_set_en(true);
+
+		g_rle = get_dev_config<bool>(g_sr_device, SR_CONF_RLE).value_or(false);
+		s_rleDepth = get_dev_config<uint64_t>(g_sr_device, SR_CONF_RLE_SAMPLELIMITS).value_or(0);
+		LogDebug("Hardware RLE: %s\n", rle_supported() ? (g_rle ? "on" : "off") : "unsupported");
 	}
 
 	g_hw_depth = get_dev_config<uint64_t>(g_sr_device, SR_CONF_HW_DEPTH).value();
@@ -280,7 +315,7 @@ bool stop_capture_sync() {
 	int cycles = 0;
 	while (g_running) {
 		if (cycles++ > 1000) break; // Avoid hanging if not triggering
-		usleep(100);
+		policed_usleep(100);
 	}
 
 	return wasRunning;
@@ -296,12 +331,12 @@ void force_correct_config() {
 	// and this fixes it.
 
 	if (g_deviceIsScope && g_run) {
-		while (!g_running) usleep(100);
+		while (!g_running) policed_usleep(100);
 
 		int cycles = 0;
 		while (!g_capturedFirstFrame) {
 			if (cycles++ > 1000) break; // Avoid hanging if not triggered
-			usleep(100);
+			policed_usleep(100);
 		}
 	}
 
@@ -329,6 +364,45 @@ void set_depth(uint64_t depth) {
 	set_dev_config<uint64_t>(g_sr_device, SR_CONF_LIMIT_SAMPLES, g_depth);
 }
 
+void set_vdiv(size_t chnum, uint64_t vdiv) {
+	set_probe_config<uint64_t>(g_sr_device, g_channels[chnum], SR_CONF_PROBE_VDIV, vdiv);
+	s_vdiv[chnum] = get_probe_config<uint64_t>(g_sr_device, g_channels[chnum], SR_CONF_PROBE_VDIV).value_or(vdiv);
+}
+
+bool rle_supported() {
+	return !g_deviceIsScope && get_dev_config<bool>(g_sr_device, SR_CONF_RLE_SUPPORT).value_or(false);
+}
+
+/**
+	@brief Turn the DSLogic's hardware run-length compression on or off; false if it can't be
+
+	With RLE the device stores and transfers runs rather than every sample, so sparse signals take
+	less of its buffer and of the USB link. The driver expands them again, so packets look the same.
+ */
+bool set_rle(bool enable) {
+	if (!rle_supported())
+		return false;
+
+	bool wasRunning = stop_capture_sync();
+
+	set_dev_config<bool>(g_sr_device, SR_CONF_RLE, enable);
+	g_rle = get_dev_config<bool>(g_sr_device, SR_CONF_RLE).value_or(false);
+	g_hw_depth = get_dev_config<uint64_t>(g_sr_device, SR_CONF_HW_DEPTH).value_or(g_hw_depth);
+	s_rleDepth = get_dev_config<uint64_t>(g_sr_device, SR_CONF_RLE_SAMPLELIMITS).value_or(0);
+
+	// A depth only reachable with RLE does not survive turning it off
+	if (g_depth > max_capture_depth())
+		set_depth(max_capture_depth());
+
+	if (wasRunning) restart_capture();
+
+	return g_rle == enable;
+}
+
+uint64_t get_vdiv(size_t chnum) {
+	return chnum < s_vdiv.size() ? s_vdiv[chnum].load() : 0;
+}
+
 void set_trigfs(uint64_t fs) {
 	// LogDebug("set_trigfs %lu\n", fs);
 
@@ -366,3 +440,112 @@ void set_trigfs(uint64_t fs) {
 	else
 		ds_trigger_set_pos(g_trigpct);
 }
+
+/**
+	@brief Deepest capture offered to clients
+
+	Without RLE that is the deepest known to work (g_maxDepth; SR_CONF_HW_DEPTH is far more than
+	libsigrok4DSL can actually transfer). With RLE the device stores and sends runs, so the limit
+	is its own RLE sample limit.
+ */
+uint64_t max_capture_depth() {
+	if (g_rle && s_rleDepth)
+		return std::max(s_rleDepth, std::min(g_hw_depth, g_maxDepth));
+
+	return std::min(g_hw_depth, g_maxDepth);
+}
+
+/**
+	@brief Sample depths offered to clients: 1-2.5-5 steps from 100 up to `limit`
+ */
+std::vector<uint64_t> sample_depth_steps(uint64_t limit) {
+	std::vector<uint64_t> result;
+	for (uint64_t d = 10; d <= limit; d *= 10) {
+		for (uint64_t m : {10, 25, 50}) {
+			if (d * m <= limit)
+				result.push_back(d * m);
+		}
+	}
+
+	return result;
+}
+
+bool depth_probe_active() {
+	return s_probing;
+}
+
+/**
+	@brief Datafeed packets seen while probing; counts samples instead of sending frames
+ */
+void depth_probe_packet(const struct sr_datafeed_packet* packet) {
+	if (packet->type == SR_DF_LOGIC) {
+		auto logic = (const struct sr_datafeed_logic*)packet->payload;
+
+		int enabled = 0;
+		for (auto ch : g_channels)
+			enabled += ch->enabled ? 1 : 0;
+
+		if (logic->data_error)
+			s_probeError = true;
+		else if (enabled)
+			s_probeSamples += logic->length / enabled * 8;	// bytes per channel, 8 samples each
+	} else if (packet->type == SR_DF_DSO) {
+		s_probeSamples += ((const struct sr_datafeed_dso*)packet->payload)->num_samples;
+	}
+}
+
+/**
+	@brief Find the deepest capture that actually completes, by trying depths above g_maxDepth
+
+	Runs one capture per candidate depth, shallowest first, until one fails or times out. Must be
+	called from the session thread (with the datafeed callback registered) before any client
+	can start a capture.
+ */
+void probe_sample_depths() {
+	uint64_t saved = g_depth;
+
+	// A capture that waits for a trigger would only time out
+	if (!g_deviceIsScope)
+		ds_trigger_set_en(false);
+
+	s_probing = true;
+	for (uint64_t depth : sample_depth_steps(g_hw_depth)) {
+		if (depth <= g_maxDepth)
+			continue;
+
+		set_depth(depth);
+		s_probeSamples = 0;
+		s_probeError = false;
+
+		std::atomic<bool> done{false};
+		std::thread watchdog([&done] {
+			uint64_t start = get_ms();
+			while (!done && get_ms() - start < PROBE_TIMEOUT_MS)
+				usleep(10000);
+			if (!done)
+				sr_session_stop();
+		});
+
+		uint64_t start = get_ms();
+		int err = sr_session_start();
+		if (err == SR_OK)
+			err = sr_session_run();
+		done = true;
+		watchdog.join();
+
+		bool ok = err == SR_OK && !s_probeError && s_probeSamples >= depth;
+		LogDebug("Depth probe: %lu samples %s (%lu received in %lu ms)\n", depth, ok ? "ok" : "failed",
+			(uint64_t)s_probeSamples, get_ms() - start);
+
+		if (!ok)
+			break;
+		g_maxDepth = depth;
+	}
+	s_probing = false;
+
+	if (!g_deviceIsScope)
+		ds_trigger_set_en(true);
+	set_depth(saved);
+
+	LogNotice("Deepest working capture: %lu samples\n", g_maxDepth);
+}
@@ -4,6 +4,8 @@
 
 #include <vector>
 #include <mutex>
+#include <memory>
+#include <atomic>
 
 #include <libsigrok4DSL/libsigrok.h>
 #include "xptools/Socket.h"
@@ -20,18 +22,41 @@ extern struct sr_session* g_sr_session;
 
 extern vector<struct sr_channel*> g_channels;
 extern vector<uint64_t> vdiv_options;
+extern vector<uint64_t> g_rate_options;
 extern uint64_t g_rate, g_depth, g_trigfs;
 extern uint64_t g_hw_depth;
+extern uint64_t g_maxDepth;
+extern bool g_probeDepths;
 extern uint8_t g_trigpct;
 extern vector<uint64_t> g_attenuations;
 
 extern bool g_quit;
+extern std::atomic<bool> g_shutdown;
 extern bool g_run;
 extern bool g_running;
 extern bool g_oneShot;
 extern bool g_capturedFirstFrame;
 extern bool g_deviceIsScope;
 
+extern std::atomic<uint64_t> g_channelMask;
+extern std::atomic<size_t> g_chunkSamples;
+// Largest DATA:CHUNK; a chunk's sample count goes out as a u32
+static const size_t CHUNK_MAX_SAMPLES = UINT32_MAX;
+extern std::atomic<int> g_logicLayout;
+extern std::atomic<bool> g_rle;
+extern std::atomic<unsigned> g_batchFrames;
+extern std::atomic<unsigned> g_batchWaitMs;
+
+static const unsigned BATCH_MAX_FRAMES = 256;
+static const unsigned BATCH_MAX_WAIT_MS = 10000;
+
+// How logic captures are laid out on the data plane (DATA:LAYOUT)
+enum logic_layout {
+	LAYOUT_CHANNEL,	// the usual per-channel frames
+	LAYOUT_BUS,	// MESSAGE_BUS, one word per sample
+	LAYOUT_EDGES	// MESSAGE_EDGES, level change positions per channel
+};
+
 extern uint64_t g_session_start_ms;
 extern uint32_t g_seqnum;
 extern double g_lastReportedRate;
@@ -64,10 +89,32 @@ void force_correct_config();
 void set_rate(uint64_t rate);
 void set_depth(uint64_t depth);
 void set_trigfs(uint64_t fs);
+void set_vdiv(size_t chnum, uint64_t vdiv);
+bool rle_supported();
+bool set_rle(bool enable);
+double edge_compression();
+uint64_t get_vdiv(size_t chnum);
+
+uint64_t max_capture_depth();
+std::vector<uint64_t> sample_depth_steps(uint64_t limit);
+bool depth_probe_active();
+void depth_probe_packet(const struct sr_datafeed_packet* packet);
+void probe_sample_depths();
 
 bool stop_capture_sync();
 void restart_capture();
 
+class DataTransport;
+class FrameBuffer;
+extern std::shared_ptr<DataTransport> g_dataClient;
+extern std::atomic<bool> g_pendingAcquisition;
+std::shared_ptr<DataTransport> take_pending_client();
+void send_in_order(std::shared_ptr<DataTransport> client, std::shared_ptr<FrameBuffer> msg);
+
 void WaveformServerThread();
+void serve_data_client(std::shared_ptr<DataTransport> client);
+void SessionThread();
+extern std::atomic<bool> g_sessionReady;
+void disconnect_data_client();
 
 #endif // server_h
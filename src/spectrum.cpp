@@ -0,0 +1,353 @@
+
+#include "spectrum.h"
+#include "fft.h"
+#include "server.h"
+#include "threading.h"
+#include "DataTransport.h"
+#include "log/log.h"
+
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <condition_variable>
+#include <math.h>
+
+struct spectrum_job {
+	uint32_t seqnum;
+	std::vector<size_t> chnums;
+	std::vector<std::vector<uint8_t>> samples;
+	size_t num_samples;
+	int64_t samplerate_fs;
+};
+
+/**
+	@brief FFT plan plus window for one capture depth
+ */
+struct spectrum_setup {
+	spectrum_setup(size_t depth, size_t points);
+
+	FFTPlan plan;
+	std::vector<float> window;	// covers the samples actually used; the rest is zero padding
+	double window_sum;
+};
+
+spectrum_setup::spectrum_setup(size_t depth, size_t points)
+	: plan(points)
+	, window(std::min(depth, points))
+	, window_sum(0)
+{
+	// 4-term Blackman-Harris: sidelobes below the 8-bit ADC's noise floor
+	size_t n = window.size();
+	for (size_t i = 0; i < n; i++) {
+		double x = 2 * M_PI * i / (n - 1);
+		window[i] = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) - 0.01168 * cos(3 * x);
+		window_sum += window[i];
+	}
+}
+
+/**
+	@brief Owns the "fft" thread and everything it works on
+ */
+class SpectrumWorker
+{
+public:
+	~SpectrumWorker();
+
+	void Start();
+	bool Submit(uint32_t seqnum, const std::vector<size_t>& chnums,
+		const std::vector<const uint8_t*>& samples, size_t num_samples, int64_t samplerate_fs);
+	void NotifyAck();
+
+	std::atomic<uint32_t> m_average{1};
+	std::atomic<bool> m_resetRequested{false};
+	std::atomic<double> m_rate{0};
+
+protected:
+	void Run();
+	void Process(spectrum_job& job);
+	void Publish(spectrum_job& job, spectrum_setup& setup);
+	void TrySend();
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	bool m_stop = false;
+	bool m_jobReady = false;
+	bool m_acked = false;
+	spectrum_job m_next;
+
+	// Worker thread only
+	std::map<size_t, std::unique_ptr<spectrum_setup>> m_setups;	// by capture depth
+	std::vector<size_t> m_chnums;
+	size_t m_depth = 0;
+	int64_t m_samplerate_fs = 0;
+	std::vector<std::vector<double>> m_powerSum;
+	uint32_t m_captures = 0;
+	std::vector<float> m_volts;
+	std::vector<float> m_power;
+
+	// Last published spectrum, until it goes out, and the client whose transport allocated it
+	std::shared_ptr<FrameBuffer> m_unsent;
+	std::weak_ptr<DataTransport> m_unsentClient;
+
+	uint64_t m_rateStartMs = 0;
+	uint64_t m_rateFrames = 0;
+	uint64_t m_dropped = 0;
+};
+
+static std::atomic<bool> s_enabled{false};
+static SpectrumWorker s_worker;
+
+SpectrumWorker::~SpectrumWorker() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void SpectrumWorker::Start() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_thread.joinable())
+		m_thread = std::thread(&SpectrumWorker::Run, this);
+}
+
+/**
+	@brief Hand a capture to the worker, unless it is still busy with the previous one
+ */
+bool SpectrumWorker::Submit(uint32_t seqnum, const std::vector<size_t>& chnums,
+	const std::vector<const uint8_t*>& samples, size_t num_samples, int64_t samplerate_fs) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_jobReady) {
+		m_dropped++;
+		return false;
+	}
+
+	m_next.seqnum = seqnum;
+	m_next.chnums = chnums;
+	m_next.num_samples = num_samples;
+	m_next.samplerate_fs = samplerate_fs;
+	m_next.samples.resize(chnums.size());
+	for (size_t i = 0; i < chnums.size(); i++)
+		m_next.samples[i].assign(samples[i], samples[i] + num_samples);
+
+	m_jobReady = true;
+	m_wake.notify_one();
+	return true;
+}
+
+void SpectrumWorker::NotifyAck() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_acked = true;
+	m_wake.notify_one();
+}
+
+void SpectrumWorker::Run() {
+	apply_thread_policy("fft");
+
+	spectrum_job job;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		m_wake.wait(lock, [this] { return m_stop || m_jobReady || m_acked; });
+		if (m_stop)
+			return;
+
+		bool haveJob = m_jobReady;
+		if (haveJob) {
+			// Keep both jobs' buffers around so steady state does not allocate
+			std::swap(job, m_next);
+			m_jobReady = false;
+		}
+		m_acked = false;
+		lock.unlock();
+
+		if (haveJob)
+			Process(job);
+		TrySend();
+
+		lock.lock();
+	}
+}
+
+void SpectrumWorker::Process(spectrum_job& job) {
+	size_t points = 4;
+	while (points < job.num_samples && points < SPECTRUM_MAX_POINTS)
+		points *= 2;
+
+	// Plans are cheap to rebuild; don't keep one for every depth the client ever used
+	if (m_setups.size() > 8 && !m_setups.count(job.num_samples))
+		m_setups.clear();
+
+	auto& setup = m_setups[job.num_samples];
+	if (!setup)
+		setup.reset(new spectrum_setup(job.num_samples, points));
+
+	size_t bins = setup->plan.GetBins();
+
+	if (m_resetRequested.exchange(false) || job.chnums != m_chnums || job.num_samples != m_depth
+		|| job.samplerate_fs != m_samplerate_fs) {
+		m_chnums = job.chnums;
+		m_depth = job.num_samples;
+		m_samplerate_fs = job.samplerate_fs;
+		m_powerSum.assign(m_chnums.size(), std::vector<double>(bins, 0));
+		m_captures = 0;
+	}
+
+	m_volts.assign(points, 0);
+	m_power.resize(bins);
+
+	const std::vector<float>& window = setup->window;
+	for (size_t i = 0; i < m_chnums.size(); i++) {
+		float scale, offset;
+		compute_scale_and_offset(g_channels[m_chnums[i]], scale, offset);
+
+		const uint8_t* in = job.samples[i].data();
+		for (size_t j = 0; j < window.size(); j++)
+			m_volts[j] = (in[j] * scale - offset) * window[j];
+
+		setup->plan.Power(m_volts.data(), m_power.data());
+
+		std::vector<double>& sum = m_powerSum[i];
+		for (size_t k = 0; k < bins; k++)
+			sum[k] += m_power[k];
+	}
+
+	m_captures++;
+	if (m_captures >= m_average)
+		Publish(job, *setup);
+
+	m_rateFrames++;
+	uint64_t now = get_ms();
+	if (!m_rateStartMs) {
+		m_rateStartMs = now;
+	} else if (now - m_rateStartMs >= 10000) {
+		m_rate = m_rateFrames * 1000.0 / (now - m_rateStartMs);
+
+		uint64_t dropped;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			dropped = m_dropped;
+			m_dropped = 0;
+		}
+
+		LogDebug("Spectrum: %.1f captures/s transformed, %lu dropped while busy\n", m_rate.load(), dropped);
+		m_rateStartMs = now;
+		m_rateFrames = 0;
+	}
+}
+
+/**
+	@brief Turn the averaged power into a MESSAGE_SPECTRUM message, replacing any still unsent
+ */
+void SpectrumWorker::Publish(spectrum_job& job, spectrum_setup& setup) {
+	uint32_t bins = setup.plan.GetBins();
+	double bin_hz = 1e15 / m_samplerate_fs / setup.plan.GetPoints();
+
+	// A sine of amplitude A puts (A * window_sum / 2)^2 into its bin
+	double norm = 4 / (setup.window_sum * setup.window_sum) / m_captures;
+
+	std::shared_ptr<DataTransport> client = std::atomic_load(&g_dataClient);
+	if (!client) {
+		for (auto& sum : m_powerSum)
+			std::fill(sum.begin(), sum.end(), 0);
+		m_captures = 0;
+		return;
+	}
+
+	auto msg = client->Acquire(64 + m_chnums.size() * (sizeof(size_t) + bins * sizeof(float)));
+	msg->Put(MESSAGE_TAG);
+	msg->Put((uint8_t)MESSAGE_SPECTRUM);
+	msg->Put(job.seqnum);
+	msg->Put((uint16_t)m_chnums.size());
+	msg->Put(bins);
+	msg->Put(bin_hz);
+	msg->Put(m_captures);
+	msg->Put(m_rate.load());
+
+	for (size_t i = 0; i < m_chnums.size(); i++) {
+		msg->Put(m_chnums[i]);
+
+		float* db = (float*)msg->Append(bins * sizeof(float));
+		std::vector<double>& sum = m_powerSum[i];
+		for (size_t k = 0; k < bins; k++) {
+			db[k] = 10 * log10(sum[k] * norm + 1e-20);
+			sum[k] = 0;
+		}
+	}
+
+	m_captures = 0;
+	m_unsent = msg;
+	m_unsentClient = client;
+}
+
+void SpectrumWorker::TrySend() {
+	if (!m_unsent)
+		return;
+
+	std::shared_ptr<DataTransport> client = take_pending_client();
+	if (!client)
+		return;
+
+	// The buffer may be registered with (or live in) the old client's transport; never hand it to a
+	// new one, and leave the new client's request for the next frame
+	if (m_unsentClient.lock() != client) {
+		m_unsent = NULL;
+		g_pendingAcquisition = true;
+		return;
+	}
+
+	client->Send(m_unsent);
+	m_unsent = NULL;
+}
+
+/**
+	@brief Switch between spectrum and time domain frames
+ */
+void spectrum_set_enabled(bool enabled) {
+	if (enabled)
+		s_worker.Start();
+
+	s_worker.m_resetRequested = true;
+	s_enabled = enabled;
+}
+
+bool spectrum_enabled() {
+	return s_enabled;
+}
+
+/**
+	@brief Average power over `captures` captures per published spectrum
+ */
+void spectrum_set_average(uint32_t captures) {
+	s_worker.m_average = std::clamp<uint32_t>(captures, 1, SPECTRUM_MAX_AVERAGE);
+	s_worker.m_resetRequested = true;
+}
+
+uint32_t spectrum_get_average() {
+	return s_worker.m_average;
+}
+
+// Captures transformed per second over the last report interval
+double spectrum_rate() {
+	return s_worker.m_rate;
+}
+
+void spectrum_submit(uint32_t seqnum, const std::vector<size_t>& chnums,
+	const std::vector<const uint8_t*>& samples, size_t num_samples, int64_t samplerate_fs) {
+	if (num_samples < 2 || chnums.empty())
+		return;
+
+	s_worker.Submit(seqnum, chnums, samples, num_samples, samplerate_fs);
+}
+
+// The client asked for another frame; send the last spectrum if it hasn't gone out yet
+void spectrum_notify_ack() {
+	if (s_enabled)
+		s_worker.NotifyAck();
+}
@@ -0,0 +1,38 @@
+
+#ifndef spectrum_h
+#define spectrum_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+	Spectrum mode: instead of time domain frames, the client receives the windowed power spectrum
+	of each subscribed analog channel in dBV (amplitude of a sine in each bin). Captures are handed
+	to a worker thread ("fft") and dropped while it is busy, so the capture path never waits.
+	Power is optionally averaged over several captures before a spectrum is published.
+
+	Each spectrum answers one 'K' on the data socket, as a MESSAGE_SPECTRUM message:
+
+		u32 MESSAGE_TAG, u8 MESSAGE_SPECTRUM, u32 seqnum, u16 numchans, u32 bins, double bin_hz,
+		u32 captures averaged, double captures transformed per second, then per channel
+		size_t chnum, float dBV[bins]
+
+	Captures longer than SPECTRUM_MAX_POINTS are truncated; shorter ones are zero padded to a
+	power of two.
+ */
+
+static const size_t SPECTRUM_MAX_POINTS = 1 << 20;
+static const uint32_t SPECTRUM_MAX_AVERAGE = 65536;
+
+void spectrum_set_enabled(bool enabled);
+bool spectrum_enabled();
+void spectrum_set_average(uint32_t captures);
+uint32_t spectrum_get_average();
+double spectrum_rate();
+
+void spectrum_submit(uint32_t seqnum, const std::vector<size_t>& chnums,
+	const std::vector<const uint8_t*>& samples, size_t num_samples, int64_t samplerate_fs);
+void spectrum_notify_ack();
+
+#endif // spectrum_h
@@ -0,0 +1,303 @@
+
+#include "threading.h"
+#include "log/log.h"
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+struct thread_policy {
+	std::vector<int> cpus;	// empty = every CPU the bridge was started on
+	int fifo_priority = 0;	// 0 = SCHED_OTHER
+};
+
+struct thread_stats {
+	std::string name;
+	std::atomic<uint64_t> wakeups{0};
+	std::atomic<uint64_t> late{0};
+	std::atomic<uint64_t> worst_us{0};
+};
+
+// A wakeup this much later than requested counts as a scheduling delay
+static const uint64_t LATE_WAKEUP_US = 1000;
+
+static std::map<std::string, thread_policy> s_policies;
+
+static std::mutex s_statsMutex;
+static std::vector<std::unique_ptr<thread_stats>> s_stats;
+static thread_local thread_stats* t_stats = NULL;
+
+static std::atomic<uint64_t> s_lastReportMs{0};
+
+/**
+	@brief Monotonic time in microseconds
+ */
+uint64_t now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef __linux__
+/**
+	@brief The CPUs the bridge was started on, read before any thread policy is applied
+
+	Threads without a policy of their own are put back on these, so they do not inherit the
+	placement of whichever bridge thread happened to create them.
+ */
+static cpu_set_t default_cpus() {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &set);
+	}
+	return set;
+}
+
+static const cpu_set_t s_defaultCpus = default_cpus();
+#endif
+
+static bool parse_cpu_list(const std::string& list, std::vector<int>& cpus) {
+	if (list == "*")
+		return true;
+
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t comma = list.find(',', pos);
+		std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+
+		int first, last;
+		if (sscanf(item.c_str(), "%d-%d", &first, &last) != 2) {
+			if (sscanf(item.c_str(), "%d", &first) != 1)
+				return false;
+			last = first;
+		}
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+
+		if (comma == std::string::npos)
+			break;
+		pos = comma + 1;
+	}
+
+	return !cpus.empty();
+}
+
+static bool parse_policy_entry(std::string entry) {
+	// Trim whitespace and skip comments/blank lines
+	size_t start = entry.find_first_not_of(" \t\r\n");
+	if (start == std::string::npos || entry[start] == '#')
+		return true;
+	entry = entry.substr(start, entry.find_last_not_of(" \t\r\n") - start + 1);
+
+	size_t eq = entry.find('=');
+	if (eq == std::string::npos || eq == 0) {
+		LogError("Bad thread policy entry '%s' (expected <name>=<cpus>[@<priority>])\n", entry.c_str());
+		return false;
+	}
+
+	std::string name = entry.substr(0, eq);
+	std::string cpus = entry.substr(eq + 1);
+
+	thread_policy policy;
+
+	size_t at = cpus.find('@');
+	if (at != std::string::npos) {
+		policy.fifo_priority = atoi(cpus.c_str() + at + 1);
+		cpus = cpus.substr(0, at);
+
+		int maxprio = sched_get_priority_max(SCHED_FIFO);
+		int minprio = sched_get_priority_min(SCHED_FIFO);
+		if (policy.fifo_priority < minprio || policy.fifo_priority > maxprio) {
+			LogError("SCHED_FIFO priority for thread '%s' must be %d-%d\n", name.c_str(), minprio, maxprio);
+			return false;
+		}
+	}
+
+	if (!parse_cpu_list(cpus, policy.cpus)) {
+		LogError("Bad CPU list '%s' for thread '%s'\n", cpus.c_str(), name.c_str());
+		return false;
+	}
+
+	s_policies[name] = policy;
+	return true;
+}
+
+/**
+	@brief Parse a ';' separated list of thread policy entries, as given on the command line
+ */
+bool parse_thread_policy(const std::string& spec) {
+	size_t pos = 0;
+	for (;;) {
+		size_t semi = spec.find(';', pos);
+		if (!parse_policy_entry(spec.substr(pos, semi == std::string::npos ? std::string::npos : semi - pos)))
+			return false;
+
+		if (semi == std::string::npos)
+			return true;
+		pos = semi + 1;
+	}
+}
+
+/**
+	@brief Load thread policy entries from a file, one per line
+ */
+bool load_thread_policy(const std::string& path) {
+	std::ifstream in(path);
+	if (!in) {
+		LogError("Failed to open thread policy file %s\n", path.c_str());
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!parse_policy_entry(line))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Name the calling thread and apply its configured CPU affinity and priority
+
+	Once any policy is configured, a thread without an entry of its own gets default affinity and
+	scheduling, so it never runs with the placement of the thread that spawned it.
+
+	Failures (typically missing CAP_SYS_NICE or RLIMIT_RTPRIO) are reported and the thread carries
+	on with default scheduling.
+ */
+void apply_thread_policy(const char* name) {
+	{
+		// Threads that come and go with each client (e.g. "waveform") share one stats entry
+		std::lock_guard<std::mutex> lock(s_statsMutex);
+		t_stats = NULL;
+		for (auto& stats : s_stats) {
+			if (stats->name == name)
+				t_stats = stats.get();
+		}
+
+		if (!t_stats) {
+			s_stats.emplace_back(new thread_stats);
+			t_stats = s_stats.back().get();
+			t_stats->name = name;
+		}
+	}
+
+	#ifdef __linux__
+	char osname[16];
+	snprintf(osname, sizeof(osname), "bridge/%s", name);
+	pthread_setname_np(pthread_self(), osname);
+
+	// Nothing configured at all: leave every thread as the OS placed it
+	if (s_policies.empty())
+		return;
+
+	// Unconfigured threads and unconfigured parts of a policy go back to the defaults rather than
+	// keeping whatever the creating thread had
+	static const thread_policy none;
+	auto it = s_policies.find(name);
+	const thread_policy& policy = it == s_policies.end() ? none : it->second;
+
+	cpu_set_t set = s_defaultCpus;
+	if (!policy.cpus.empty()) {
+		CPU_ZERO(&set);
+		for (int cpu : policy.cpus)
+			CPU_SET(cpu, &set);
+	}
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0)
+		LogWarning("Could not pin thread '%s': %s\n", name, strerror(err));
+	else if (!policy.cpus.empty())
+		LogDebug("Pinned thread '%s' to %zu CPU(s)\n", name, policy.cpus.size());
+
+	sched_param param;
+	param.sched_priority = policy.fifo_priority;
+
+	err = pthread_setschedparam(pthread_self(), policy.fifo_priority ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (err != 0 && policy.fifo_priority)
+		LogWarning("Could not give thread '%s' SCHED_FIFO priority %d (%s), using default scheduling\n",
+			name, policy.fifo_priority, strerror(err));
+	else if (err != 0)
+		LogWarning("Could not reset scheduling of thread '%s': %s\n", name, strerror(err));
+	else if (policy.fifo_priority)
+		LogDebug("Thread '%s' now SCHED_FIFO priority %d\n", name, policy.fifo_priority);
+	#else
+	(void) name;
+	#endif
+}
+
+/**
+	@brief Lock current and future pages into RAM so hot paths never take major faults
+ */
+void lock_process_memory() {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		LogWarning("mlockall failed (%s), continuing without locked memory\n", strerror(errno));
+	else
+		LogDebug("Process memory locked\n");
+}
+
+/**
+	@brief usleep() that records how late the calling thread was woken
+ */
+void policed_usleep(uint64_t us) {
+	uint64_t start = now_us();
+	usleep(us);
+	note_wakeup(us, now_us() - start);
+}
+
+/**
+	@brief Record that the calling thread asked to sleep for `us` and actually woke after `elapsed`
+ */
+void note_wakeup(uint64_t us, uint64_t elapsed) {
+	if (t_stats) {
+		uint64_t delay = elapsed > us ? elapsed - us : 0;
+		t_stats->wakeups++;
+
+		if (delay > LATE_WAKEUP_US) {
+			t_stats->late++;
+
+			uint64_t worst = t_stats->worst_us;
+			while (delay > worst && !t_stats->worst_us.compare_exchange_weak(worst, delay))
+				;
+		}
+	}
+
+	report_sched_delays();
+}
+
+/**
+	@brief Log threads that saw late wakeups, at most once every 10 seconds
+ */
+void report_sched_delays() {
+	uint64_t now = now_us() / 1000;
+	uint64_t last = s_lastReportMs;
+	if (now - last < 10000 || !s_lastReportMs.compare_exchange_strong(last, now))
+		return;
+
+	std::lock_guard<std::mutex> lock(s_statsMutex);
+	for (auto& stats : s_stats) {
+		uint64_t late = stats->late.exchange(0);
+		uint64_t wakeups = stats->wakeups.exchange(0);
+		uint64_t worst = stats->worst_us.exchange(0);
+
+		if (late)
+			LogWarning("Thread '%s': %lu of %lu wakeups more than %lu us late (worst %lu us)\n",
+				stats->name.c_str(), late, wakeups, LATE_WAKEUP_US, worst);
+	}
+}
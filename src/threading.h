@@ -0,0 +1,32 @@
+
+#ifndef threading_h
+#define threading_h
+
+#include <stdint.h>
+#include <string>
+
+/*
+	Thread topology: every bridge thread calls apply_thread_policy() with its name when it starts
+	("scpi", "session", "waveform", ...). A policy entry for that name pins it to a CPU set and can
+	give it a SCHED_FIFO priority. Entries are written as
+
+		<name>=<cpu list>[@<fifo priority>]
+
+	e.g. "session=2@80;waveform=3@70;scpi=0-1", separated by ';' on the command line or one per
+	line in a file. A cpu list of '*' allows every CPU the bridge was started on. Bridge threads
+	without an entry run with that affinity and default scheduling; threads started by libraries
+	(libusb) inherit the policy of the bridge thread that starts them.
+ */
+
+bool parse_thread_policy(const std::string& spec);
+bool load_thread_policy(const std::string& path);
+void apply_thread_policy(const char* name);
+void lock_process_memory();
+
+uint64_t now_us();
+
+void policed_usleep(uint64_t us);
+void note_wakeup(uint64_t us, uint64_t elapsed);
+void report_sched_delays();
+
+#endif // threading_h
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "server.h"
+#include "averaging.h"
+
+/*
+	Averaging must line captures up on their trigger: two captures of the same edge whose trigger
+	phases round in different directions have to average to one edge, as steep as either capture,
+	crossing the trigger level where the averaged frame's trigphase says.
+ */
+
+static const size_t DEPTH = 64;
+static const size_t NOMINAL = 32;
+
+// A 50 code/sample ramp through code 128 at `crossing`, clamped to 28..228
+static std::vector<uint8_t> capture_edge(float crossing) {
+	std::vector<uint8_t> samples(DEPTH);
+	for (size_t i = 0; i < DEPTH; i++)
+		samples[i] = lroundf(std::min(228.f, std::max(28.f, 128 + 50 * (i - crossing))));
+	return samples;
+}
+
+int main()
+{
+	// Only the channel count is looked at; averaging keeps its state per channel index
+	g_channels.push_back(NULL);
+	std::vector<size_t> chnums = {0};
+
+	avg_set_count(2);
+
+	float phases[] = {-0.8f, -0.3f};
+	for (float trigphase : phases) {
+		std::vector<uint8_t> samples = capture_edge(NOMINAL + trigphase);
+
+		if (!avg_begin_frame(chnums, DEPTH, 1000000)) {
+			printf("FAIL: average complete after too few captures\n");
+			return 1;
+		}
+
+		avg_accumulate(0, samples.data(), DEPTH, trigphase, false);
+		avg_end_frame();
+	}
+
+	if (!avg_complete()) {
+		printf("FAIL: average not complete after two captures\n");
+		return 1;
+	}
+
+	std::vector<uint16_t> out(DEPTH);
+	avg_output(0, out.data());
+
+	std::vector<float> codes(DEPTH);
+	for (size_t i = 0; i < DEPTH; i++)
+		codes[i] = out[i] / 256.f;
+
+	// Where the average crosses 128, interpolated
+	float crossing = -1;
+	for (size_t i = 1; i < DEPTH; i++) {
+		if (codes[i - 1] < 128 && codes[i] >= 128) {
+			crossing = i - 1 + (128 - codes[i - 1]) / (codes[i] - codes[i - 1]);
+			break;
+		}
+	}
+
+	float expected = NOMINAL + avg_trigphase(0);
+	float slope = codes[NOMINAL + 1] - codes[NOMINAL];
+	printf("crossing %.3f, trigphase says %.3f, slope %.1f codes/sample\n", crossing, expected, slope);
+
+	if (fabsf(crossing - expected) > 0.05f) {
+		printf("FAIL: averaged edge is not at the reported trigger phase\n");
+		return 1;
+	}
+
+	if (fabsf(slope - 50) > 1) {
+		printf("FAIL: averaged edge is smeared\n");
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# Data plane load test against checked-in baselines: starts the bridge on the virtual-demo driver,
+# runs bridge-loadtest against it and fails if throughput or latency regressed.
+#
+#	loadtest.sh <scopehal-sigrok-bridge> <bridge-loadtest> <baseline file> [port]
+#
+# Exits 77 (reported by CTest as skipped) when the bridge cannot be started here, e.g. because
+# libsigrok4DSL or its virtual-demo driver is not installed.
+
+BRIDGE="$1"
+LOADTEST="$2"
+BASELINE="$3"
+PORT="${4:-15025}"
+SKIP=77
+
+if [ ! -x "$BRIDGE" ] || [ ! -x "$LOADTEST" ] || [ ! -f "$BASELINE" ]; then
+	echo "usage: $0 <bridge> <bridge-loadtest> <baseline> [port]"
+	exit 2
+fi
+
+LOG=$(mktemp)
+"$BRIDGE" --port "$PORT" --no-shm --sync-log virtual-demo >"$LOG" 2>&1 &
+BRIDGE_PID=$!
+trap 'kill $BRIDGE_PID 2>/dev/null; wait $BRIDGE_PID 2>/dev/null; rm -f "$LOG"' EXIT
+
+# Wait for the control plane to listen, or for the bridge to give up on the driver
+for i in $(seq 1 100); do
+	if ! kill -0 $BRIDGE_PID 2>/dev/null; then
+		echo "Bridge exited during startup; skipping:"
+		tail -n 20 "$LOG"
+		exit $SKIP
+	fi
+
+	if (exec 3<>"/dev/tcp/localhost/$PORT") 2>/dev/null; then
+		break
+	fi
+
+	sleep 0.1
+done
+
+if ! (exec 3<>"/dev/tcp/localhost/$PORT") 2>/dev/null; then
+	echo "Bridge did not start listening on port $PORT; skipping"
+	tail -n 20 "$LOG"
+	exit $SKIP
+fi
+
+"$LOADTEST" --port "$PORT" --warmup 1 --seconds 5 --baseline "$BASELINE"
+STATUS=$?
+
+if [ $STATUS -ne 0 ]; then
+	echo "Bridge log:"
+	tail -n 50 "$LOG"
+fi
+
+exit $STATUS